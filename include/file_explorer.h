@@ -1,6 +1,11 @@
 #include "types.h"
 #include "strings.h"
 #include <stdlib.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <linux/io_uring.h>
 
 typedef enum
 {
@@ -8,6 +13,9 @@ typedef enum
     SEARCH,
     NORMAL,
     VISUAL,
+    LIMIT,
+    JUMP,
+    FILTER,
 } Mode;
 
 typedef enum
@@ -16,12 +24,34 @@ typedef enum
     MOVE,
 } OperationType;
 
+// What copy_file carries over from the source besides the data
+typedef enum
+{
+    PRESERVE_MODE  = 1 << 0,
+    PRESERVE_OWNER = 1 << 1,
+    PRESERVE_TIMES = 1 << 2,
+    PRESERVE_XATTR = 1 << 3,
+    PRESERVE_ALL   = PRESERVE_MODE|PRESERVE_OWNER|PRESERVE_TIMES|PRESERVE_XATTR,
+} PreserveFlags;
+
+// A directory yanked from, shared by every operation yanked from it in a row so the queue holds
+// one fd per directory rather than one per line. Main thread only.
+typedef struct
+{
+    u32 refs;
+    int fd;
+} YankDir;
+
 typedef struct
 {
     OperationType type;
     b32 is_dir;
+    u32 preserve;
 
-    String *name;
+    // Interned, the operation holds a reference
+    u32 name;
+    // Source directory, the operation holds a reference. in_path is only kept for display and the journal.
+    YankDir *dir;
     String *in_path;
     String *out_path;
 } Operation;
@@ -35,22 +65,735 @@ typedef struct
     Operation *data;
 } OperationQueue;
 
+typedef void (*TaskFunction)(void*);
+
+typedef struct
+{
+    TaskFunction function;
+    void *data;
+} Task;
+
+// Which pool a job's tasks run on. Bulk workers are niced and in the lowest best effort
+// I/O class so they yield the disk to everything else on the machine.
+typedef enum
+{
+    PRIORITY_INTERACTIVE,
+    PRIORITY_BULK,
+    NUM_PRIORITIES,
+} Priority;
+
+// Fixed set of threads pulling Tasks off a growable ring, same layout as OperationQueue.
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t has_work;
+
+    u32 size;
+    u32 capacity;
+    u32 start;
+    u32 end;
+    Task *tasks;
+
+    u32 num_threads;
+    pthread_t *threads;
+    b32 shutdown;
+    Priority priority;
+} WorkerPool;
+
+// Token bucket shared by every thread working for a job. Callers take what they're about to
+// use and sleep off any debt, so the limits can change at any time. Zero means unlimited.
+typedef struct
+{
+    pthread_mutex_t lock;
+    atomic_ullong bytes_per_second;
+    atomic_ullong ops_per_second;
+    double byte_tokens;
+    double op_tokens;
+    struct timespec last_refill;
+} RateLimit;
+
+typedef enum
+{
+    IO_BACKEND_THREADS,
+    IO_BACKEND_URING,
+} IoBackend;
+
+// Minimal io_uring, one per thread. Everything is used in batches: queue up to depth
+// sqes, then ioring_run submits them together and waits for every completion.
+typedef struct
+{
+    int fd;
+    u32 depth;
+    u32 queued;
+
+    u32 *sq_head;
+    u32 *sq_tail;
+    u32 *sq_mask;
+    u32 *sq_array;
+    struct io_uring_sqe *sqes;
+
+    u32 *cq_head;
+    u32 *cq_tail;
+    u32 *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Registered with the kernel so reads and writes skip the per call page pinning
+    u8 *buffers;
+    u32 buffer_size;
+    u32 num_buffers;
+
+    // From IORING_REGISTER_PROBE, ioring_prep refuses anything the kernel doesn't know
+    b32 supported[IORING_OP_LAST];
+    // io_uring_enter failed with sqes still in flight, their completions could land in any later
+    // run so the ring is never used again
+    b32 dead;
+} IoRing;
+
+typedef enum
+{
+    JOB_DELETE,
+    JOB_COPY,
+} JobType;
+
+// Open addressed set of relative paths, the files a resumed copy can skip
+typedef struct
+{
+    u32 count;
+    u32 capacity;
+    char **entries;
+} PathSet;
+
+// A destination file or directory the next journal commit has to fdatasync()
+typedef struct
+{
+    int fd;
+    dev_t dev;
+    ino_t ino;
+} JournalSync;
+
+// Write ahead log of pastes. Records are buffered and group committed by a thread of its own: an
+// fdatasync() of every destination file and directory written since the last commit, then one write
+// and fdatasync() of the log. Nobody else waits on that unless they need a record on disk.
+// Record format is "<tag> <id>" followed by " <length>:<bytes>" fields and a newline.
+//   B id type preserve src_dir name dst_dir   paste began, type is c or m, committed straight away
+//   I id path                                 about to copy path, relative to dst_dir
+//   C id path                                 path is copied
+//   M id                                      move's copy is complete, source gets deleted next
+//   E id                                      paste finished or was rolled back
+typedef struct
+{
+    pthread_mutex_t lock;
+    int fd;
+    u64 next_id;
+    // Pastes begun and not yet ended, the log is truncated whenever this gets back to zero
+    u32 active;
+
+    char *buffer;
+    u32 length;
+    u32 capacity;
+    u32 records;
+    struct timespec oldest;
+    JournalSync *syncs;
+    u32 num_syncs;
+    u32 sync_capacity;
+
+    pthread_t committer;
+    // wake tells the committer there's something buffered, progress is broadcast whenever it takes
+    // the buffer or finishes a commit
+    pthread_cond_t wake;
+    pthread_cond_t progress;
+    b32 commit_requested;
+    // Commits taken and finished so far. Records appended now go out in commit taken + 1.
+    u64 taken;
+    u64 committed;
+} Journal;
+
+// One paste read back from the journal at startup
+typedef struct
+{
+    u64 id;
+    char type;
+    u32 preserve;
+    char *src_dir;
+    char *name;
+    char *dst_dir;
+    b32 copied;
+    b32 ended;
+    PathSet completed;
+} JournalEntry;
+
+// Counters dumped to $FILE_EXPLORER_STATS on exit
+typedef struct
+{
+    atomic_ullong journal_records;
+    atomic_ullong journal_commits;
+    atomic_ullong journal_commit_ns;
+    // Entering a directory, whether its listing was cached and if so whether a prefetch put it there
+    atomic_ullong listing_hits;
+    atomic_ullong listing_misses;
+    atomic_ullong prefetch_hits;
+    atomic_ullong prefetches_started;
+    atomic_ullong prefetches_cancelled;
+    // Allocations served by arenas and slabs, and how many of them needed a malloc behind them
+    atomic_ullong arena_allocs;
+    atomic_ullong arena_mallocs;
+    atomic_ullong slab_allocs;
+    atomic_ullong slab_mallocs;
+    // Names a filter ran its DFA over, and ones whose verdict carried over from the last listing
+    atomic_ullong filter_runs;
+    atomic_ullong filter_reuses;
+    // Files flat walks listed, and entries they skipped because of ignore rules
+    atomic_ullong flat_files;
+    atomic_ullong flat_ignored;
+    // Directories tree views opened, and how many of those had to be read on the pool
+    atomic_ullong tree_opens;
+    atomic_ullong tree_reads;
+    // Calls to malloc, calloc and realloc anywhere in the process. Main loop iterations, and how
+    // many of those made any on the main thread.
+    atomic_ullong mallocs;
+    atomic_ullong frames;
+    atomic_ullong frames_with_mallocs;
+    // Calls to load_directory and exec_search and the allocations they made between them
+    atomic_ullong loads;
+    atomic_ullong load_mallocs;
+    atomic_ullong searches;
+    atomic_ullong search_mallocs;
+} Stats;
+
+// Bump allocator for scratch data that all dies at once. Blocks are chained when one fills up and
+// merged into a single block on reset, so once it has grown to fit, a reset leaves nothing to malloc.
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    u64 capacity;
+    u64 used;
+    char data[];
+} ArenaBlock;
+
+typedef struct
+{
+    ArenaBlock *blocks;
+    u64 block_size;
+} Arena;
+
+// Fixed size items carved out of chunks and recycled through a free list. Chunks are kept for the
+// life of the process. Main thread only.
+typedef struct
+{
+    u32 item_size;
+    void *free_list;
+} Slab;
+
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    // Where the first copy went, relative to the copy's destination directory
+    char *path;
+} InodeLink;
+
+// Open addressed (dev, ino) set of every multiply linked file a copy has seen, so later
+// links to the same inode become linkat()s instead of another copy of the data.
+typedef struct
+{
+    pthread_mutex_t lock;
+    u32 count;
+    u32 capacity;
+    InodeLink *entries;
+} InodeMap;
+
+// Identifies a directory independent of the path it was reached by
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+} DirId;
+
+// A background operation. Workers only ever touch the atomic counters and set done last,
+// the main thread owns everything else and frees the job once it sees done.
+typedef struct Job
+{
+    JobType type;
+    // Directory the job changes, buffers showing it are reloaded when the job finishes
+    DirId directory;
+
+    atomic_ullong files_done;
+    atomic_ullong dirs_done;
+    atomic_ullong bytes_done;
+    atomic_ullong bytes_saved;
+    atomic_ullong errors;
+    atomic_int done;
+
+    RateLimit limit;
+    atomic_int priority;
+
+    // Copies only
+    u32 preserve;
+    int dst_root_fd;
+    InodeMap links;
+    // Set for cross device moves, the source is deleted once everything copied cleanly
+    b32 move;
+    DirId source_directory;
+    // Nonzero when the job is a journaled paste
+    u64 journal_id;
+    // Commit that puts the paste's B record on disk, nothing is written to the destination before it
+    u64 journal_commit;
+    // Resumed copies skip these, and tolerate what a crash left behind for everything else
+    PathSet *completed;
+
+    struct Job *next;
+} Job;
+
+// One directory being removed. pending counts the node's own listing pass plus every child
+// directory not yet removed, whoever drops it to zero removes the directory and walks up.
+typedef struct DeleteNode
+{
+    struct DeleteNode *parent;
+    Job *job;
+    int fd;
+    atomic_uint pending;
+    char name[];
+} DeleteNode;
+
+// Files picked directly in a buffer, unlinked by one task on the pool so a big selection never
+// holds up the main thread. Holds a pending count on root like a child directory would.
+typedef struct
+{
+    DeleteNode *root;
+    u32 count;
+    // count names, each null terminated
+    char *names;
+} DeleteFiles;
+
+// Per mount trash directory. Items are renamed in so trashing never leaves the filesystem.
+typedef struct
+{
+    dev_t dev;
+    int fd;
+} TrashDir;
+
+// Something trashed this session. trash_name is prefixed with the time it was trashed
+// which is all the purger needs to decide when it can be reclaimed.
+typedef struct
+{
+    u32 trash_index;
+    String *trash_name;
+    // Where it came from, held open so restoring doesn't depend on the path
+    int dir_fd;
+    String *name;
+} TrashEntry;
+
+// Mirror of DeleteNode but top down: a directory is copied by its own task and gets its
+// metadata applied once pending says every child directory has been filled in.
+typedef struct CopyNode
+{
+    struct CopyNode *parent;
+    Job *job;
+    int src_fd;
+    int dst_fd;
+    atomic_uint pending;
+    struct statx source;
+    // Relative to the job's destination directory
+    char *path;
+    char name[];
+} CopyNode;
+
+typedef enum
+{
+    COPY_HAVE_SOURCE = 1 << 0,
+    COPY_DST_EXISTS  = 1 << 1,
+} CopyFlags;
+
+typedef enum
+{
+    META_NONE,
+    META_PENDING,
+    META_DONE,
+} MetaState;
+
+// A filename stored once for every listing, search result and operation referring to it, and
+// referred to by a 32 bit id. Equal names have equal ids. text is null terminated, either in its
+// inline buffer or in chars right after the struct.
+typedef struct
+{
+    String text;
+    u32 hash;
+    u32 refs;
+    // Next id in the same hash bucket
+    u32 next;
+    char chars[];
+} Name;
+
+typedef enum
+{
+    LINE_DIR = 1 << 0,
+} LineFlags;
+
+typedef enum
+{
+    SORT_NAME,
+    SORT_NATURAL,
+    SORT_EXTENSION,
+    SORT_SIZE,
+    SORT_MTIME,
+    SORT_USAGE,
+    NUM_SORTS,
+} SortMode;
+
+// One read of a directory, shared by every buffer, search and cache entry showing it. Lines are in
+// name order with directories first, a buffer showing them some other way keeps its own order of
+// line indices. A refresh reads a new listing and moves the viewers over to it, so past the read only
+// the lazily filled metadata, usage and sort keys are written. Flat listings are the exception,
+// their walk or tree view keeps appending lines in whatever order it finds them.
+typedef struct Listing
+{
+    DirId id;
+    // The directory's mtime when it was read, a cached listing is only reused while it matches
+    struct timespec mtime;
+    u32 refs;
+    b32 metadata_requested;
+    b32 usage_requested;
+    // Read ahead by a prefetch and not entered yet
+    b32 prefetched;
+    // Lines are paths relative to the directory, appended by a flat view's walk or a tree view
+    // opening directories. Never cached or shared between buffers.
+    b32 flat;
+    u32 num_lines;
+    // Lines and blob bytes the columns have room for, only tracked for flat listings
+    u32 capacity;
+    u32 blob_size;
+    u32 blob_capacity;
+    // All lines before this index are directories
+    u32 files_start;
+
+    // A column per field, indexed by line, lines in name order. Names are packed null terminated
+    // into blob in the same order so scans over them are linear. The interned id is what identifies
+    // a line across listings. Flat listings have no names column, their lines are only the paths in
+    // blob, so a walk doesn't take the names lock or keep a second copy of every path.
+    char *blob;
+    u32 *offsets;
+    u16 *lengths;
+    u8 *flags;
+    u32 *names;
+    // Metadata columns, allocated by listing_add_metadata the first time they're needed. A line's
+    // are only valid once its meta_state is META_DONE.
+    u8 *meta_state;
+    u16 *modes;
+    u32 *uids;
+    u64 *sizes;
+    i64 *mtimes;
+    // Directories only, recursive disk usage once usage_state is META_DONE
+    u8 *usage_state;
+    u64 *usages;
+    // Shared by every usage request on the listing. usage_pending of refs are results still to come
+    // back from it, once those are all that's left nobody can see them and the walk is cancelled.
+    struct UsageWalk *usage_walk;
+    u32 usage_pending;
+
+    // Packed per line sort keys, built the first time a mode is used. The top bit keeps directories
+    // first so a single radix sort over the keys gives the whole order.
+    u64 *keys[NUM_SORTS];
+
+    // Where the last buffer to leave it had its cursor, as a line and its row on screen
+    u32 saved_line;
+    u32 saved_row;
+
+    // Position in the listing cache, most recently used first
+    b32 cached;
+    u64 cached_bytes;
+    struct Listing *newer;
+    struct Listing *older;
+} Listing;
+
+// A multiply linked file directly in a cached directory, kept so hardlinks are still counted once
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    u64 bytes;
+} UsageLink;
+
+// What a directory contributes to disk usage by itself, not counting subdirectories, and the names
+// of those subdirectories. Valid while the directory's mtime is unchanged.
+typedef struct UsageEntry
+{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    u64 own;
+    u32 num_links;
+    UsageLink *links;
+    // Subdirectory names, each null terminated
+    u32 num_subdirs;
+    u32 subdirs_size;
+    char *subdirs;
+
+    // Position in the usage cache, most recently used first
+    u64 cached_bytes;
+    struct UsageEntry *newer;
+    struct UsageEntry *older;
+} UsageEntry;
+
+// Open addressed by dev and ino, with the same LRU order and byte budget as the listing cache
+typedef struct
+{
+    pthread_mutex_t lock;
+    u32 count;
+    u32 capacity;
+    UsageEntry **slots;
+    UsageEntry *newest;
+    UsageEntry *oldest;
+    u64 bytes;
+} UsageCache;
+
+// Shared by a listing and the root node of every usage request on it, whichever lets go last frees it
+typedef struct UsageWalk
+{
+    // Directories not measured yet are skipped once it's set
+    atomic_int cancelled;
+    atomic_uint refs;
+    // Only membership matters, the paths are all the same empty string
+    InodeMap links;
+} UsageWalk;
+
+// One directory being measured. Like DeleteNode, pending counts the node's own pass plus every
+// child not finished yet, whoever drops it to zero adds the node's total into its parent's.
+typedef struct UsageNode
+{
+    struct UsageNode *parent;
+    UsageWalk *walk;
+    int fd;
+    atomic_uint pending;
+    atomic_ullong total;
+    // Children of the walk's root report their total for this line of listing
+    Listing *listing;
+    u32 line;
+    char name[];
+} UsageNode;
+
+// A directory read ahead of the user entering it. The worker owns it until it's on the done list,
+// cancelled only tells it to stop early.
+typedef struct Prefetch
+{
+    int dir_fd;
+    atomic_int cancelled;
+    Listing *listing;
+    struct Prefetch *next;
+    char name[];
+} Prefetch;
+
+typedef struct UsageResult
+{
+    Listing *listing;
+    u32 line;
+    u64 total;
+    struct UsageResult *next;
+} UsageResult;
+
+// Filters are compiled to a Thompson NFA over byte sets first, then to a DFA
+typedef enum
+{
+    NFA_SET,
+    NFA_SPLIT,
+    NFA_EMPTY,
+    NFA_MATCH,
+} NfaType;
+
+typedef struct
+{
+    NfaType type;
+    // NFA_SET's byte set, out is followed on a byte in it. NFA_SPLIT follows both out and out1.
+    u32 set;
+    u32 out;
+    u32 out1;
+} NfaState;
+
+// A piece of the NFA being built, end is an NFA_EMPTY whose out is still to be joined up
+typedef struct
+{
+    u32 start;
+    u32 end;
+} NfaFragment;
+
+typedef struct
+{
+    const char *text;
+    u32 length;
+    u32 at;
+    b32 error;
+
+    NfaState *states;
+    u32 num_states;
+    u32 states_capacity;
+    // 256 bit byte sets, four words each
+    u64 *sets;
+    u32 num_sets;
+    u32 sets_capacity;
+} FilterParser;
+
+// A glob, or a regular expression after a leading '/', compiled to a DFA. Bytes no set in the
+// pattern tells apart share a class so a state's row is num_classes wide. State 0 is dead and
+// 1 is the start.
+typedef struct Filter
+{
+    String *pattern;
+    u8 classes[256];
+    u32 num_classes;
+    u32 num_states;
+    u32 *transitions;
+    u8 *accepting;
+
+    // Which lines of listing it keeps. The listing is held so the next one it runs over only
+    // needs the names this one didn't have.
+    Listing *listing;
+    u32 num_lines;
+    u8 *verdicts;
+} Filter;
+
+// Some of a listing's lines for one task to run a filter over
 typedef struct
 {
-    String *text;
-    u8 is_dir;
-} Line;
+    Filter *filter;
+    Listing *listing;
+    u32 *lines;
+    u32 count;
+    u8 *verdicts;
+} FilterChunk;
+
+// A filter run split across the pool. Every thread in it claims chunks through next until there
+// are none left, so the one that started it only ever waits for chunks already being run. Shared
+// by it and the pool's tasks, whichever lets go last frees it.
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    atomic_uint refs;
+    atomic_uint next;
+    // Under lock
+    u32 finished;
+    u32 num_chunks;
+    FilterChunk chunks[];
+} FilterRun;
+
+typedef enum
+{
+    // Written with a leading !, un-ignores what an earlier pattern ignored
+    IGNORE_NEGATE   = 1 << 0,
+    // Written with a trailing /, only matches directories
+    IGNORE_DIR      = 1 << 1,
+    // Written with a / before the end, matches the path from the .gitignore's directory
+    IGNORE_ANCHORED = 1 << 2,
+} IgnoreFlags;
+
+// The patterns of one directory's .gitignore, chained to those of the directories above it.
+// Shared by every node below it that doesn't have a .gitignore of its own.
+typedef struct IgnoreRules
+{
+    struct IgnoreRules *parent;
+    atomic_uint refs;
+    // Anchored patterns match a node's path from this many bytes in
+    u32 base;
+    u32 count;
+    Filter **filters;
+    u8 *flags;
+} IgnoreRules;
+
+// Paths a walker found, packed like a listing's blob so the main thread appends them in one copy
+typedef struct FlatBatch
+{
+    u32 count;
+    u32 size;
+    u32 capacity;
+    char *blob;
+    u16 *lengths;
+    struct FlatBatch *next;
+} FlatBatch;
+
+// Shared by a flat view's buffer and the walk's root node, whichever lets go last frees it
+typedef struct FlatWalk
+{
+    atomic_int cancelled;
+    atomic_uint refs;
+    // Files handed over so far, the walk stops at FLAT_MAX_LINES and sets truncated
+    atomic_uint found;
+    atomic_int truncated;
+    atomic_int finished;
+    // Main thread only, whether it's still counted in global_flat_walks
+    b32 active;
+    // Levels below the directory to list, 0 for no limit
+    u32 max_depth;
+    b32 hidden;
+    b32 ignore;
+    pthread_mutex_t lock;
+    // Newest first, poll_flat turns them round
+    FlatBatch *done;
+} FlatWalk;
+
+// One directory of a flat walk. Like UsageNode, pending counts its own pass plus every child not
+// finished yet, so its fd stays open while children still open theirs relative to it.
+typedef struct FlatNode
+{
+    struct FlatNode *parent;
+    FlatWalk *walk;
+    int fd;
+    atomic_uint pending;
+    u32 depth;
+    IgnoreRules *rules;
+    // Path from the walk's directory, name is where its last component starts
+    u32 name;
+    u32 length;
+    char path[];
+} FlatNode;
+
+typedef enum
+{
+    // Its children are in the tree's listing from first_child on
+    TREE_LOADED  = 1 << 0,
+    TREE_LOADING = 1 << 1,
+    // Its children show whenever it does
+    TREE_OPEN    = 1 << 2,
+} TreeFlags;
+
+// Indexed by line of a tree view's listing. A directory's children are appended together the first
+// time it opens and kept when it closes, so opening it again only splices rows into the order.
+typedef struct TreeView
+{
+    // The buffer's and one per load in flight, main thread only
+    u32 refs;
+    // The directory's own entries are the first lines
+    u32 num_top;
+    u32 capacity;
+    u16 *depths;
+    // TREE_ROOT for the directory's own entries
+    u32 *parents;
+    u32 *first_child;
+    u32 *num_children;
+    u8 *state;
+} TreeView;
 
+// A line and its sort key, for sorting a few siblings on their own
 typedef struct
 {
-    String *text;
-    u32 original_line_number;
-    u8 is_dir;
-    u64 color_mask;
-} Result;
+    u64 key;
+    u32 line;
+} KeyedLine;
+
+// Reads a directory a tree view opened that wasn't cached
+typedef struct TreeLoad
+{
+    TreeView *tree;
+    u32 line;
+    int dir_fd;
+    Listing *listing;
+    struct TreeLoad *next;
+    char path[];
+} TreeLoad;
+
 
 typedef struct
 {
+    // Everything is done relative to dir_fd, current_directory is only for display
+    int dir_fd;
     String *current_directory;
 
     // x, y coordinates of the top left of the buffer
@@ -70,9 +813,79 @@ typedef struct
     // should always be view_range_start + height - 1 because first row is for the title
     u32 view_range_end;
 
-    Line *buffer;
+    Listing *listing;
+    SortMode sort;
+    // Lines the filter hides aren't in order at all, NULL shows everything
+    Filter *filter;
+    // Indices of the listing's lines in the order this buffer shows them
+    u32 *order;
+    // Fills a flat listing, kept after it finishes to tell whether it stopped short
+    struct FlatWalk *walk;
+    // Set while the buffer is a tree view, its listing is then the tree's
+    struct TreeView *tree;
+
+    // The leaf of the layout holding this buffer
+    struct Tile *tile;
 } Buffer;
 
+typedef enum
+{
+    TILE_PANE,
+    // Side by side with a separator column between them
+    TILE_VERTICAL,
+    // One above the other, the top pane's status row separates them
+    TILE_HORIZONTAL,
+} TileType;
+
+// The screen is a binary tree of splits with a buffer in every leaf. Each tile remembers the area
+// it was last laid out in so a layout pass only descends into and repaints what actually moved.
+typedef struct Tile
+{
+    TileType type;
+    struct Tile *parent;
+    // Splits only, first being the left or top one. ratio is first's share of the area out of 1024.
+    struct Tile *first;
+    struct Tile *second;
+    u32 ratio;
+    // Panes only
+    Buffer *buffer;
+    // Including a pane's margins and status row
+    u32 x;
+    u32 y;
+    u32 width;
+    u32 height;
+} Tile;
+
+// Directory fd shared by every batch of one request, closed by whoever drops the last reference
+typedef struct
+{
+    int fd;
+    atomic_uint refs;
+} StatDir;
+
+// A run of a listing's lines stat'd together on the pool. Workers only fill in results, the main
+// thread copies them into the listing, which the batch holds a reference to.
+typedef struct StatBatch
+{
+    Listing *listing;
+    StatDir *dir;
+    u32 count;
+    u32 *lines;
+    char **names;
+    // Copies of a flat listing's lines, its blob can move while the batch is out
+    char *paths;
+    i32 *status;
+    struct statx *results;
+    struct StatBatch *next;
+} StatBatch;
+
+// A run of matched characters in a search result
+typedef struct
+{
+    u16 start;
+    u16 length;
+} MatchSpan;
+
 // NOTE(Luke): Remember this buffer should only contain strings also stored in the main buffer
 // so don't free them twice!
 typedef struct
@@ -96,7 +909,10 @@ typedef struct
     // should always be view_range_start + height
     u32 view_range_end;
 
-    Result *buffer;
+    // Matching lines of listing, which is held so they stay valid if the buffer is reloaded mid
+    // search. Which characters matched is only worked out for the visible ones when drawing.
+    Listing *listing;
+    u32 *matches;
 } SearchBuffer;
 
 OperationQueue *queue_new(u32 capacity)
@@ -144,13 +960,43 @@ void enqueue(OperationQueue *op, Operation operation)
     }
 }
 
-void reallocate_buffer(Buffer*);
-void reallocate_search_buffer(SearchBuffer*);
 void panic(const char *error);
+u32 name_hash(const char*, u32);
+u32 name_intern(const char*, u32);
+void name_retain(u32);
+void name_release(u32);
+String *name_string(u32);
+void *arena_alloc(Arena*, u64);
+void arena_reset(Arena*);
+String *arena_string(Arena*, const char*);
+void *slab_alloc(Slab*);
+void slab_free(Slab*, void*);
+String *slab_string(Slab*, String*);
+void slab_string_free(Slab*, String*);
 void draw_vertical_line(u32, u32, u32);
-u64 search_test(String*, String*);
+b32 search_test(const char*, u32, String*, MatchSpan*, u32*);
+u32 nfa_state(FilterParser*, NfaType, u32, u32, u32);
+u32 nfa_set(FilterParser*);
+void nfa_set_add(FilterParser*, u32, u8);
+NfaFragment nfa_fragment(FilterParser*, u32);
+NfaFragment nfa_repeat(FilterParser*, NfaFragment, char);
+NfaFragment nfa_concatenate(FilterParser*, NfaFragment, NfaFragment);
+NfaFragment parse_alternation(FilterParser*, b32);
+u32 glob_to_regex(const char*, u32, char*);
+Filter *filter_compile(String*);
+Filter *filter_build(FilterParser*, u32);
+b32 filter_match(Filter*, const char*, u32);
+void filter_chunk(FilterChunk*);
+void filter_claim(FilterRun*);
+void filter_run_release(FilterRun*);
+void filter_task(void*);
+void filter_listing(Filter*, Listing*);
+b32 filter_keeps(Filter*, Listing*, u32);
+void filter_free(Filter*);
+void apply_filter(Buffer*, String*);
 void exec_search(Buffer*, SearchBuffer*, String*);
 void background(u16);
+b32 buffer_hidden(Buffer*);
 void clear_normal_buffer_area(Buffer*);
 void clear_search_buffer_area(SearchBuffer*, u32);
 void update_screen(Buffer*);
@@ -159,12 +1005,155 @@ void update_search_screen(SearchBuffer*);
 void draw_search_overlay(Buffer*, SearchBuffer*);
 int pop_directory(String*);
 void push_directory(String*, String*);
-void load_directory(char*, Buffer*);
-void init_buffer(Buffer*, u32, u32, u32, u32, String*);
+void load_directory(Buffer*);
+Listing *listing_read(int, atomic_int*);
+void name_sort(u32*, u32*, u32, char*, u32*, u16*);
+void listing_release(Listing*);
+i32 natural_compare(const char*, u32, const char*, u32);
+void listing_add_metadata(Listing*);
+u64 *listing_keys(Listing*, SortMode);
+void radix_sort(u32*, u64*, u32);
+void sort_buffer(Buffer*);
+void set_listing(Buffer*, Listing*);
+u32 listing_find(Listing*, u32);
+u32 listing_prefix_find(Listing*, u32, u32, const char*, u32);
+b32 jump_to_prefix(Buffer*, String*);
+u64 listing_bytes(Listing*);
+void listing_cache_remove(Listing*);
+void listing_cache_insert(Listing*);
+Listing *listing_cache_find(int);
+Listing *listing_cache_lookup(dev_t, ino_t);
+u64 monotonic_ms(void);
+void prefetch_task(void*);
+void cancel_prefetches(void);
+void update_prefetch(Buffer*);
+void poll_prefetches(void);
+u32 line_at(Buffer*, u32);
+void init_buffer(Buffer*, u32, u32, u32, u32, Buffer*);
+void change_directory(Buffer*, const char*);
+DirId dir_id(int);
+b32 directory_inside(int, dev_t, ino_t);
 void scroll(Buffer*, i32);
 void search_scroll(SearchBuffer*);
 void jump_to_line(Buffer*, u32);
 void draw_text(String*, u32, u32);
 void clear_text(u32, u32, u32);
-void vertical_split(Buffer*);
-void copy_file(String*, String*);
+void place_buffer(Tile*);
+void layout_tile(Tile*, u32, u32, u32, u32);
+void split_buffer(Buffer*, TileType);
+b32 copy_file_at(int, const char*, int, const char*, u32, struct statx*, u32, RateLimit*);
+b32 copy_metadata(int, int, struct statx*, u32);
+void pool_init(WorkerPool*, u32, Priority);
+void pool_submit(WorkerPool*, TaskFunction, void*);
+void pool_shutdown(WorkerPool*);
+Job *job_new(JobType, DirId);
+void poll_jobs(void);
+void draw_job_status(Buffer*);
+IoRing *ioring_get(void);
+struct io_uring_sqe *ioring_prep(IoRing*, u8, int, u64);
+void ioring_run(IoRing*, i32*);
+b32 ioring_copy(IoRing*, int, int, u64, RateLimit*);
+void rate_limit_init(RateLimit*, u64, u64);
+void rate_limit_take(RateLimit*, u64, u64);
+u64 parse_size(const char*, char**);
+Job *oldest_job(void);
+void apply_limit_command(Buffer*, String*);
+void delete_node_task(void*);
+void delete_node_finish(DeleteNode*);
+void delete_flush(Job*, IoRing*, u32);
+void delete_unlink(Job*, IoRing*, int, const char*, u32*);
+void delete_files_task(void*);
+void delete_spawn(DeleteNode*, const char*);
+void start_delete_job(Buffer*, u32, u32);
+InodeLink *inode_map_find(InodeMap*, dev_t, ino_t);
+void inode_map_insert(InodeMap*, dev_t, ino_t, char*);
+void copy_entry(CopyNode*, const char*, struct statx*);
+void copy_node_finish(CopyNode*);
+void copy_spawn(CopyNode*, const char*);
+void copy_node_task(void*);
+YankDir *yank_dir(OperationQueue*, int);
+void yank_dir_release(YankDir*);
+void start_paste_job(Buffer*, Operation*);
+Job *start_copy_job(int, int, const char*, u32, b32, u64, u64, PathSet*);
+void delete_into_job(Job*, int, const char*);
+u32 path_hash(const char*);
+void path_set_insert(PathSet*, char*);
+b32 path_set_contains(PathSet*, const char*);
+void path_set_free(PathSet*);
+void journal_open(void);
+void *journal_committer(void*);
+void journal_wait(u64);
+void journal_flush(void);
+void journal_sync_locked(int);
+void journal_sync(int);
+u64 journal_record(char, u64, const char**, u32, int, int, b32);
+u64 journal_begin(char, u32, String*, const char*, String*, u64*);
+void journal_end(u64);
+u32 journal_read(JournalEntry**);
+void journal_recover(Buffer*);
+void write_stats(void);
+void reload_buffers(DirId);
+void format_size(u64, char*, size_t);
+void draw_metadata(Buffer*, u32, u16);
+void draw_title(Buffer*);
+void stat_batch_task(void*);
+void submit_stat_batch(Listing*, StatDir*, u32*, u32, Priority);
+void request_metadata(Buffer*);
+void poll_metadata(void);
+void metadata_changed(Listing*);
+void listing_metadata_stale(Listing*);
+u32 usage_hash(dev_t, ino_t);
+void usage_cache_unlink(UsageEntry*);
+void usage_cache_push(UsageEntry*);
+void usage_cache_remove(UsageEntry*);
+UsageEntry *usage_cache_find(dev_t, ino_t);
+void usage_cache_store(UsageEntry*);
+void usage_walk_release(UsageWalk*);
+void usage_cancel(Listing*);
+void usage_node_finish(UsageNode*);
+void usage_spawn(UsageNode*, const char*, Listing*, u32);
+void usage_node_task(void*);
+void request_usage(Buffer*);
+IgnoreRules *ignore_read(int, IgnoreRules*, u32);
+void ignore_release(IgnoreRules*);
+b32 ignore_match(IgnoreRules*, const char*, u32, b32);
+FlatBatch *flat_batch_new(void);
+void flat_batch_add(FlatBatch*, const char*, u32);
+void flat_batch_free(FlatBatch*);
+void flat_push(FlatWalk*, FlatBatch*);
+void flat_walk_release(FlatWalk*);
+void flat_node_finish(FlatNode*);
+void flat_spawn(FlatNode*, const char*, u32, u32);
+void flat_node_task(void*);
+void listing_grow(Listing*, u32);
+void flat_append(Listing*, FlatBatch*);
+void append_rows(Buffer*, u32);
+void start_flat_view(Buffer*);
+void stop_flat_view(Buffer*);
+b32 poll_flat(void);
+void listing_reserve(Listing*, u32, u32);
+void listing_appended(Listing*);
+Listing *flat_listing_new(int);
+void tree_reserve(TreeView*, u32);
+void tree_release(TreeView*);
+void tree_add_children(Buffer*, u32, Listing*);
+int compare_keyed_lines(const void*, const void*);
+u32 tree_rows(Buffer*, u32, u32, u64*, u32*);
+void tree_order(Buffer*);
+u32 tree_row(Buffer*, u32);
+void tree_show_children(Buffer*, u32);
+void tree_hide_children(Buffer*, u32);
+void tree_load_task(void*);
+void tree_toggle(Buffer*, u32);
+void start_tree_view(Buffer*);
+void stop_tree_view(Buffer*);
+void poll_tree(void);
+u32 draw_tree_indent(Buffer*, u32, u32, const char**, u32*);
+void resort_buffer(Buffer*);
+const char *owner_name(u32);
+void draw_error(Buffer*, const char*);
+i32 trash_directory(int);
+b32 trash_lines(Buffer*, u32, u32);
+void restore_trash(Buffer*);
+void purge_tree(int, const char*);
+void *trash_purger(void*);
@@ -2,11 +2,16 @@
 
 #ifndef STRINGS
 #define STRINGS
+// Strings that fit in small are stored in the struct itself with start pointing at it, so most
+// filenames are a single allocation. Longer ones have start on the heap. Either way start is
+// where the characters are, but a String can't be copied by value.
+#define STRING_INLINE 24
 typedef struct
 {
     char *start;
     unsigned int capacity;
     unsigned int length;
+    char small[STRING_INLINE];
 } String;
 
 String* string_new(unsigned int);
@@ -17,6 +22,7 @@ int string_equals(String*, String*);
 void string_to_lowercase(String*);
 String* string_copy(String*);
 b32 string_compare(String*, String*);
+b32 string_compare_chars(const char*, unsigned int, const char*, unsigned int);
 void string_cstring(String*, char*, size_t);
 void string_replace(String*, char*, size_t);
 void string_push(String*, char);
@@ -24,4 +30,5 @@ void string_push_str(String*, char*, size_t);
 void string_pop(String*);
 void string_print(String*);
 void string_free(String*);
+unsigned int string_heap_bytes(String*);
 #endif
@@ -1,113 +1,154 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "../include/strings.h"
 
-String*
-string_new(unsigned int capacity)
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+// Lower cases the ASCII letters in 16 bytes. Bytes from 0x80 up are negative as signed chars so
+// the range check leaves them alone, same as the scalar version.
+static inline __m128i
+fold16(__m128i bytes)
+{
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(bytes, _mm_set1_epi8('Z' + 1)));
+    return _mm_add_epi8(bytes, _mm_and_si128(upper, _mm_set1_epi8(32)));
+}
+#endif
+
+static inline u8
+fold(u8 c)
+{
+    return c >= 'A' && c <= 'Z' ? c + 32 : c;
+}
+
+// Index of the first byte where a and b differ ignoring ASCII case, or length if they don't
+static unsigned int
+fold_mismatch(const char *a, const char *b, unsigned int length)
+{
+    unsigned int i = 0;
+#ifdef __SSE2__
+    for(; i + 16 <= length; i += 16)
+    {
+        __m128i x = fold16(_mm_loadu_si128((const __m128i*)(a + i)));
+        __m128i y = fold16(_mm_loadu_si128((const __m128i*)(b + i)));
+        unsigned int equal = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+        if(equal != 0xFFFF) return i + __builtin_ctz(~equal);
+    }
+#endif
+    while(i < length && fold(a[i]) == fold(b[i])) i++;
+    return i;
+}
+
+// Makes room for capacity characters, moving out of the inline buffer if need be. Grows to twice
+// what was asked for so repeated pushes stay cheap.
+static void
+string_reserve(String *str, unsigned int capacity)
+{
+    if(capacity <= str->capacity) return;
+    char *new_str = (char*)malloc(sizeof(char) * capacity * 2);
+    memcpy(new_str, str->start, str->length);
+    if(str->start != str->small) free(str->start);
+    str->start = new_str;
+    str->capacity = capacity * 2;
+}
+
+// A string with room for exactly capacity characters, or the inline buffer if that's enough
+static String*
+string_alloc(unsigned int capacity)
 {
     String *str = (String*)malloc(sizeof(String));
-    str -> start = (char*)malloc(sizeof(char) * capacity);
-    str -> capacity = capacity;
+    if(capacity <= STRING_INLINE)
+    {
+        str -> start = str -> small;
+        str -> capacity = STRING_INLINE;
+    }
+    else
+    {
+        str -> start = (char*)malloc(sizeof(char) * capacity);
+        str -> capacity = capacity;
+    }
     str -> length = 0;
     return str;
 }
 
+String*
+string_new(unsigned int capacity)
+{
+    return string_alloc(capacity);
+}
+
 String*
 string_from(const char *c_str)
 {
-    int length = 0;
-    String *str = (String*)malloc(sizeof(String));
-    while(c_str[length] != '\0') {length++;}
-    str -> capacity = 2 * length; 
+    unsigned int length = strlen(c_str);
+    String *str = string_alloc(length);
+    memcpy(str -> start, c_str, length);
     str -> length = length;
-    str -> start = (char*)malloc(sizeof(char) * str -> capacity);
-    for(int i = 0; i < length; i++)
-    {
-        str -> start[i] = c_str[i];
-    }
     return str;
 }
 
 void
 string_concat(String *str1, String *str2)
 {
-    int length1 = str1->length, length2 = str2->length;
-    int total_length = length1 + length2;
-    if(total_length <= str1->capacity)
-    {
-        for(int i = length1; i < total_length; i++)
-        {
-            str1->start[i] = str2->start[i - length1];
-        }
-        str1->length = total_length;
-    }
-    else
-    {
-        char *new_str = (char*)malloc(sizeof(char) * total_length * 2);
-        for(int i = 0; i < length1; i++)
-        {
-            new_str[i] = str1->start[i];
-        }
-        for(int j = 0; j < length2; j++)
-        {
-            new_str[j + length1] = str2->start[j];
-        }
-        free(str1->start);
-        str1->start = new_str;
-        str1->length = total_length;
-        str1->capacity = total_length * 2;
-    }
+    string_reserve(str1, str1->length + str2->length);
+    memcpy(str1->start + str1->length, str2->start, str2->length);
+    str1->length += str2->length;
 }
 
+// Checks 16 positions at a time for the literal's first and last byte and only compares the
+// whole literal where both match, which rules out nearly every position in one pass.
 int
 string_contains(String *str, const char *literal)
 {
-    int l_length = 0;
-    while(literal[l_length] != '\0') {l_length++;}
-    if(l_length == 0) return 0;
-
-    for(int i = 0; i < str->length; i++)
-    {
-        if(i + l_length > str-> length) {return 0;}
-
-        if(str->start[i] == literal[0])
+    unsigned int l_length = strlen(literal);
+    if(l_length == 0 || l_length > str->length) return 0;
+
+    const char *text = str->start;
+    unsigned int last = str->length - l_length;
+    unsigned int i = 0;
+#ifdef __SSE2__
+    __m128i first_byte = _mm_set1_epi8(literal[0]);
+    __m128i last_byte  = _mm_set1_epi8(literal[l_length - 1]);
+    for(; i + 16 <= last + 1; i += 16)
+    {
+        __m128i starts = _mm_cmpeq_epi8(first_byte, _mm_loadu_si128((const __m128i*)(text + i)));
+        __m128i ends   = _mm_cmpeq_epi8(last_byte, _mm_loadu_si128((const __m128i*)(text + i + l_length - 1)));
+        unsigned int candidates = (unsigned int)_mm_movemask_epi8(_mm_and_si128(starts, ends));
+        while(candidates)
         {
-            // If l_length is 1 then we know str contains literal
-            // this also avoids SEGFAULTS or weird behaviour in 
-            // the while loop
-            if(l_length == 1) return 1;
-
-            int l_idx = 1;
-            while(str->start[i + l_idx] == literal[l_idx])
-            {
-                l_idx++;
-                if(l_idx >= l_length) return 1;
-            }
+            unsigned int offset = i + __builtin_ctz(candidates);
+            if(memcmp(text + offset, literal, l_length) == 0) return 1;
+            candidates &= candidates - 1;
         }
     }
+#endif
+    for(; i <= last; i++)
+    {
+        if(text[i] == literal[0] && memcmp(text + i, literal, l_length) == 0) return 1;
+    }
     return 0;
 }
 
 int
 string_equals(String *str1, String *str2)
 {
-    if(str1->length != str2->length) return 0;
-
-    for(int i = 0; i < str1->length; i++)
-    {
-        if(str1->start[i] != str2->start[i]) return 0;
-    }
-    return 1;
+    return str1->length == str2->length && memcmp(str1->start, str2->start, str1->length) == 0;
 }
 
 void
 string_to_lowercase(String *str)
 {
-    for(int i = 0; i < str->length; i++)
+    unsigned int i = 0;
+#ifdef __SSE2__
+    for(; i + 16 <= str->length; i += 16)
     {
-        char c = str->start[i];
-        if(c >= 'A' && c <= 'Z') str->start[i] += 32;
+        __m128i *bytes = (__m128i*)(str->start + i);
+        _mm_storeu_si128(bytes, fold16(_mm_loadu_si128(bytes)));
     }
+#endif
+    for(; i < str->length; i++) str->start[i] = fold(str->start[i]);
 }
 
 String*
@@ -118,16 +159,9 @@ string_copy(String *str)
         return NULL;
     }
 
-    char *copy = (char*)malloc(sizeof(char) * str->capacity);
-    String *copy_string = (String*)malloc(sizeof(String));
-    copy_string->capacity = str->capacity;
+    String *copy_string = string_alloc(str->length);
+    memcpy(copy_string->start, str->start, str->length);
     copy_string->length = str->length;
-    copy_string->start = copy;
-
-    for(int i = 0; i < str->length; i++)
-    {
-        copy_string->start[i] = str->start[i];
-    }
     return copy_string;
 }
 
@@ -135,17 +169,20 @@ string_copy(String *str)
 b32
 string_compare(String *str1, String *str2)
 {
-    String *smaller = str1->length < str2->length ? str1 : str2;
+    return string_compare_chars(str1->start, str1->length, str2->start, str2->length);
+}
 
-    for(u32 i = 0; i < smaller->length; i++)
-    {
-        u8 ch1 = (str1->start[i] >= 'A' && str1->start[i] <= 'Z') ? str1->start[i] + 32 : str1->start[i];
-        u8 ch2 = (str2->start[i] >= 'A' && str2->start[i] <= 'Z') ? str2->start[i] + 32 : str2->start[i];
-        i8 diff = ch1 - ch2;
-        if(diff < 0) return true;
-        if(diff > 0) return false;
-    }
-    return smaller == str1;
+// string_compare for characters that aren't in a String
+b32
+string_compare_chars(const char *str1, unsigned int length1, const char *str2, unsigned int length2)
+{
+    unsigned int smaller = length1 < length2 ? length1 : length2;
+
+    // Only the first difference decides. Bytes compare unsigned so the order is total and binary
+    // searches over lines sorted with it are sound.
+    u32 i = fold_mismatch(str1, str2, smaller);
+    if(i == smaller) return length1 < length2;
+    return fold(str1[i]) < fold(str2[i]);
 }
 
 void
@@ -164,48 +201,17 @@ string_cstring(String *str, char *c_str, size_t length)
 void
 string_replace(String *str, char *c_str, size_t length)
 {
-    if(str->capacity >= length)
-    {
-        str->length = length;
-        for(u32 i = 0; i < length; i++)
-        {
-            str->start[i] = c_str[i];
-        }
-    }
-    else
-    {
-        char *new_str = (char*)malloc(sizeof(char) * length * 2);
-        for(u32 i = 0; i < length; i++)
-        {
-            new_str[i] = c_str[i];
-        }
-        str->length = length;
-        str->capacity = length * 2;
-        free(str->start);
-        str->start = new_str;
-    }
+    str->length = 0;
+    string_reserve(str, length);
+    memcpy(str->start, c_str, length);
+    str->length = length;
 }
 
 void
 string_push(String *str, char c)
 {
-    if(str->length < str->capacity)
-    {
-        str->start[str->length++] = c;
-    }
-    else
-    {
-        char *new_str = (char*)malloc(sizeof(char) * (str->capacity + 1) * 2);
-        for(u32 i = 0; i < str->capacity; i++)
-        {
-            new_str[i] = str->start[i];
-        }
-        new_str[str->capacity] = c;
-        str->length++;
-        str->capacity = (str->capacity + 1) * 2;
-        free(str->start);
-        str->start = new_str;
-    }
+    string_reserve(str, str->length + 1);
+    str->start[str->length++] = c;
 }
 
 void
@@ -220,31 +226,9 @@ string_pop(String *str)
 void
 string_push_str(String *str, char *cstr, size_t length)
 {
-    if(str->length + length <= str->capacity)
-    {
-        for(u32 i = 0; i < length; i++)
-        {
-            str->start[str->length++] = cstr[i];
-        }
-    }
-    else 
-    {
-        u32 new_length = str->length + length;
-        char *new_str = (char*)malloc(sizeof(char) * new_length * 2);
-        u32 index = 0;
-        for(u32 i = 0; i < str->length; i++)
-        {
-            new_str[index++] = str->start[i];
-        }
-        for(u32 i = 0; i < length; i++)
-        {
-            new_str[index++] = cstr[i];
-        }
-        str->length = new_length;
-        str->capacity = new_length * 2;
-        free(str->start);
-        str->start = new_str;
-    }
+    string_reserve(str, str->length + length);
+    memcpy(str->start + str->length, cstr, length);
+    str->length += length;
 }
 
 void 
@@ -259,6 +243,13 @@ string_print(String *str)
 void
 string_free(String *str)
 {
-    free(str->start);
+    if(str->start != str->small) free(str->start);
     free(str);
 }
+
+// Bytes held outside the String itself, zero for inline strings
+unsigned int
+string_heap_bytes(String *str)
+{
+    return str->start != str->small ? str->capacity : 0;
+}
@@ -0,0 +1,106 @@
+// Checks the SSE2 paths in strings.c against plain byte at a time versions of the same functions.
+// Built and run by src/build. Includes strings.c itself so the static helpers can be reached.
+#include "strings.c"
+
+static unsigned int failures;
+
+static u8
+reference_fold(u8 c)
+{
+    return c >= 'A' && c <= 'Z' ? c + 32 : c;
+}
+
+static unsigned int
+reference_mismatch(const char *a, const char *b, unsigned int length)
+{
+    unsigned int i = 0;
+    while(i < length && reference_fold(a[i]) == reference_fold(b[i])) i++;
+    return i;
+}
+
+static int
+reference_contains(const char *text, unsigned int length, const char *literal)
+{
+    unsigned int l_length = strlen(literal);
+    if(l_length == 0 || l_length > length) return 0;
+    for(unsigned int i = 0; i + l_length <= length; i++)
+    {
+        if(memcmp(text + i, literal, l_length) == 0) return 1;
+    }
+    return 0;
+}
+
+// Mostly letters either side of the case boundaries and bytes from 0x80 up, since those are what
+// the signed compares in fold16 could get wrong
+static char
+random_byte(void)
+{
+    static const char interesting[] = "@AZ[`az{09 ._";
+    switch(rand() % 4)
+    {
+        case 0: return interesting[rand() % (sizeof(interesting) - 1)];
+        case 1: return (char)(0x80 + rand() % 0x80);
+        case 2: return (char)('a' + rand() % 3);
+        default: return (char)(1 + rand() % 0x7F);
+    }
+}
+
+static void
+fail(const char *what, unsigned int length)
+{
+    printf("strings_test: %s differs at length %u\n", what, length);
+    failures++;
+}
+
+int
+main(void)
+{
+    srand(1);
+    char a[200];
+    char b[200];
+    for(unsigned int round = 0; round < 200000; round++)
+    {
+        unsigned int length = rand() % 100;
+        for(unsigned int i = 0; i < length; i++) a[i] = random_byte();
+        a[length] = '\0';
+
+        // Same text with cases flipped and sometimes one byte changed, so the mismatch can be anywhere
+        for(unsigned int i = 0; i <= length; i++) b[i] = rand() % 2 && a[i] >= 'a' && a[i] <= 'z' ? a[i] - 32 : a[i];
+        if(length && rand() % 2) b[rand() % length] = random_byte();
+
+        if(fold_mismatch(a, b, length) != reference_mismatch(a, b, length)) fail("fold_mismatch", length);
+
+        unsigned int smaller = length;
+        unsigned int i = reference_mismatch(a, b, smaller);
+        b32 expected = i == smaller ? 0 : reference_fold(a[i]) < reference_fold(b[i]);
+        if(string_compare_chars(a, length, b, length) != expected) fail("string_compare_chars", length);
+
+        String *text = string_from(a);
+        char literal[8];
+        unsigned int l_length = 1 + rand() % 6;
+        if(length >= l_length && rand() % 2)
+        {
+            memcpy(literal, a + rand() % (length - l_length + 1), l_length);
+        }
+        else
+        {
+            for(unsigned int j = 0; j < l_length; j++) literal[j] = random_byte();
+        }
+        literal[l_length] = '\0';
+        if(string_contains(text, literal) != reference_contains(a, length, literal)) fail("string_contains", length);
+
+        string_to_lowercase(text);
+        for(unsigned int j = 0; j < length; j++)
+        {
+            if((u8)text->start[j] != reference_fold(a[j]))
+            {
+                fail("string_to_lowercase", length);
+                break;
+            }
+        }
+        string_free(text);
+    }
+
+    if(failures == 0) printf("strings_test: ok\n");
+    return failures != 0;
+}
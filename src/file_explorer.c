@@ -8,6 +8,15 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/xattr.h>
+#include <sys/file.h>
+#include <sys/sysmacros.h>
+#include <linux/ioprio.h>
+#include <time.h>
+#include <pwd.h>
 #include "../include/termbox.h"
 #include "../include/file_explorer.h"
 
@@ -24,19 +33,210 @@
 // Maybe ideas.
 // 1. add an x offset field to Buffer
 
-#define MAX_BUFFERS 2
+// Blank columns either side of a pane and the smallest pane a split can leave
+#define PANE_MARGIN 2
+#define MIN_PANE_WIDTH 16
+#define MIN_PANE_HEIGHT 4
 #define TEXT_OFF 7
 
+// Submission queue depth and fixed buffers of every thread's io_uring
+#define IORING_DEPTH 64
+#define IORING_NUM_BUFFERS 8
+#define IORING_BUFFER_SIZE (256 * 1024)
+
+#define MAX_TRASH_DIRS 16
+#define TRASH_DIR_NAME ".file_explorer_trash"
+// Trashed items older than this many seconds are purged by the background purger
+#define TRASH_RETENTION (60 * 60 * 24 * 3)
+#define TRASH_PURGE_INTERVAL 60
+// Upper bound on unlinks per second the purger issues
+#define TRASH_PURGE_RATE 2000
+
+#define JOURNAL_NAME ".file_explorer_journal"
+// Buffered journal records are committed once there are this many or the oldest is this old
+#define JOURNAL_COMMIT_RECORDS 512
+#define JOURNAL_COMMIT_MS 50
+// A commit also happens early once this many destinations are waiting to be synced, each holds an fd
+#define JOURNAL_SYNC_FDS 256
+
+// Limits new jobs start with, zero is unlimited. Running jobs are changed from LIMIT mode.
+#define DEFAULT_BYTES_PER_SECOND 0
+#define DEFAULT_OPS_PER_SECOND 0
+#define BULK_NICE 10
+// Chunk size copy_file_range works in when a job is rate limited
+#define LIMITED_COPY_CHUNK (1024 * 1024)
+
+// Lines stat'd per task, one ring submission when io_uring is available
+#define STAT_BATCH IORING_DEPTH
+// Mode, owner, size and mtime columns plus their separators
+#define META_WIDTH 44
+// Memory the listing cache may keep for directories no buffer is showing, FILE_EXPLORER_CACHE_MB overrides it
+#define LISTING_CACHE_MB 64
+// Same for the usage cache, FILE_EXPLORER_USAGE_CACHE_MB overrides it
+#define USAGE_CACHE_MB 32
+// How long the cursor has to rest on a directory before it's read ahead, and how many reads can be in flight
+#define PREFETCH_DELAY_MS 150
+#define MAX_PREFETCHES 2
+// Scratch memory reset every time round the main loop, and how many items a slab gets per malloc
+#define FRAME_ARENA_SIZE (16 << 10)
+#define SLAB_CHUNK 64
+// Room for a String and its characters, enough for nearly every name and path an Operation holds
+#define PATH_SLAB_ITEM 256
+// Interned names are looked up through pages of this many entries, up to NAME_PAGES of them
+#define NAME_PAGE_BITS 12
+#define NAME_PAGES 4096
+
+// Room for a state's slot in the DFA table, compiling fails rather than go past it
+#define MAX_DFA_STATES 1024
+// Filter runs over at least this many names are split across the interactive pool in chunks
+#define FILTER_PARALLEL_LINES (32 << 10)
+#define FILTER_CHUNK (8 << 10)
+// Files a flat view lists before its walk stops, which bounds the listing's memory, and how many
+// paths a walker hands over at a time
+#define FLAT_MAX_LINES (1 << 20)
+#define FLAT_BATCH 512
+// Levels below the directory a flat view lists, 0 for no limit. FILE_EXPLORER_FLAT_DEPTH overrides it.
+#define FLAT_DEPTH 0
+// Most of a .gitignore that's read
+#define IGNORE_FILE_MAX (16 << 10)
+// Parent of a tree view's top level lines
+#define TREE_ROOT 0xFFFFFFFF
+
 static u32 global_terminal_width;
 static u32 global_terminal_height;
 
 static u32 global_state_active_buffer;
 static u32 global_state_num_buffers;
 static Buffer **global_state_buffers;
+static Tile *global_layout;
+
+static Arena global_frame_arena = {NULL, FRAME_ARENA_SIZE};
+static Slab global_path_slab = {PATH_SLAB_ITEM, NULL};
+static Slab global_prefetch_slab = {sizeof(Prefetch) + NAME_MAX + 1, NULL};
+
+// Interned names. Entries live in fixed pages so an id can be looked up without the lock while
+// other threads intern, the lock covers the hash buckets, reference counts and free list.
+static pthread_mutex_t global_names_lock = PTHREAD_MUTEX_INITIALIZER;
+static Name **global_name_pages[NAME_PAGES];
+static u32 *global_name_buckets;
+static u32 global_name_num_buckets;
+static u32 global_name_count;
+// Ids start at 1 so 0 can mean no name
+static u32 global_name_next = 1;
+// Released ids, reused before new ones
+static u32 *global_name_free;
+static u32 global_name_num_free;
+static u32 global_name_free_capacity;
 
 static Mode global_mode;
-static char global_path[256];
-static size_t global_path_size = 256;
+
+static WorkerPool global_pools[NUM_PRIORITIES];
+static Job *global_jobs;
+// Directory fds held open by background jobs. Past the budget walkers recurse depth first
+// on their own thread instead of fanning out, which bounds open fds to the tree depth.
+static atomic_uint global_open_fds;
+static u32 global_fd_budget;
+// Shown in the status line until the next key press
+static char global_message[128];
+
+// Set at startup, FILE_EXPLORER_IO=threads forces plain syscalls for comparing the two.
+// Drops back to IO_BACKEND_THREADS the first time a ring can't be set up.
+static IoBackend global_io_backend = IO_BACKEND_URING;
+static __thread IoRing *thread_ring;
+static __thread b32 thread_ring_failed;
+
+// Limits and priority of jobs that aren't running yet, LIMIT mode sets these when nothing is
+static u64 global_default_bytes_per_second = DEFAULT_BYTES_PER_SECOND;
+static u64 global_default_ops_per_second = DEFAULT_OPS_PER_SECOND;
+static i32 global_default_priority = -1;
+
+static Journal global_journal = {PTHREAD_MUTEX_INITIALIZER, -1};
+static Stats global_stats;
+// This thread's share of global_stats.mallocs
+static __thread u64 thread_mallocs;
+
+// The allocator is interposed so the stats see every allocation, libc's own included, and glibc's
+// entry points do the work. Sanitizer builds bring their own allocator and are left alone.
+#ifndef __SANITIZE_ADDRESS__
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void*, size_t);
+
+void *malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&global_stats.mallocs, 1, memory_order_relaxed);
+    thread_mallocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    atomic_fetch_add_explicit(&global_stats.mallocs, 1, memory_order_relaxed);
+    thread_mallocs++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *memory, size_t size)
+{
+    atomic_fetch_add_explicit(&global_stats.mallocs, 1, memory_order_relaxed);
+    thread_mallocs++;
+    return __libc_realloc(memory, size);
+}
+#endif
+
+// Preserve flags given to new yanks, a toggles between these and plain copies
+static u32 global_copy_preserve = PRESERVE_ALL;
+
+// When set D renames into the trash instead of deleting
+static b32 global_trash_mode = true;
+static pthread_mutex_t global_trash_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t global_trash_wake = PTHREAD_COND_INITIALIZER;
+static atomic_int global_trash_purging = true;
+static TrashDir global_trash_dirs[MAX_TRASH_DIRS];
+static u32 global_trash_num_dirs;
+static TrashEntry *global_trash_entries;
+static u32 global_trash_num_entries;
+static u32 global_trash_capacity;
+static RateLimit global_purge_limit;
+
+static b32 global_show_metadata;
+static pthread_mutex_t global_stat_lock = PTHREAD_MUTEX_INITIALIZER;
+// Batches the workers are done with, waiting for the main thread to copy them into their buffer
+static StatBatch *global_stat_done;
+static u32 global_stat_pending;
+// Set when metadata arrives for a buffer sorted by it while it can't be re-sorted yet
+static b32 global_stale_sorts;
+
+static UsageCache global_usage_cache = {PTHREAD_MUTEX_INITIALIZER};
+static u64 global_usage_cache_budget = (u64)USAGE_CACHE_MB << 20;
+
+// Recently read listings, each holding a reference. Main thread only.
+static Listing *global_listing_newest;
+static Listing *global_listing_oldest;
+static u64 global_listing_cache_bytes;
+static u64 global_listing_cache_budget = (u64)LISTING_CACHE_MB << 20;
+
+// Prefetches still owned by a worker, including cancelled ones that haven't noticed yet
+static Prefetch *global_prefetches[MAX_PREFETCHES];
+static u32 global_num_prefetches;
+static Prefetch *global_prefetches_done;
+// The directory line the cursor is resting on and when it got there
+static Listing *global_prefetch_listing;
+static u32 global_prefetch_line;
+static u64 global_prefetch_at;
+static b32 global_prefetch_armed;
+
+// How flat views walk, set from FILE_EXPLORER_FLAT_DEPTH, FILE_EXPLORER_FLAT_HIDDEN and FILE_EXPLORER_FLAT_IGNORE
+static u32 global_flat_depth = FLAT_DEPTH;
+static b32 global_flat_hidden;
+static b32 global_flat_ignore = true;
+// Walks still filling a buffer, the main loop polls while there are any
+static u32 global_flat_walks;
+// Directories tree views are waiting on, and the ones read waiting for the main thread
+static u32 global_tree_loads;
+static TreeLoad *global_tree_loads_done;
+// Walk results waiting for the main thread, counted in global_stat_pending as well
+static UsageResult *global_usage_done;
 
 void panic(const char *error)
 {
@@ -45,6 +245,219 @@ void panic(const char *error)
     exit(1);
 }
 
+void *arena_alloc(Arena *arena, u64 size)
+{
+    size = (size + 15) & ~(u64)15;
+    atomic_fetch_add(&global_stats.arena_allocs, 1);
+    ArenaBlock *block = arena->blocks;
+    if(!block || block->used + size > block->capacity)
+    {
+        u64 capacity = size > arena->block_size ? size : arena->block_size;
+        block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + capacity);
+        block->next     = arena->blocks;
+        block->capacity = capacity;
+        block->used     = 0;
+        arena->blocks   = block;
+        atomic_fetch_add(&global_stats.arena_mallocs, 1);
+    }
+    void *memory = block->data + block->used;
+    block->used += size;
+    return memory;
+}
+
+// Frees everything allocated since the last reset. If that took more than one block they're
+// replaced by one big enough for all of it next time.
+void arena_reset(Arena *arena)
+{
+    ArenaBlock *block = arena->blocks;
+    if(!block) return;
+    if(block->next)
+    {
+        u64 total = 0;
+        while(block)
+        {
+            ArenaBlock *next = block->next;
+            total += block->capacity;
+            free(block);
+            block = next;
+        }
+        arena->blocks     = NULL;
+        arena->block_size = total;
+        return;
+    }
+    block->used = 0;
+}
+
+// A String living in the arena, only good until it's reset and never to be string_free'd.
+String *arena_string(Arena *arena, const char *text)
+{
+    u32 length  = strlen(text);
+    String *str = (String*)arena_alloc(arena, sizeof(String) + length);
+    str->start    = (char*)(str + 1);
+    str->capacity = length;
+    str->length   = length;
+    memcpy(str->start, text, length);
+    return str;
+}
+
+u32 name_hash(const char *text, u32 length)
+{
+    // FNV-1a
+    u32 hash = 2166136261u;
+    for(u32 i = 0; i < length; i++) hash = (hash ^ (u8)text[i]) * 16777619u;
+    return hash;
+}
+
+static Name *name_entry(u32 id)
+{
+    return global_name_pages[id >> NAME_PAGE_BITS][id & ((1 << NAME_PAGE_BITS) - 1)];
+}
+
+// Returns the id of the name, adding it if it's new, with a reference the caller has to release.
+// Safe to call from workers.
+u32 name_intern(const char *text, u32 length)
+{
+    u32 hash = name_hash(text, length);
+    pthread_mutex_lock(&global_names_lock);
+    for(u32 id = global_name_num_buckets ? global_name_buckets[hash & (global_name_num_buckets - 1)] : 0; id; id = name_entry(id)->next)
+    {
+        Name *name = name_entry(id);
+        if(name->hash == hash && name->text.length == length && memcmp(name->text.start, text, length) == 0)
+        {
+            name->refs++;
+            pthread_mutex_unlock(&global_names_lock);
+            return id;
+        }
+    }
+
+    // Rehashing walks every id ever handed out, released ones have no entry
+    if(global_name_count + 1 > global_name_num_buckets)
+    {
+        global_name_num_buckets = global_name_num_buckets ? global_name_num_buckets * 2 : 1024;
+        global_name_buckets = (u32*)realloc(global_name_buckets, sizeof(u32) * global_name_num_buckets);
+        memset(global_name_buckets, 0, sizeof(u32) * global_name_num_buckets);
+        for(u32 id = 1; id < global_name_next; id++)
+        {
+            Name *name = name_entry(id);
+            if(!name) continue;
+            u32 *bucket = &global_name_buckets[name->hash & (global_name_num_buckets - 1)];
+            name->next = *bucket;
+            *bucket = id;
+        }
+    }
+
+    u32 id;
+    if(global_name_num_free)
+    {
+        id = global_name_free[--global_name_num_free];
+    }
+    else
+    {
+        id = global_name_next++;
+        if((id >> NAME_PAGE_BITS) >= NAME_PAGES) panic("Too many distinct filenames");
+        Name ***page = &global_name_pages[id >> NAME_PAGE_BITS];
+        if(!*page) *page = (Name**)calloc(1 << NAME_PAGE_BITS, sizeof(Name*));
+    }
+
+    b32 small   = length < STRING_INLINE;
+    Name *name  = (Name*)malloc(sizeof(Name) + (small ? 0 : length + 1));
+    name->text.start    = small ? name->text.small : name->chars;
+    name->text.capacity = length;
+    name->text.length   = length;
+    memcpy(name->text.start, text, length);
+    name->text.start[length] = '\0';
+    name->hash = hash;
+    name->refs = 1;
+    u32 *bucket = &global_name_buckets[hash & (global_name_num_buckets - 1)];
+    name->next = *bucket;
+    *bucket = id;
+    global_name_pages[id >> NAME_PAGE_BITS][id & ((1 << NAME_PAGE_BITS) - 1)] = name;
+    global_name_count++;
+    pthread_mutex_unlock(&global_names_lock);
+    return id;
+}
+
+void name_retain(u32 id)
+{
+    pthread_mutex_lock(&global_names_lock);
+    name_entry(id)->refs++;
+    pthread_mutex_unlock(&global_names_lock);
+}
+
+// Drops a reference, freeing the name and its id with the last one. Takes the lock per call, so
+// listing_release does its lines in one go with name_release_locked instead.
+static void name_release_locked(u32 id)
+{
+    Name *name = name_entry(id);
+    if(--name->refs > 0) return;
+    u32 *link = &global_name_buckets[name->hash & (global_name_num_buckets - 1)];
+    while(*link != id) link = &name_entry(*link)->next;
+    *link = name->next;
+    free(name);
+    global_name_pages[id >> NAME_PAGE_BITS][id & ((1 << NAME_PAGE_BITS) - 1)] = NULL;
+    if(global_name_num_free == global_name_free_capacity)
+    {
+        global_name_free_capacity = global_name_free_capacity ? global_name_free_capacity * 2 : 1024;
+        global_name_free = (u32*)realloc(global_name_free, sizeof(u32) * global_name_free_capacity);
+    }
+    global_name_free[global_name_num_free++] = id;
+    global_name_count--;
+}
+
+void name_release(u32 id)
+{
+    if(!id) return;
+    pthread_mutex_lock(&global_names_lock);
+    name_release_locked(id);
+    pthread_mutex_unlock(&global_names_lock);
+}
+
+// Valid for as long as the caller, or whatever it got id from, holds a reference.
+String *name_string(u32 id)
+{
+    return &name_entry(id)->text;
+}
+
+void *slab_alloc(Slab *slab)
+{
+    atomic_fetch_add(&global_stats.slab_allocs, 1);
+    if(!slab->free_list)
+    {
+        char *chunk = (char*)malloc((u64)slab->item_size * SLAB_CHUNK);
+        for(u32 i = 0; i < SLAB_CHUNK; i++) slab_free(slab, chunk + (u64)i * slab->item_size);
+        atomic_fetch_add(&global_stats.slab_mallocs, 1);
+    }
+    void *item = slab->free_list;
+    slab->free_list = *(void**)item;
+    return item;
+}
+
+void slab_free(Slab *slab, void *item)
+{
+    *(void**)item = slab->free_list;
+    slab->free_list = item;
+}
+
+// A copy of source in a single slab item, or an ordinary string_copy if it doesn't fit. Either
+// way it's read only and freed with slab_string_free.
+String *slab_string(Slab *slab, String *source)
+{
+    if(!source || sizeof(String) + source->length > slab->item_size) return string_copy(source);
+    String *str = (String*)slab_alloc(slab);
+    str->start    = (char*)(str + 1);
+    str->capacity = slab->item_size - sizeof(String);
+    str->length   = source->length;
+    memcpy(str->start, source->start, source->length);
+    return str;
+}
+
+void slab_string_free(Slab *slab, String *str)
+{
+    if(!str) return;
+    if(str->start == (char*)(str + 1)) slab_free(slab, str);
+    else string_free(str);
+}
+
 
 void draw_vertical_line(u32 y_start, u32 y_end, u32 x)
 {
@@ -55,646 +468,5783 @@ void draw_vertical_line(u32 y_start, u32 y_end, u32 x)
     tb_present();
 }
 
-u64 search_test(String *file, String *query)
+// Whether query's characters appear in order in file, ignoring case. With spans, also writes the
+// matched characters as runs into it, which needs room for query->length of them, and their count
+// into num_spans.
+b32 search_test(const char *file, u32 length, String *query, MatchSpan *spans, u32 *num_spans)
 {
-    if(query->length > file->length) return 0;
-    u64 color_mask = 0;
-    // This is to make sure the bit shifting doesn't produce fucked values
-    u64 one = 1;
+    if(query->length > length) return false;
+    u32 count = 0;
     u32 index = 0;
     u32 num_matched = 0;
     for(u32 i = 0; i < query->length; i++)
     {
-        while(index < file->length)
+        while(index < length)
         {
             u8 c1 = query->start[i];
-            u8 c2 = file->start[index];
+            u8 c2 = file[index];
             if(c1 >= 'A' && c1 <= 'Z') c1 += 32;
             if(c2 >= 'A' && c2 <= 'Z') c2 += 32;
             i8 diff = c1 - c2;
             if(diff == 0)
             {
-                color_mask |= (one << index);
-                if(++num_matched == query->length) return color_mask;
+                if(spans)
+                {
+                    if(count && spans[count - 1].start + spans[count - 1].length == index) spans[count - 1].length++;
+                    else spans[count++] = (MatchSpan){(u16)index, 1};
+                }
+                if(++num_matched == query->length)
+                {
+                    if(num_spans) *num_spans = count;
+                    return true;
+                }
                 index++;
                 break;
             }
             index++;
         }
     }
-    return 0;
+    return false;
 }
 
-void exec_search(Buffer *screen, SearchBuffer *results, String *query)
+u32 nfa_state(FilterParser *parser, NfaType type, u32 set, u32 out, u32 out1)
 {
-    if(query->length == 0)
+    if(parser->num_states == parser->states_capacity)
     {
-        results->num_lines = screen->num_lines;
-        for(u32 i = 0; i < screen->num_lines; i++)
-        {
-            results->buffer[i].text = screen->buffer[i].text;
-            results->buffer[i].original_line_number = i;
-            results->buffer[i].is_dir = screen->buffer[i].is_dir;
-            results->buffer[i].color_mask = 0;
-        }
+        parser->states_capacity = parser->states_capacity ? parser->states_capacity * 2 : 64;
+        parser->states = (NfaState*)realloc(parser->states, sizeof(NfaState) * parser->states_capacity);
     }
-    else
+    parser->states[parser->num_states] = (NfaState){type, set, out, out1};
+    return parser->num_states++;
+}
+
+u32 nfa_set(FilterParser *parser)
+{
+    if(parser->num_sets == parser->sets_capacity)
     {
-        results->num_lines = 0;
-        for(u32 i = 0; i < screen->num_lines; i++)
-        {
-            u64 color_mask = search_test(screen->buffer[i].text, query);
-            if(color_mask)
-            {
-                u32 index = results->num_lines;
-                results->buffer[index].text = screen->buffer[i].text;
-                results->buffer[index].original_line_number = i;
-                results->buffer[index].is_dir = screen->buffer[i].is_dir;
-                results->buffer[index].color_mask = color_mask;
-                results->num_lines++;
-                if(results->num_lines >= results->capacity)
-                {
-                    reallocate_search_buffer(results);
-                }
-            }
-        }
+        parser->sets_capacity = parser->sets_capacity ? parser->sets_capacity * 2 : 16;
+        parser->sets = (u64*)realloc(parser->sets, sizeof(u64) * 4 * parser->sets_capacity);
     }
+    memset(parser->sets + parser->num_sets * 4, 0, sizeof(u64) * 4);
+    return parser->num_sets++;
+}
 
-    u32 max_height            = screen->height / 4;
-    results->view_range_start = 0;
-    results->current_line     = 0;
-    results->query_x          = screen->x;
-    results->query_y          = screen->y + screen->height;
-    results->x                = screen->x;
-    results->width            = screen->width / 2;
-    if(results->num_lines > max_height)
+// Filters ignore case like search does, so letters go in as both
+void nfa_set_add(FilterParser *parser, u32 set, u8 c)
+{
+    u64 *bits = parser->sets + set * 4;
+    bits[c >> 6] |= 1ULL << (c & 63);
+    if(c >= 'a' && c <= 'z') c -= 32;
+    else if(c >= 'A' && c <= 'Z') c += 32;
+    bits[c >> 6] |= 1ULL << (c & 63);
+}
+
+NfaFragment nfa_fragment(FilterParser *parser, u32 set)
+{
+    u32 end = nfa_state(parser, NFA_EMPTY, 0, 0, 0);
+    u32 start = nfa_state(parser, NFA_SET, set, end, 0);
+    return (NfaFragment){start, end};
+}
+
+// fragment followed by '*', '+' or '?'
+NfaFragment nfa_repeat(FilterParser *parser, NfaFragment fragment, char op)
+{
+    u32 end = nfa_state(parser, NFA_EMPTY, 0, 0, 0);
+    u32 split = nfa_state(parser, NFA_SPLIT, 0, fragment.start, end);
+    // Star and plus loop back through the split, question carries straight on
+    parser->states[fragment.end].out = op == '?' ? end : split;
+    return (NfaFragment){op == '+' ? fragment.start : split, end};
+}
+
+void parse_escape(FilterParser *parser, u32 set, u8 c)
+{
+    if(c == 'd' || c == 'w')
     {
-        results->height = max_height;
-        results->y = screen->y + screen->height - max_height;
+        for(u8 d = '0'; d <= '9'; d++) nfa_set_add(parser, set, d);
     }
-    else
+    if(c == 'w')
     {
-        results->height = results->num_lines;
-        results->y = screen->y + screen->height - results->num_lines;
+        for(u8 l = 'a'; l <= 'z'; l++) nfa_set_add(parser, set, l);
+        nfa_set_add(parser, set, '_');
     }
-    results->view_range_end = results->height;
-
-    // Sort search results by string length. The idea is that shorter strings are closer matches than long strings
-    // with this search system. And there's always more letters that you can add to close in on any longer strings
-    for(u32 i = 1; i < results->num_lines; i++)
+    else if(c == 's')
+    {
+        nfa_set_add(parser, set, ' ');
+        nfa_set_add(parser, set, '\t');
+    }
+    else if(c != 'd')
     {
-        Result current = results->buffer[i];
-        u32 current_length = current.text->length;
-        u32 index = i;
+        nfa_set_add(parser, set, c);
+    }
+}
 
-        while(index > 0 && results->buffer[index - 1].text->length > current_length)
+// After the '['. A ']' straight after it or the '^' is part of the class.
+void parse_class(FilterParser *parser, u32 set)
+{
+    const char *text = parser->text;
+    b32 negate = parser->at < parser->length && text[parser->at] == '^';
+    if(negate) parser->at++;
+    u32 first = parser->at;
+    while(parser->at < parser->length && (parser->at == first || text[parser->at] != ']'))
+    {
+        u8 low = text[parser->at++];
+        if(low == '\\' && parser->at < parser->length) low = text[parser->at++];
+        u8 high = low;
+        if(parser->at + 1 < parser->length && text[parser->at] == '-' && text[parser->at + 1] != ']')
         {
-            results->buffer[index] = results->buffer[index - 1];
-            index--;
+            high = text[parser->at + 1];
+            parser->at += 2;
+            if(high == '\\' && parser->at < parser->length) high = text[parser->at++];
         }
-        results->buffer[index] = current;
+        for(u32 c = low; c <= high; c++) nfa_set_add(parser, set, (u8)c);
+    }
+    if(parser->at == parser->length) parser->error = true;
+    else parser->at++;
+    if(negate)
+    {
+        for(u32 i = 0; i < 4; i++) parser->sets[set * 4 + i] = ~parser->sets[set * 4 + i];
     }
 }
 
-void background(u16 bg)
+NfaFragment parse_atom(FilterParser *parser)
 {
-    struct tb_cell *tb_buffer = tb_cell_buffer();
-    u32 length = global_terminal_width * global_terminal_height;
-    for(u32 i = 0; i < length; i++)
+    u8 c = parser->text[parser->at++];
+    if(c == '(')
     {
-        tb_buffer[i].ch = (u32)' ';
-        tb_buffer[i].bg = bg;
+        NfaFragment inner = parse_alternation(parser, false);
+        if(parser->at < parser->length && parser->text[parser->at] == ')') parser->at++;
+        else parser->error = true;
+        return inner;
     }
-    tb_present();
+
+    u32 set = nfa_set(parser);
+    if(c == '.') memset(parser->sets + set * 4, 0xff, sizeof(u64) * 4);
+    else if(c == '[') parse_class(parser, set);
+    else if(c == '\\' && parser->at < parser->length) parse_escape(parser, set, parser->text[parser->at++]);
+    else nfa_set_add(parser, set, c);
+    return nfa_fragment(parser, set);
 }
 
-void clear_normal_buffer_area(Buffer *screen)
+NfaFragment parse_repeat(FilterParser *parser)
 {
-    struct tb_cell *tb_buffer = tb_cell_buffer();
-
-    for(u32 y = screen->y; y < screen->y + screen->height; y++)
+    NfaFragment fragment = parse_atom(parser);
+    while(parser->at < parser->length)
     {
-        for(u32 x = screen->x; x < screen->x + screen->width; x++)
-        {
-            u32 tb_index = x + global_terminal_width * y;
-            tb_buffer[tb_index].ch = (u32)' ';
-            tb_buffer[tb_index].bg = TB_BLACK;
-        }
+        char op = parser->text[parser->at];
+        if(op != '*' && op != '+' && op != '?') break;
+        parser->at++;
+        fragment = nfa_repeat(parser, fragment, op);
     }
-    tb_present();
+    return fragment;
 }
 
-// Pass zero for query_length to not clear the query
-void clear_search_buffer_area(SearchBuffer *results, u32 query_length)
+// Joins b on after a
+NfaFragment nfa_concatenate(FilterParser *parser, NfaFragment a, NfaFragment b)
 {
-    struct tb_cell *tb_buffer = tb_cell_buffer();
-    u32 tb_index = global_terminal_width * results->query_y;
+    parser->states[a.end].out = b.start;
+    return (NfaFragment){a.start, b.end};
+}
 
-    // Clear query
-    clear_text(results->query_x, results->query_y, query_length);
+// Only top level branches can be anchored, ^ and $ anywhere else are literal. An unanchored end
+// matches anywhere, which is the same as a .* there.
+NfaFragment parse_concatenation(FilterParser *parser, b32 top)
+{
+    const char *text = parser->text;
+    b32 anchor_start = top && parser->at < parser->length && text[parser->at] == '^';
+    b32 anchor_end = false;
+    if(anchor_start) parser->at++;
 
-    // Clear rest of buffer
-    tb_index = global_terminal_width * results->y;
-    for(u32 y = results->y; y < results->y + results->height; y++)
+    u32 empty = nfa_state(parser, NFA_EMPTY, 0, 0, 0);
+    NfaFragment fragment = {empty, empty};
+    while(parser->at < parser->length && text[parser->at] != '|' && text[parser->at] != ')')
     {
-        for(u32 x = results->x; x < results->x + results->width; x++)
+        if(top && text[parser->at] == '$' && (parser->at + 1 == parser->length || text[parser->at + 1] == '|'))
         {
-            tb_buffer[tb_index + x].ch = (u32)' ';
-            tb_buffer[tb_index + x].bg = TB_BLACK;
+            anchor_end = true;
+            parser->at++;
+            break;
         }
-        tb_index += global_terminal_width;
+        fragment = nfa_concatenate(parser, fragment, parse_repeat(parser));
     }
-    tb_present();
+
+    for(u32 side = 0; top && side < 2; side++)
+    {
+        if(side == 0 ? anchor_start : anchor_end) continue;
+        u32 any = nfa_set(parser);
+        memset(parser->sets + any * 4, 0xff, sizeof(u64) * 4);
+        NfaFragment skip = nfa_repeat(parser, nfa_fragment(parser, any), '*');
+        fragment = side == 0 ? nfa_concatenate(parser, skip, fragment) : nfa_concatenate(parser, fragment, skip);
+    }
+    return fragment;
 }
 
-void update_screen(Buffer *screen)
+NfaFragment parse_alternation(FilterParser *parser, b32 top)
 {
-    struct tb_cell *tb_buffer = tb_cell_buffer();
+    NfaFragment fragment = parse_concatenation(parser, top);
+    while(parser->at < parser->length && parser->text[parser->at] == '|')
+    {
+        parser->at++;
+        NfaFragment other = parse_concatenation(parser, top);
+        u32 end = nfa_state(parser, NFA_EMPTY, 0, 0, 0);
+        u32 split = nfa_state(parser, NFA_SPLIT, 0, fragment.start, other.start);
+        parser->states[fragment.end].out = end;
+        parser->states[other.end].out = end;
+        fragment = (NfaFragment){split, end};
+    }
+    return fragment;
+}
 
-    // Draw title
+// Writes the regular expression a glob means into out, which needs length * 2 + 2 bytes. '*' and
+// '?' are any run and any one character, [...] and [!...] are classes, the rest is literal and it
+// has to match the whole name.
+u32 glob_to_regex(const char *glob, u32 length, char *out)
+{
+    u32 size = 0;
+    out[size++] = '^';
+    for(u32 i = 0; i < length; i++)
     {
-        static char title[19] = "Current Directory:";
+        char c = glob[i];
+        u32 close = i + 1;
+        if(c == '[')
+        {
+            if(close < length && (glob[close] == '!' || glob[close] == '^')) close++;
+            if(close < length && glob[close] == ']') close++;
+            while(close < length && glob[close] != ']') close++;
+        }
 
-        for(u32 i = 0; i < 18; i++)
+        if(c == '*')
+        {
+            out[size++] = '.';
+            out[size++] = '*';
+        }
+        else if(c == '?')
         {
-            tb_change_cell(i + screen->x, screen->y, (u32)title[i], TB_WHITE, TB_BLACK);
+            out[size++] = '.';
         }
-        for(u32 i = 0; i < screen->current_directory->length; i++)
+        else if(c == '[' && close < length)
         {
-            tb_change_cell(i + screen->x + 18, screen->y, (u32)screen->current_directory->start[i], TB_WHITE, TB_BLACK);
+            out[size++] = '[';
+            i++;
+            if(glob[i] == '!' || glob[i] == '^')
+            {
+                out[size++] = '^';
+                i++;
+            }
+            for(; i < close; i++)
+            {
+                if(glob[i] == '\\') out[size++] = '\\';
+                out[size++] = glob[i];
+            }
+            out[size++] = ']';
+        }
+        else
+        {
+            // Including a '[' that's never closed
+            if(c && strchr("\\.+()|^$[]", c)) out[size++] = '\\';
+            out[size++] = c;
         }
     }
-    draw_text(NULL, screen->x, screen->y + screen->height);
+    out[size++] = '$';
+    return size;
+}
 
-    u32 end_y;
-    if(screen->num_lines < screen->view_range_end)
+// NULL if the pattern doesn't parse or needs more than MAX_DFA_STATES.
+Filter *filter_compile(String *pattern)
+{
+    const char *text = pattern->start;
+    u32 length = pattern->length;
+    char *regex = NULL;
+    if(length && text[0] == '/')
     {
-        end_y = screen->num_lines;
+        text++;
+        length--;
     }
     else
     {
-        end_y = screen->view_range_end;
+        regex = (char*)malloc(length * 2 + 2);
+        length = glob_to_regex(text, length, regex);
+        text = regex;
     }
 
-    for(u32 y = screen->view_range_start; y < end_y; y++)
+    FilterParser parser = {};
+    parser.text   = text;
+    parser.length = length;
+    NfaFragment fragment = parse_alternation(&parser, true);
+    if(parser.at < parser.length) parser.error = true;
+    parser.states[fragment.end].out = nfa_state(&parser, NFA_MATCH, 0, 0, 0);
+
+    Filter *filter = parser.error ? NULL : filter_build(&parser, fragment.start);
+    if(filter) filter->pattern = string_copy(pattern);
+    free(parser.states);
+    free(parser.sets);
+    free(regex);
+    return filter;
+}
+
+// Adds state and everything it reaches without a byte to the closure, keeping only the states that
+// matter to a DFA state, the byte sets and the match.
+void nfa_closure(FilterParser *parser, u32 state, u32 *marks, u32 mark, u32 *stack, u32 *closure, u32 *count)
+{
+    u32 top = 0;
+    stack[top++] = state;
+    while(top)
     {
-        Line line = screen->buffer[y];
-        // TODO(Luke): Make this robust
-        if(line.is_dir)
+        u32 next = stack[--top];
+        if(marks[next] == mark) continue;
+        marks[next] = mark;
+        NfaState *nfa = &parser->states[next];
+        if(nfa->type == NFA_SPLIT)
         {
-            u32 end_line = line.text->length + screen->x + global_terminal_width * (screen->y + y - screen->view_range_start + 1);
-            tb_buffer[end_line].ch = (u32)'/';
-            tb_buffer[end_line].fg = TB_WHITE;
-            tb_buffer[end_line].bg = y == screen->current_line ? TB_BLUE : TB_BLACK;
+            stack[top++] = nfa->out1;
+            stack[top++] = nfa->out;
         }
-
-        u32 end_x;
-        if(screen->x + screen->width < line.text->length)
+        else if(nfa->type == NFA_EMPTY)
         {
-            end_x = screen->x + screen->width;
+            stack[top++] = nfa->out;
         }
         else
         {
-            end_x = line.text->length;
+            closure[(*count)++] = next;
         }
-
-        for(u32 x = 0; x < end_x; x++)
-        {
-            u32 tb_index = screen->x + x + global_terminal_width * (screen->y + y - screen->view_range_start + 1);
-            tb_buffer[tb_index].ch = (u32)line.text->start[x];
-            tb_buffer[tb_index].fg = TB_WHITE;
-            tb_buffer[tb_index].bg = y == screen->current_line ? TB_BLUE : TB_BLACK;
-        }
-    }
-
-    for(u32 i = 0; i < global_terminal_width; i++)
-    {
-        u32 index = i + global_terminal_width * (screen->y + screen->height - 1);
-        tb_buffer[index].fg = TB_WHITE | TB_UNDERLINE;
     }
+}
 
-    tb_present();
+int compare_u32(const void *a, const void *b)
+{
+    u32 x = *(const u32*)a;
+    u32 y = *(const u32*)b;
+    return x < y ? -1 : x > y;
 }
 
-void update_visual_screen(Buffer *screen, u32 start, u32 end)
+// Subset construction. A DFA state is the sorted set of NFA states it stands for, packed into
+// members and found again through a hash table of them.
+Filter *filter_build(FilterParser *parser, u32 start)
 {
-    struct tb_cell *tb_buffer = tb_cell_buffer();
+    Filter *filter = (Filter*)calloc(1, sizeof(Filter));
 
-    // Draw title
+    // Two bytes share a class when every set has both or neither
+    u32 num_classes = 1;
+    for(u32 set = 0; set < parser->num_sets; set++)
     {
-        static char title[19] = "Current Directory:";
-
-        for(u32 i = 0; i < 18; i++)
-        {
-            tb_change_cell(i + screen->x, screen->y, (u32)title[i], TB_WHITE, TB_BLACK);
-        }
-        for(u32 i = 0; i < screen->current_directory->length; i++)
+        u64 *bits = parser->sets + set * 4;
+        i16 split[512];
+        memset(split, -1, sizeof(split));
+        num_classes = 0;
+        for(u32 c = 0; c < 256; c++)
         {
-            tb_change_cell(i + screen->x + 18, screen->y, (u32)screen->current_directory->start[i], TB_WHITE, TB_BLACK);
+            u32 key = filter->classes[c] * 2 + ((bits[c >> 6] >> (c & 63)) & 1);
+            if(split[key] < 0) split[key] = num_classes++;
+            filter->classes[c] = (u8)split[key];
         }
     }
-    draw_text(NULL, screen->x, screen->y + screen->height);
+    u8 representative[256];
+    for(u32 c = 256; c-- > 0;) representative[filter->classes[c]] = (u8)c;
+    filter->num_classes = num_classes;
 
-    u32 end_y;
-    if(screen->num_lines < screen->view_range_end)
-    {
-        end_y = screen->num_lines;
-    }
-    else
-    {
-        end_y = screen->view_range_end;
-    }
+    u32 num_nfa = parser->num_states;
+    u32 *marks = (u32*)calloc(num_nfa, sizeof(u32));
+    u32 *stack = (u32*)malloc(sizeof(u32) * (num_nfa * 2 + 1));
+    u32 *closure = (u32*)malloc(sizeof(u32) * num_nfa);
+    u32 mark = 0;
+    u32 members_capacity = 256;
+    u32 *members = (u32*)malloc(sizeof(u32) * members_capacity);
+    // Members of state n are starts[n] up to starts[n + 1]
+    u32 *starts = (u32*)malloc(sizeof(u32) * (MAX_DFA_STATES + 1));
+    u32 table[MAX_DFA_STATES * 2] = {0};
+    u32 *transitions = (u32*)calloc((u64)MAX_DFA_STATES * num_classes, sizeof(u32));
+    u8 *accepting = (u8*)calloc(MAX_DFA_STATES, 1);
 
-    for(u32 y = screen->view_range_start; y < end_y; y++)
+    // State 0 is the empty set, dead, and going round it once makes the start state
+    starts[0] = 0;
+    starts[1] = 0;
+    u32 num_states = 1;
+    b32 failed = false;
+    for(u32 state = 0; state < num_states && !failed; state++)
     {
-        Line line = screen->buffer[y];
-        // TODO(Luke): Make this robust
-        if(line.is_dir)
+        for(u32 c = 0; c < (state ? num_classes : 1); c++)
         {
-            u32 end_line = line.text->length + screen->x + global_terminal_width * (screen->y + y - screen->view_range_start + 1);
-            tb_buffer[end_line].ch = (u32)'/';
-            tb_buffer[end_line].fg = TB_WHITE;
+            u32 count = 0;
+            mark++;
+            if(state == 0)
+            {
+                nfa_closure(parser, start, marks, mark, stack, closure, &count);
+            }
+            else
+            {
+                u8 byte = representative[c];
+                for(u32 m = starts[state]; m < starts[state + 1]; m++)
+                {
+                    NfaState *nfa = &parser->states[members[m]];
+                    if(nfa->type != NFA_SET) continue;
+                    u64 *bits = parser->sets + nfa->set * 4;
+                    if((bits[byte >> 6] >> (byte & 63)) & 1) nfa_closure(parser, nfa->out, marks, mark, stack, closure, &count);
+                }
+            }
+            qsort(closure, count, sizeof(u32), compare_u32);
+
+            u32 next = 0;
+            if(count)
+            {
+                u32 hash = 2166136261u;
+                for(u32 i = 0; i < count; i++) hash = (hash ^ closure[i]) * 16777619u;
+                u32 slot = hash & (MAX_DFA_STATES * 2 - 1);
+                while(table[slot])
+                {
+                    u32 other = table[slot];
+                    u32 other_count = starts[other + 1] - starts[other];
+                    if(other_count == count && !memcmp(members + starts[other], closure, sizeof(u32) * count)) break;
+                    slot = (slot + 1) & (MAX_DFA_STATES * 2 - 1);
+                }
+                next = table[slot];
+                if(!next && num_states == MAX_DFA_STATES)
+                {
+                    failed = true;
+                    break;
+                }
+                if(!next)
+                {
+                    next = num_states++;
+                    table[slot] = next;
+                    u32 used = starts[next];
+                    while(used + count > members_capacity)
+                    {
+                        members_capacity *= 2;
+                        members = (u32*)realloc(members, sizeof(u32) * members_capacity);
+                    }
+                    memcpy(members + used, closure, sizeof(u32) * count);
+                    starts[next + 1] = used + count;
+                    for(u32 i = 0; i < count; i++) accepting[next] |= parser->states[closure[i]].type == NFA_MATCH;
+                }
+            }
+            if(state) transitions[state * num_classes + c] = next;
+        }
+    }
+    free(marks);
+    free(stack);
+    free(closure);
+    free(members);
+    free(starts);
+    if(failed)
+    {
+        free(transitions);
+        free(accepting);
+        free(filter);
+        return NULL;
+    }
+    filter->num_states  = num_states;
+    filter->transitions = (u32*)realloc(transitions, sizeof(u32) * num_states * num_classes);
+    filter->accepting   = (u8*)realloc(accepting, num_states);
+    return filter;
+}
+
+b32 filter_match(Filter *filter, const char *name, u32 length)
+{
+    u32 state = 1;
+    for(u32 i = 0; i < length && state; i++)
+    {
+        state = filter->transitions[state * filter->num_classes + filter->classes[(u8)name[i]]];
+    }
+    return filter->accepting[state];
+}
+
+void filter_chunk(FilterChunk *chunk)
+{
+    Listing *listing = chunk->listing;
+    for(u32 i = 0; i < chunk->count; i++)
+    {
+        u32 line = chunk->lines[i];
+        chunk->verdicts[line] = filter_match(chunk->filter, listing->blob + listing->offsets[line], listing->lengths[line]);
+    }
+}
+
+// Runs chunks of run until none are left unclaimed.
+void filter_claim(FilterRun *run)
+{
+    u32 done = 0;
+    for(u32 i; (i = atomic_fetch_add(&run->next, 1)) < run->num_chunks; done++) filter_chunk(&run->chunks[i]);
+    if(!done) return;
+    pthread_mutex_lock(&run->lock);
+    run->finished += done;
+    if(run->finished == run->num_chunks) pthread_cond_signal(&run->done);
+    pthread_mutex_unlock(&run->lock);
+}
+
+void filter_run_release(FilterRun *run)
+{
+    if(atomic_fetch_sub(&run->refs, 1) != 1) return;
+    pthread_mutex_destroy(&run->lock);
+    pthread_cond_destroy(&run->done);
+    free(run);
+}
+
+// Runs on the interactive pool. A task that only gets going after the run is over finds nothing
+// to claim, which is fine since the pool is shared and could be busy with anything.
+void filter_task(void *data)
+{
+    FilterRun *run = (FilterRun*)data;
+    filter_claim(run);
+    filter_run_release(run);
+}
+
+// Works out which of listing's lines the filter keeps. Both listings are in name order so the
+// verdicts of names the last one also had carry over in one walk, only new names are run.
+void filter_listing(Filter *filter, Listing *listing)
+{
+    if(filter->listing == listing && filter->num_lines == listing->num_lines) return;
+    u8 *verdicts = (u8*)malloc(listing->num_lines ? listing->num_lines : 1);
+    u32 *pending = (u32*)arena_alloc(&global_frame_arena, sizeof(u32) * (listing->num_lines + 1));
+    u32 count = 0;
+    Listing *old = filter->listing;
+    if(old == listing)
+    {
+        // A flat listing only grows at the end, so only its new lines are run
+        memcpy(verdicts, filter->verdicts, filter->num_lines);
+        for(u32 i = filter->num_lines; i < listing->num_lines; i++) pending[count++] = i;
+    }
+    for(u32 part = 0; part < 2 && old != listing; part++)
+    {
+        u32 i       = part ? listing->files_start : 0;
+        u32 end     = part ? listing->num_lines : listing->files_start;
+        // Flat lines aren't in name order and have no ids, so nothing carries over to or from them
+        b32 carry   = old && !old->flat && !listing->flat;
+        u32 j       = !carry ? 0 : part ? old->files_start : 0;
+        u32 old_end = !carry ? 0 : part ? old->num_lines : old->files_start;
+        while(i < end)
+        {
+            if(j < old_end && old->names[j] == listing->names[i])
+            {
+                verdicts[i++] = filter->verdicts[j++];
+            }
+            else if(j < old_end && string_compare_chars(old->blob + old->offsets[j], old->lengths[j],
+                                                        listing->blob + listing->offsets[i], listing->lengths[i]))
+            {
+                j++;
+            }
+            else
+            {
+                pending[count++] = i++;
+            }
+        }
+    }
+    atomic_fetch_add(&global_stats.filter_runs, count);
+    atomic_fetch_add(&global_stats.filter_reuses, listing->num_lines - count);
+
+    if(count < FILTER_PARALLEL_LINES)
+    {
+        FilterChunk chunk = {filter, listing, pending, count, verdicts};
+        filter_chunk(&chunk);
+    }
+    else
+    {
+        // Workers join in as they come free, this thread claims chunks alongside them and only
+        // waits for the ones they started. Queued work ahead of the tasks can't hold it up.
+        u32 num_chunks = (count + FILTER_CHUNK - 1) / FILTER_CHUNK;
+        FilterRun *run = (FilterRun*)calloc(1, sizeof(FilterRun) + sizeof(FilterChunk) * num_chunks);
+        pthread_mutex_init(&run->lock, NULL);
+        pthread_cond_init(&run->done, NULL);
+        run->num_chunks = num_chunks;
+        for(u32 i = 0; i < num_chunks; i++)
+        {
+            u32 first = i * FILTER_CHUNK;
+            u32 size = count - first < FILTER_CHUNK ? count - first : FILTER_CHUNK;
+            run->chunks[i] = (FilterChunk){filter, listing, pending + first, size, verdicts};
+        }
+        WorkerPool *pool = &global_pools[PRIORITY_INTERACTIVE];
+        u32 num_tasks = pool->num_threads < num_chunks - 1 ? pool->num_threads : num_chunks - 1;
+        atomic_init(&run->refs, num_tasks + 1);
+        for(u32 i = 0; i < num_tasks; i++) pool_submit(pool, filter_task, run);
+
+        filter_claim(run);
+        pthread_mutex_lock(&run->lock);
+        while(run->finished < run->num_chunks) pthread_cond_wait(&run->done, &run->lock);
+        pthread_mutex_unlock(&run->lock);
+        filter_run_release(run);
+    }
+
+    listing->refs++;
+    listing_release(old);
+    free(filter->verdicts);
+    filter->listing   = listing;
+    filter->num_lines = listing->num_lines;
+    filter->verdicts  = verdicts;
+}
+
+// Whether line of the listing the filter last ran over is shown. . and .. always are so a buffer
+// is never empty and there's a way out.
+b32 filter_keeps(Filter *filter, Listing *listing, u32 line)
+{
+    const char *name = listing->blob + listing->offsets[line];
+    b32 dots = name[0] == '.' && (listing->lengths[line] == 1 || (listing->lengths[line] == 2 && name[1] == '.'));
+    return filter->verdicts[line] || dots;
+}
+
+void filter_free(Filter *filter)
+{
+    if(!filter) return;
+    listing_release(filter->listing);
+    if(filter->pattern) string_free(filter->pattern);
+    free(filter->transitions);
+    free(filter->accepting);
+    free(filter->verdicts);
+    free(filter);
+}
+
+// Replaces the buffer's filter with pattern compiled, or removes it when pattern is empty.
+void apply_filter(Buffer *screen, String *pattern)
+{
+    Filter *filter = NULL;
+    if(pattern->length)
+    {
+        filter = filter_compile(pattern);
+        if(!filter)
+        {
+            draw_error(screen, "Bad filter pattern");
+            return;
+        }
+    }
+    filter_free(screen->filter);
+    screen->filter = filter;
+    resort_buffer(screen);
+}
+
+void exec_search(Buffer *screen, SearchBuffer *results, String *query)
+{
+    u64 mallocs = thread_mallocs;
+    screen->listing->refs++;
+    listing_release(results->listing);
+    results->listing = screen->listing;
+
+    Listing *listing = screen->listing;
+    if(listing->num_lines > results->capacity)
+    {
+        results->capacity = listing->num_lines;
+        results->matches  = (u32*)realloc(results->matches, sizeof(u32) * results->capacity);
+    }
+
+    // The results are only indices into the listing, scanned in the buffer's order
+    u32 *matches = (u32*)arena_alloc(&global_frame_arena, sizeof(u32) * (screen->num_lines + 1));
+    u32 count = 0;
+    for(u32 row = 0; row < screen->num_lines; row++)
+    {
+        u32 i = line_at(screen, row);
+        if(query->length == 0 || search_test(listing->blob + listing->offsets[i], listing->lengths[i], query, NULL, NULL))
+        {
+            matches[count++] = i;
+        }
+    }
+    results->num_lines = count;
+
+    u32 max_height            = screen->height / 4;
+    results->view_range_start = 0;
+    results->current_line     = 0;
+    results->query_x          = screen->x;
+    results->query_y          = screen->y + screen->height;
+    results->x                = screen->x;
+    results->width            = screen->width / 2;
+    if(results->num_lines > max_height)
+    {
+        results->height = max_height;
+        results->y = screen->y + screen->height - max_height;
+    }
+    else
+    {
+        results->height = results->num_lines;
+        results->y = screen->y + screen->height - results->num_lines;
+    }
+    results->view_range_end = results->height;
+
+    // Sort search results by string length. The idea is that shorter strings are closer matches than long strings
+    // with this search system. And there's always more letters that you can add to close in on any longer strings
+    // Names are at most NAME_MAX long so it's a counting sort, stable so equal lengths keep the buffer's order.
+    // A flat view's paths can be longer, those all share the last length.
+    u32 starts[NAME_MAX + 2] = {0};
+    for(u32 i = 0; i < count; i++)
+    {
+        u32 length = listing->lengths[matches[i]];
+        starts[(length < NAME_MAX ? length : NAME_MAX) + 1]++;
+    }
+    for(u32 length = 1; length < NAME_MAX + 2; length++) starts[length] += starts[length - 1];
+    for(u32 i = 0; i < count; i++)
+    {
+        u32 length = listing->lengths[matches[i]];
+        u32 index = starts[length < NAME_MAX ? length : NAME_MAX]++;
+        results->matches[index] = matches[i];
+    }
+    atomic_fetch_add(&global_stats.searches, 1);
+    atomic_fetch_add(&global_stats.search_mallocs, thread_mallocs - mallocs);
+}
+
+void background(u16 bg)
+{
+    struct tb_cell *tb_buffer = tb_cell_buffer();
+    u32 length = global_terminal_width * global_terminal_height;
+    for(u32 i = 0; i < length; i++)
+    {
+        tb_buffer[i].ch = (u32)' ';
+        tb_buffer[i].bg = bg;
+    }
+    tb_present();
+}
+
+// A pane squeezed below the minimum size by a resize isn't drawn, its rows and columns can run
+// past the terminal's.
+b32 buffer_hidden(Buffer *screen)
+{
+    return screen->tile && (screen->tile->width < MIN_PANE_WIDTH || screen->tile->height < MIN_PANE_HEIGHT);
+}
+
+void clear_normal_buffer_area(Buffer *screen)
+{
+    if(buffer_hidden(screen)) return;
+    struct tb_cell *tb_buffer = tb_cell_buffer();
+
+    for(u32 y = screen->y; y < screen->y + screen->height; y++)
+    {
+        for(u32 x = screen->x; x < screen->x + screen->width; x++)
+        {
+            u32 tb_index = x + global_terminal_width * y;
+            tb_buffer[tb_index].ch = (u32)' ';
+            tb_buffer[tb_index].bg = TB_BLACK;
+        }
+    }
+    tb_present();
+}
+
+// Pass zero for query_length to not clear the query
+void clear_search_buffer_area(SearchBuffer *results, u32 query_length)
+{
+    struct tb_cell *tb_buffer = tb_cell_buffer();
+    u32 tb_index = global_terminal_width * results->query_y;
+
+    // Clear query
+    clear_text(results->query_x, results->query_y, query_length);
+
+    // Clear rest of buffer
+    tb_index = global_terminal_width * results->y;
+    for(u32 y = results->y; y < results->y + results->height; y++)
+    {
+        for(u32 x = results->x; x < results->x + results->width; x++)
+        {
+            tb_buffer[tb_index + x].ch = (u32)' ';
+            tb_buffer[tb_index + x].bg = TB_BLACK;
+        }
+        tb_index += global_terminal_width;
+    }
+    tb_present();
+}
+
+void draw_title(Buffer *screen)
+{
+    static char title[19] = "Current Directory:";
+    static const char *sort_names[NUM_SORTS] = {"", " (natural)", " (extension)", " (size)", " (modified)", " (disk usage)"};
+
+    // Cut off at the pane's edge so it doesn't run into the pane next to it
+    u32 end = screen->x + screen->width;
+    for(u32 i = 0; i < 18 && i + screen->x < end; i++)
+    {
+        tb_change_cell(i + screen->x, screen->y, (u32)title[i], TB_WHITE, TB_BLACK);
+    }
+    for(u32 i = 0; i < screen->current_directory->length && i + screen->x + 18 < end; i++)
+    {
+        tb_change_cell(i + screen->x + 18, screen->y, (u32)screen->current_directory->start[i], TB_WHITE, TB_BLACK);
+    }
+    // Cleared to the pane's edge so switching back doesn't leave any of it behind
+    char suffix[64];
+    u32 length = snprintf(suffix, sizeof(suffix), "%s", sort_names[screen->sort]);
+    if(screen->tree && length < sizeof(suffix))
+    {
+        length += snprintf(suffix + length, sizeof(suffix) - length, " (tree)");
+    }
+    else if(screen->listing->flat && length < sizeof(suffix))
+    {
+        FlatWalk *walk = screen->walk;
+        const char *state = !walk ? "" : walk->active ? ", walking" : atomic_load(&walk->truncated) ? ", truncated" : "";
+        length += snprintf(suffix + length, sizeof(suffix) - length, " (flat%s)", state);
+    }
+    if(screen->filter && length < sizeof(suffix))
+    {
+        String *pattern = screen->filter->pattern;
+        length += snprintf(suffix + length, sizeof(suffix) - length, " [%.*s]", (int)pattern->length, pattern->start);
+    }
+    if(length > sizeof(suffix) - 1) length = sizeof(suffix) - 1;
+    u32 x = screen->x + 18 + screen->current_directory->length;
+    for(u32 i = 0; x + i < end; i++)
+    {
+        tb_change_cell(x + i, screen->y, (u32)(i < length ? suffix[i] : ' '), TB_WHITE, TB_BLACK);
+    }
+}
+
+void update_screen(Buffer *screen)
+{
+    if(buffer_hidden(screen)) return;
+    struct tb_cell *tb_buffer = tb_cell_buffer();
+
+    draw_title(screen);
+    draw_text(NULL, screen->x, screen->y + screen->height);
+
+    u32 end_y;
+    if(screen->num_lines < screen->view_range_end)
+    {
+        end_y = screen->num_lines;
+    }
+    else
+    {
+        end_y = screen->view_range_end;
+    }
+
+    request_metadata(screen);
+    request_usage(screen);
+    u32 name_width = global_show_metadata && screen->width >= META_WIDTH * 2 ? screen->width - META_WIDTH : screen->width;
+    for(u32 y = screen->view_range_start; y < end_y; y++)
+    {
+        Listing *listing = screen->listing;
+        u32 line = line_at(screen, y);
+        const char *text = listing->blob + listing->offsets[line];
+        u32 length = listing->lengths[line];
+        u32 indent = draw_tree_indent(screen, line, y, &text, &length);
+        u32 left = screen->x + indent;
+        u32 width = name_width - indent;
+        if((listing->flags[line] & LINE_DIR) && length < width)
+        {
+            u32 end_line = length + left + global_terminal_width * (screen->y + y - screen->view_range_start + 1);
+            tb_buffer[end_line].ch = (u32)'/';
+            tb_buffer[end_line].fg = TB_WHITE;
             tb_buffer[end_line].bg = y == screen->current_line ? TB_BLUE : TB_BLACK;
         }
 
         u32 end_x;
-        if(screen->x + screen->width < line.text->length)
+        if(width < length)
         {
-            end_x = screen->x + screen->width;
+            end_x = width;
         }
         else
         {
-            end_x = line.text->length;
+            end_x = length;
+        }
+
+        for(u32 x = 0; x < end_x; x++)
+        {
+            u32 tb_index = left + x + global_terminal_width * (screen->y + y - screen->view_range_start + 1);
+            tb_buffer[tb_index].ch = (u32)text[x];
+            tb_buffer[tb_index].fg = TB_WHITE;
+            tb_buffer[tb_index].bg = y == screen->current_line ? TB_BLUE : TB_BLACK;
+        }
+        draw_metadata(screen, y, y == screen->current_line ? TB_BLUE : TB_BLACK);
+    }
+
+    for(u32 i = screen->x; i < screen->x + screen->width; i++)
+    {
+        u32 index = i + global_terminal_width * (screen->y + screen->height - 1);
+        tb_buffer[index].fg = TB_WHITE | TB_UNDERLINE;
+    }
+
+    tb_present();
+}
+
+void update_visual_screen(Buffer *screen, u32 start, u32 end)
+{
+    if(buffer_hidden(screen)) return;
+    struct tb_cell *tb_buffer = tb_cell_buffer();
+
+    draw_title(screen);
+    draw_text(NULL, screen->x, screen->y + screen->height);
+
+    u32 end_y;
+    if(screen->num_lines < screen->view_range_end)
+    {
+        end_y = screen->num_lines;
+    }
+    else
+    {
+        end_y = screen->view_range_end;
+    }
+
+    request_metadata(screen);
+    request_usage(screen);
+    u32 name_width = global_show_metadata && screen->width >= META_WIDTH * 2 ? screen->width - META_WIDTH : screen->width;
+    for(u32 y = screen->view_range_start; y < end_y; y++)
+    {
+        Listing *listing = screen->listing;
+        u32 line = line_at(screen, y);
+        const char *text = listing->blob + listing->offsets[line];
+        u32 length = listing->lengths[line];
+        u32 indent = draw_tree_indent(screen, line, y, &text, &length);
+        u32 left = screen->x + indent;
+        u32 width = name_width - indent;
+        if((listing->flags[line] & LINE_DIR) && length < width)
+        {
+            u32 end_line = length + left + global_terminal_width * (screen->y + y - screen->view_range_start + 1);
+            tb_buffer[end_line].ch = (u32)'/';
+            tb_buffer[end_line].fg = TB_WHITE;
+            tb_buffer[end_line].bg = y == screen->current_line ? TB_BLUE : TB_BLACK;
+        }
+
+        u32 end_x;
+        if(width < length)
+        {
+            end_x = width;
+        }
+        else
+        {
+            end_x = length;
+        }
+
+        for(u32 x = 0; x < end_x; x++)
+        {
+            u32 tb_index = left + x + global_terminal_width * (screen->y + y - screen->view_range_start + 1);
+            tb_buffer[tb_index].ch = (u32)text[x];
+            tb_buffer[tb_index].fg = TB_WHITE;
+            if(y >= start && y < end)
+            {
+                tb_buffer[tb_index].bg = TB_BLUE;
+            }
+            else
+            {
+                tb_buffer[tb_index].bg = TB_BLACK;
+            }
+        }
+        draw_metadata(screen, y, y >= start && y < end ? TB_BLUE : TB_BLACK);
+    }
+
+    for(u32 i = screen->x; i < screen->x + screen->width; i++)
+    {
+        u32 index = i + global_terminal_width * (screen->y + screen->height - 1);
+        tb_buffer[index].fg = TB_WHITE | TB_UNDERLINE;
+    }
+
+    tb_present();
+}
+
+void update_search_screen(SearchBuffer *results)
+{
+    struct tb_cell *tb_buffer = tb_cell_buffer();
+
+    // Draw query bar
+    draw_text(results->query, results->query_x, results->query_y);
+
+    u32 end;
+    if(results->num_lines < results->view_range_end)
+    {
+        end = results->num_lines;
+    }
+    else
+    {
+        end = results->view_range_end;
+    }
+
+    // Spans for one result at a time, only the visible ones are matched again
+    Listing *listing = results->listing;
+    u32 query_length = results->query ? results->query->length : 0;
+    MatchSpan *spans = (MatchSpan*)arena_alloc(&global_frame_arena, sizeof(MatchSpan) * (query_length + 1));
+    for(u32 y = results->view_range_start; y < end; y++)
+    {
+        u32 line = results->matches[y];
+        const char *text = listing->blob + listing->offsets[line];
+        u32 length = listing->lengths[line];
+        u32 num_spans = 0;
+        if(query_length) search_test(text, length, results->query, spans, &num_spans);
+        u32 span = 0;
+        // Flat view paths can be wider than the results, whatever doesn't fit is cut off
+        u32 visible = length < results->width ? length : results->width;
+
+        u16 bg = y == results->current_line ? TB_MAGENTA : TB_WHITE;
+        for(u32 x = 0; x < visible; x++)
+        {
+            u32 tb_index = x + results->x + global_terminal_width * (y - results->view_range_start + results->y);
+            tb_buffer[tb_index].ch = (u32)text[x];
+            u16 fg = y == results->current_line ? TB_WHITE : TB_BLACK;
+            while(span < num_spans && spans[span].start + spans[span].length <= x) span++;
+            if(span < num_spans && spans[span].start <= x) fg |= TB_BOLD;
+            tb_buffer[tb_index].fg = fg;
+            tb_buffer[tb_index].bg = bg;
+        }
+        for(u32 x = visible; x < results->width; x++)
+        {
+            u32 tb_index = x + results->x + global_terminal_width * (y - results->view_range_start + results->y);
+            tb_buffer[tb_index].ch = (u32)' ';
+            tb_buffer[tb_index].bg = bg;
+        }
+        if((listing->flags[line] & LINE_DIR) && length < results->width)
+        {
+            u32 end_line = length + results->x + global_terminal_width * (y - results->view_range_start + results->y);
+            tb_buffer[end_line].ch = (u32)'/';
+            tb_buffer[end_line].fg = TB_WHITE;
+            tb_buffer[end_line].bg = y == results->current_line ? TB_BLUE : TB_BLACK;
+        }
+    }
+    tb_present();
+}
+
+void draw_search_overlay(Buffer *screen, SearchBuffer *results)
+{
+    clear_normal_buffer_area(screen);
+    u32 original_view_end = screen->view_range_end;
+    if(screen->num_lines < screen->height - 1 - results->height)
+    {
+        update_screen(screen);
+    }
+    else
+    {
+        screen->view_range_end  = screen->view_range_start + (screen->height - 1 - results->height);
+        update_screen(screen);
+        screen->view_range_end = original_view_end;
+    }
+    update_search_screen(results);
+}
+
+int pop_directory(String *path)
+{
+    i32 index = (i32)(path->length - 1);
+    char c;
+
+    while(index >= 0)
+    {
+        c = path->start[index];
+        index--;
+        path->length--;
+        if(c == '/') return 1;
+    }
+    return 0;
+}
+
+void push_directory(String *path, String *dir)
+{
+    string_push(path, '/');
+    string_concat(path, dir);
+}
+
+// Reads and name sorts a directory. The listing starts with one reference, owned by the caller.
+// Safe to call from workers. Stops reading early, leaving a partial listing, once cancelled is set.
+Listing *listing_read(int dir_fd, atomic_int *cancelled)
+{
+    Listing *listing = (Listing*)calloc(1, sizeof(Listing));
+    struct stat statbuf;
+    if(fstat(dir_fd, &statbuf) == 0)
+    {
+        listing->id.dev = statbuf.st_dev;
+        listing->id.ino = statbuf.st_ino;
+        listing->mtime  = statbuf.st_mtim;
+    }
+    listing->refs = 1;
+
+    // Read in directory order first, everything is laid out again in name order below
+    u32 capacity = 128;
+    u32 blob_capacity = 4096;
+    u32 blob_size = 0;
+    char *blob = (char*)malloc(blob_capacity);
+    u32 *offsets = (u32*)malloc(sizeof(u32) * capacity);
+    u16 *lengths = (u16*)malloc(sizeof(u16) * capacity);
+    u8 *flags = (u8*)malloc(capacity);
+
+    struct dirent *dir;
+    // A fresh open file description so reading doesn't move dir_fd's offset
+    int fd = openat(dir_fd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    DIR *cwd = fd >= 0 ? fdopendir(fd) : NULL;
+    if(!cwd && fd >= 0) close(fd);
+    u32 count = 0;
+    u32 dir_end = 0;
+    while(cwd && (dir = readdir(cwd)))
+    {
+        if(cancelled && (count & 255) == 0 && atomic_load_explicit(cancelled, memory_order_relaxed)) break;
+        if(count >= capacity)
+        {
+            capacity *= 2;
+            offsets = (u32*)realloc(offsets, sizeof(u32) * capacity);
+            lengths = (u16*)realloc(lengths, sizeof(u16) * capacity);
+            flags   = (u8*)realloc(flags, capacity);
+        }
+        u32 length = strlen(dir->d_name);
+        if(blob_size + length + 1 > blob_capacity)
+        {
+            while(blob_size + length + 1 > blob_capacity) blob_capacity *= 2;
+            blob = (char*)realloc(blob, blob_capacity);
+        }
+        memcpy(blob + blob_size, dir->d_name, length + 1);
+        offsets[count] = blob_size;
+        lengths[count] = length;
+        flags[count]   = dir->d_type == DT_DIR ? LINE_DIR : 0;
+        blob_size += length + 1;
+        if(flags[count] & LINE_DIR) dir_end++;
+        count++;
+    }
+    if(cwd) closedir(cwd);
+
+    // Directories first then files, each in name order
+    u32 *order = (u32*)malloc(sizeof(u32) * (count ? count : 1));
+    u32 *temp = (u32*)malloc(sizeof(u32) * (count ? count : 1));
+    u32 next_dir = 0;
+    u32 next_file = dir_end;
+    for(u32 i = 0; i < count; i++) order[flags[i] & LINE_DIR ? next_dir++ : next_file++] = i;
+    name_sort(order, temp, dir_end, blob, offsets, lengths);
+    name_sort(order + dir_end, temp, count - dir_end, blob, offsets, lengths);
+
+    listing->num_lines   = count;
+    listing->files_start = dir_end;
+    listing->blob        = (char*)malloc(blob_size ? blob_size : 1);
+    listing->offsets     = (u32*)malloc(sizeof(u32) * (count ? count : 1));
+    listing->lengths     = (u16*)malloc(sizeof(u16) * (count ? count : 1));
+    listing->flags       = (u8*)malloc(count ? count : 1);
+    listing->names       = (u32*)malloc(sizeof(u32) * (count ? count : 1));
+    u32 offset = 0;
+    for(u32 i = 0; i < count; i++)
+    {
+        u32 from = order[i];
+        char *name = blob + offsets[from];
+        memcpy(listing->blob + offset, name, lengths[from] + 1);
+        listing->offsets[i] = offset;
+        listing->lengths[i] = lengths[from];
+        listing->flags[i]   = flags[from];
+        listing->names[i]   = name_intern(name, lengths[from]);
+        offset += lengths[from] + 1;
+    }
+    free(order);
+    free(temp);
+    free(blob);
+    free(offsets);
+    free(lengths);
+    free(flags);
+    return listing;
+}
+
+// Stable merge sort of indices into blob by case insensitive name. Safe on workers, unlike qsort
+// with a global for the listing.
+void name_sort(u32 *order, u32 *temp, u32 count, char *blob, u32 *offsets, u16 *lengths)
+{
+    if(count < 2) return;
+    u32 half = count / 2;
+    name_sort(order, temp, half, blob, offsets, lengths);
+    name_sort(order + half, temp, count - half, blob, offsets, lengths);
+
+    u32 i = 0;
+    u32 j = half;
+    u32 k = 0;
+    while(i < half && j < count)
+    {
+        u32 a = order[i];
+        u32 b = order[j];
+        // Right only goes first when strictly less, that keeps it stable
+        if(string_compare_chars(blob + offsets[b], lengths[b], blob + offsets[a], lengths[a])) temp[k++] = order[j++];
+        else temp[k++] = order[i++];
+    }
+    while(i < half) temp[k++] = order[i++];
+    while(j < count) temp[k++] = order[j++];
+    memcpy(order, temp, sizeof(u32) * count);
+}
+
+// Gives the listing its metadata and usage columns, all unknown to start with. Main thread only.
+void listing_add_metadata(Listing *listing)
+{
+    if(listing->meta_state) return;
+    u32 count = listing->capacity > listing->num_lines ? listing->capacity : listing->num_lines;
+    if(!count) count = 1;
+    listing->meta_state  = (u8*)calloc(count, sizeof(u8));
+    listing->modes       = (u16*)calloc(count, sizeof(u16));
+    listing->uids        = (u32*)calloc(count, sizeof(u32));
+    listing->sizes       = (u64*)calloc(count, sizeof(u64));
+    listing->mtimes      = (i64*)calloc(count, sizeof(i64));
+    listing->usage_state = (u8*)calloc(count, sizeof(u8));
+    listing->usages      = (u64*)calloc(count, sizeof(u64));
+}
+
+void listing_release(Listing *listing)
+{
+    if(!listing) return;
+    if(--listing->refs > 0)
+    {
+        if(listing->refs == listing->usage_pending) usage_cancel(listing);
+        return;
+    }
+    if(listing->usage_walk) usage_walk_release(listing->usage_walk);
+    pthread_mutex_lock(&global_names_lock);
+    for(u32 i = 0; !listing->flat && i < listing->num_lines; i++) name_release_locked(listing->names[i]);
+    pthread_mutex_unlock(&global_names_lock);
+    for(u32 i = 0; i < NUM_SORTS; i++) free(listing->keys[i]);
+    free(listing->blob);
+    free(listing->offsets);
+    free(listing->lengths);
+    free(listing->flags);
+    free(listing->names);
+    free(listing->meta_state);
+    free(listing->modes);
+    free(listing->uids);
+    free(listing->sizes);
+    free(listing->mtimes);
+    free(listing->usage_state);
+    free(listing->usages);
+    free(listing);
+}
+
+// Like string_compare but runs of digits compare by value, so file2 comes before file10.
+// Negative, zero or positive like strcmp.
+i32 natural_compare(const char *a, u32 length_a, const char *b, u32 length_b)
+{
+    u32 i = 0;
+    u32 j = 0;
+    while(i < length_a && j < length_b)
+    {
+        u8 ca = a[i];
+        u8 cb = b[j];
+        if(ca >= '0' && ca <= '9' && cb >= '0' && cb <= '9')
+        {
+            // Skip leading zeros, then the longer run is bigger, then the first differing digit decides
+            while(i < length_a && a[i] == '0') i++;
+            while(j < length_b && b[j] == '0') j++;
+            u32 start_a = i;
+            u32 start_b = j;
+            while(i < length_a && a[i] >= '0' && a[i] <= '9') i++;
+            while(j < length_b && b[j] >= '0' && b[j] <= '9') j++;
+            if(i - start_a != j - start_b) return (i32)(i - start_a) - (i32)(j - start_b);
+            i32 diff = memcmp(a + start_a, b + start_b, i - start_a);
+            if(diff) return diff;
+            continue;
+        }
+        ca = (ca >= 'A' && ca <= 'Z') ? ca + 32 : ca;
+        cb = (cb >= 'A' && cb <= 'Z') ? cb + 32 : cb;
+        if(ca != cb) return (i32)ca - (i32)cb;
+        i++;
+        j++;
+    }
+    return (i32)(length_a - i) - (i32)(length_b - j);
+}
+
+static Listing *natural_listing;
+
+static int natural_compare_indices(const void *a, const void *b)
+{
+    u32 index_a = *(const u32*)a;
+    u32 index_b = *(const u32*)b;
+    Listing *listing = natural_listing;
+    i32 diff = natural_compare(listing->blob + listing->offsets[index_a], listing->lengths[index_a],
+                               listing->blob + listing->offsets[index_b], listing->lengths[index_b]);
+    if(diff) return diff;
+    return index_a < index_b ? -1 : index_a > index_b;
+}
+
+// Builds, or returns the cached, keys for mode. Only key order matters: ties keep name order because
+// the radix sort is stable and starts from the name ordered lines.
+u64 *listing_keys(Listing *listing, SortMode mode)
+{
+    if(listing->keys[mode]) return listing->keys[mode];
+    const u64 file_bit = 1ULL << 63;
+    const u64 max_key = file_bit - 1;
+    u32 count = listing->num_lines;
+    u64 *keys = (u64*)calloc(count ? count : 1, sizeof(u64));
+
+    switch(mode)
+    {
+        case SORT_NAME:
+        for(u32 i = 0; i < count; i++) keys[i] = i;
+        break;
+
+        case SORT_NATURAL:
+        {
+            // The one mode that can't be packed from a single line, so it's ranked once up front
+            u32 *ranked = (u32*)malloc(sizeof(u32) * (count ? count : 1));
+            for(u32 i = 0; i < count; i++) ranked[i] = i;
+            natural_listing = listing;
+            qsort(ranked, listing->files_start, sizeof(u32), natural_compare_indices);
+            qsort(ranked + listing->files_start, count - listing->files_start, sizeof(u32), natural_compare_indices);
+            for(u32 rank = 0; rank < count; rank++) keys[ranked[rank]] = rank;
+            free(ranked);
+        } break;
+
+        case SORT_EXTENSION:
+        for(u32 i = listing->files_start; i < count; i++)
+        {
+            // First 7 bytes of the lower cased extension, big endian so it sorts like the string
+            const char *text = listing->blob + listing->offsets[i];
+            u32 length = listing->lengths[i];
+            u32 dot = length;
+            while(dot > 1 && text[dot - 1] != '.' && text[dot - 1] != '/') dot--;
+            u64 key = 0;
+            if(dot > 1 && text[dot - 1] == '.')
+            {
+                for(u32 j = 0; j < 7; j++)
+                {
+                    u8 c = dot + j < length ? text[dot + j] : 0;
+                    c = (c >= 'A' && c <= 'Z') ? c + 32 : c;
+                    key = (key << 8) | c;
+                }
+            }
+            keys[i] = key;
+        }
+        break;
+
+        case SORT_SIZE:
+        case SORT_MTIME:
+        case SORT_USAGE:
+        for(u32 i = 0; i < count; i++)
+        {
+            // Biggest and newest first, anything not stat'd or measured yet goes last
+            if(!listing->meta_state)
+            {
+                keys[i] = max_key;
+                continue;
+            }
+            b32 known = listing->meta_state[i] == META_DONE;
+            u64 value = mode == SORT_MTIME ? (u64)(listing->mtimes[i] + (1LL << 62)) : listing->sizes[i];
+            if(mode == SORT_USAGE && (listing->flags[i] & LINE_DIR))
+            {
+                known = listing->usage_state[i] == META_DONE;
+                value = listing->usages[i];
+            }
+            keys[i] = known ? max_key - (value > max_key ? max_key : value) : max_key;
+        }
+        break;
+
+        default: break;
+    }
+
+    // By flag rather than files_start, a tree's directories and files are mixed
+    for(u32 i = 0; i < count; i++) keys[i] |= listing->flags[i] & LINE_DIR ? 0 : file_bit;
+    listing->keys[mode] = keys;
+    return keys;
+}
+
+// Stable LSD radix sort of indices by keys[index], 16 bits a pass. Passes where every key has the
+// same digit are skipped, which for most modes is all but one or two.
+void radix_sort(u32 *order, u64 *keys, u32 count)
+{
+    u32 *temp = (u32*)malloc(sizeof(u32) * (count ? count : 1));
+    u32 *counts = (u32*)malloc(sizeof(u32) * 65536);
+    for(u32 shift = 0; shift < 64; shift += 16)
+    {
+        memset(counts, 0, sizeof(u32) * 65536);
+        for(u32 i = 0; i < count; i++) counts[(keys[order[i]] >> shift) & 0xFFFF]++;
+        if(count == 0 || counts[(keys[order[0]] >> shift) & 0xFFFF] == count) continue;
+
+        u32 total = 0;
+        for(u32 digit = 0; digit < 65536; digit++)
+        {
+            u32 current = counts[digit];
+            counts[digit] = total;
+            total += current;
+        }
+        for(u32 i = 0; i < count; i++) temp[counts[(keys[order[i]] >> shift) & 0xFFFF]++] = order[i];
+        memcpy(order, temp, sizeof(u32) * count);
+    }
+    free(counts);
+    free(temp);
+}
+
+// Rebuilds the buffer's order for its sort mode.
+void sort_buffer(Buffer *screen)
+{
+    Listing *listing = screen->listing;
+    if(listing->num_lines > screen->capacity || !screen->order)
+    {
+        screen->capacity = listing->num_lines > 100 ? listing->num_lines : 100;
+        screen->order = (u32*)realloc(screen->order, sizeof(u32) * screen->capacity);
+    }
+    if(screen->tree)
+    {
+        tree_order(screen);
+        return;
+    }
+    screen->num_lines   = listing->num_lines;
+    screen->files_start = listing->files_start;
+    for(u32 i = 0; i < listing->num_lines; i++) screen->order[i] = i;
+    if(screen->sort != SORT_NAME) radix_sort(screen->order, listing_keys(listing, screen->sort), listing->num_lines);
+
+    if(screen->filter)
+    {
+        // Hidden lines come out of the order, which keeps directories first
+        filter_listing(screen->filter, listing);
+        u32 kept = 0;
+        u32 dirs = 0;
+        for(u32 i = 0; i < listing->num_lines; i++)
+        {
+            u32 line = screen->order[i];
+            if(!filter_keeps(screen->filter, listing, line)) continue;
+            screen->order[kept++] = line;
+            if(line < listing->files_start) dirs++;
+        }
+        screen->num_lines   = kept;
+        screen->files_start = dirs;
+    }
+}
+
+// Takes over the caller's reference to listing and shows it where the cursor was last left in it,
+// or from the top.
+void set_listing(Buffer *screen, Listing *listing)
+{
+    if(screen->listing && screen->current_line < screen->num_lines)
+    {
+        screen->listing->saved_line = screen->order[screen->current_line];
+        screen->listing->saved_row  = screen->current_line - screen->view_range_start;
+    }
+    listing_release(screen->listing);
+    screen->listing          = listing;
+    screen->current_line     = 0;
+    screen->view_range_start = 0;
+    screen->view_range_end   = screen->height - 1;
+    sort_buffer(screen);
+
+    for(u32 i = 0; listing->saved_line && i < screen->num_lines; i++)
+    {
+        if(screen->order[i] != listing->saved_line) continue;
+        u32 row = listing->saved_row < screen->height - 1 ? listing->saved_row : 0;
+        screen->current_line     = i;
+        screen->view_range_start = i >= row ? i - row : 0;
+        screen->view_range_end   = screen->view_range_start + screen->height - 1;
+        break;
+    }
+}
+
+// Index of the line called name, or num_lines if there isn't one. Interned so only ids are compared.
+u32 listing_find(Listing *listing, u32 name)
+{
+    u32 i = 0;
+    while(i < listing->num_lines && listing->names[i] != name) i++;
+    return i;
+}
+
+// First line in [start, end) whose name begins with prefix ignoring case, or end if there isn't
+// one. start to end has to be one of the listing's name ordered partitions, directories or files.
+u32 listing_prefix_find(Listing *listing, u32 start, u32 end, const char *prefix, u32 length)
+{
+    // Names cut to the prefix's length are still in order, so it's a lower bound on those
+    u32 low = start;
+    u32 high = end;
+    while(low < high)
+    {
+        u32 mid = low + (high - low) / 2;
+        u32 cut = listing->lengths[mid] < length ? listing->lengths[mid] : length;
+        if(string_compare_chars(listing->blob + listing->offsets[mid], cut, prefix, length)) low = mid + 1;
+        else high = mid;
+    }
+    if(low == end || listing->lengths[low] < length) return end;
+    const char *name = listing->blob + listing->offsets[low];
+    if(string_compare_chars(prefix, length, name, length)) return end;
+    return low;
+}
+
+// Moves the cursor to the first directory, or failing that file, starting with prefix. False and
+// the cursor stays put if nothing does.
+b32 jump_to_prefix(Buffer *screen, String *prefix)
+{
+    Listing *listing = screen->listing;
+    if(listing->flat)
+    {
+        // Paths aren't in name order, so every row is looked at. It's the name after the last /
+        // that has to start with prefix.
+        for(u32 row = 0; row < screen->num_lines; row++)
+        {
+            u32 line = line_at(screen, row);
+            const char *end = listing->blob + listing->offsets[line] + listing->lengths[line];
+            const char *name = end;
+            while(name > listing->blob + listing->offsets[line] && name[-1] != '/') name--;
+            if((u32)(end - name) < prefix->length) continue;
+            if(string_compare_chars(name, prefix->length, prefix->start, prefix->length) ||
+               string_compare_chars(prefix->start, prefix->length, name, prefix->length)) continue;
+            jump_to_line(screen, row);
+            return true;
+        }
+        return false;
+    }
+    u32 line = 0;
+    u32 end = 0;
+    for(u32 part = 0; part < 2 && line == end; part++)
+    {
+        u32 start = part ? listing->files_start : 0;
+        end = part ? listing->num_lines : listing->files_start;
+        line = listing_prefix_find(listing, start, end, prefix->start, prefix->length);
+        // Names starting with prefix are all together, skip past any the filter hides
+        while(screen->filter && line < end && !filter_keeps(screen->filter, listing, line))
+        {
+            line++;
+            if(line < end && listing_prefix_find(listing, line, line + 1, prefix->start, prefix->length) != line) line = end;
+        }
+    }
+    if(line == end) return false;
+
+    // Rows are the listing's own order when sorting by name without a filter, otherwise look for it
+    u32 row = line;
+    if(screen->sort != SORT_NAME || screen->filter)
+    {
+        row = 0;
+        while(row < screen->num_lines && line_at(screen, row) != line) row++;
+        if(row == screen->num_lines) return false;
+    }
+    jump_to_line(screen, row);
+    return true;
+}
+
+u64 listing_bytes(Listing *listing)
+{
+    // Interned names can be shared with other listings, this counts them as if they weren't
+    u32 count = listing->num_lines;
+    u64 bytes = sizeof(Listing) + (u64)count * (sizeof(u32) * 2 + sizeof(u16) + sizeof(u8) + sizeof(Name));
+    for(u32 i = 0; i < count; i++) bytes += listing->lengths[i] + 1 + (listing->lengths[i] < STRING_INLINE ? 0 : listing->lengths[i] + 1);
+    if(listing->meta_state) bytes += (u64)count * (sizeof(u8) * 2 + sizeof(u16) + sizeof(u32) + sizeof(u64) * 2 + sizeof(i64));
+    for(u32 i = 0; i < NUM_SORTS; i++) bytes += listing->keys[i] ? (u64)listing->num_lines * sizeof(u64) : 0;
+    return bytes;
+}
+
+void listing_cache_remove(Listing *listing)
+{
+    if(!listing->cached) return;
+    if(listing->newer) listing->newer->older = listing->older;
+    else global_listing_newest = listing->older;
+    if(listing->older) listing->older->newer = listing->newer;
+    else global_listing_oldest = listing->newer;
+    listing->newer  = NULL;
+    listing->older  = NULL;
+    listing->cached = false;
+    global_listing_cache_bytes -= listing->cached_bytes;
+    listing_release(listing);
+}
+
+// Makes listing the most recently used, replacing any older listing of the same directory, then
+// drops the least recently used ones until the cache is back under budget.
+void listing_cache_insert(Listing *listing)
+{
+    if(listing->cached)
+    {
+        listing->refs++;
+        listing_cache_remove(listing);
+    }
+    else
+    {
+        for(Listing *other = global_listing_newest; other; other = other->older)
+        {
+            if(other->id.dev == listing->id.dev && other->id.ino == listing->id.ino)
+            {
+                listing_cache_remove(other);
+                break;
+            }
+        }
+    }
+    listing->refs++;
+    listing->cached       = true;
+    listing->cached_bytes = listing_bytes(listing);
+    listing->older        = global_listing_newest;
+    if(global_listing_newest) global_listing_newest->newer = listing;
+    global_listing_newest = listing;
+    if(!global_listing_oldest) global_listing_oldest = listing;
+    global_listing_cache_bytes += listing->cached_bytes;
+
+    while(global_listing_cache_bytes > global_listing_cache_budget && global_listing_oldest != listing)
+    {
+        listing_cache_remove(global_listing_oldest);
+    }
+}
+
+// Returns a new reference to the cached listing of dir_fd, re-reading the directory if it changed
+// since. The cache is small enough in entries that a list walk is fine.
+Listing *listing_cache_find(int dir_fd)
+{
+    struct stat statbuf;
+    if(fstat(dir_fd, &statbuf) < 0) return NULL;
+    for(Listing *listing = global_listing_newest; listing; listing = listing->older)
+    {
+        if(listing->id.dev != statbuf.st_dev || listing->id.ino != statbuf.st_ino) continue;
+        if(listing->mtime.tv_sec == statbuf.st_mtim.tv_sec && listing->mtime.tv_nsec == statbuf.st_mtim.tv_nsec)
+        {
+            atomic_fetch_add(&global_stats.listing_hits, 1);
+            if(listing->prefetched) atomic_fetch_add(&global_stats.prefetch_hits, 1);
+            listing->prefetched = false;
+            listing->refs++;
+            listing_cache_insert(listing);
+            listing_metadata_stale(listing);
+            return listing;
+        }
+        atomic_fetch_add(&global_stats.listing_misses, 1);
+
+        // Changed, but the cursor can still go back to the same name if it's there
+        Listing *fresh = listing_read(dir_fd, NULL);
+        if(listing->saved_line < listing->num_lines)
+        {
+            u32 saved = listing_find(fresh, listing->names[listing->saved_line]);
+            fresh->saved_line = saved < fresh->num_lines ? saved : 0;
+            fresh->saved_row  = listing->saved_row;
+        }
+        listing_cache_insert(fresh);
+        return fresh;
+    }
+    return NULL;
+}
+
+// The listing's index for the buffer's row
+u32 line_at(Buffer *screen, u32 index)
+{
+    return screen->order[index];
+}
+
+// The cached listing of dev, ino or NULL, without checking it's still current or touching the LRU order.
+Listing *listing_cache_lookup(dev_t dev, ino_t ino)
+{
+    for(Listing *listing = global_listing_newest; listing; listing = listing->older)
+    {
+        if(listing->id.dev == dev && listing->id.ino == ino) return listing;
+    }
+    return NULL;
+}
+
+u64 monotonic_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void prefetch_task(void *data)
+{
+    Prefetch *prefetch = (Prefetch*)data;
+    if(!atomic_load(&prefetch->cancelled))
+    {
+        int fd = openat(prefetch->dir_fd, prefetch->name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if(fd >= 0)
+        {
+            prefetch->listing = listing_read(fd, &prefetch->cancelled);
+            close(fd);
+        }
+    }
+    close(prefetch->dir_fd);
+    pthread_mutex_lock(&global_stat_lock);
+    prefetch->next = global_prefetches_done;
+    global_prefetches_done = prefetch;
+    pthread_mutex_unlock(&global_stat_lock);
+}
+
+void cancel_prefetches(void)
+{
+    for(u32 i = 0; i < global_num_prefetches; i++)
+    {
+        if(!atomic_exchange(&global_prefetches[i]->cancelled, true)) atomic_fetch_add(&global_stats.prefetches_cancelled, 1);
+    }
+}
+
+// Called every time round the main loop. Arms a prefetch when the cursor lands on a directory,
+// starts it once the cursor has rested there for PREFETCH_DELAY_MS and cancels reads the cursor has
+// moved away from. Nothing is started past MAX_PREFETCHES, it stays armed until a slot frees up.
+void update_prefetch(Buffer *screen)
+{
+    b32 on_line = (global_mode == NORMAL || global_mode == JUMP) && screen->current_line < screen->num_lines;
+    u32 line = on_line ? line_at(screen, screen->current_line) : 0;
+    const char *text = on_line ? screen->listing->blob + screen->listing->offsets[line] : NULL;
+    u32 length = on_line ? screen->listing->lengths[line] : 0;
+    b32 wanted = on_line && (screen->listing->flags[line] & LINE_DIR) &&
+                 !(text[0] == '.' && (length == 1 || (length == 2 && text[1] == '.')));
+    if(!wanted)
+    {
+        if(global_prefetch_listing) cancel_prefetches();
+        global_prefetch_listing = NULL;
+        global_prefetch_armed   = false;
+        return;
+    }
+
+    u32 index = screen->order[screen->current_line];
+    if(global_prefetch_listing != screen->listing || global_prefetch_line != index)
+    {
+        cancel_prefetches();
+        global_prefetch_listing = screen->listing;
+        global_prefetch_line    = index;
+        global_prefetch_at      = monotonic_ms() + PREFETCH_DELAY_MS;
+        global_prefetch_armed   = true;
+        return;
+    }
+    if(!global_prefetch_armed || monotonic_ms() < global_prefetch_at || global_num_prefetches == MAX_PREFETCHES) return;
+    global_prefetch_armed = false;
+
+    // Already cached and current, nothing to do
+    char name[NAME_MAX + 1];
+    struct stat statbuf;
+    if(length >= sizeof(name)) return;
+    memcpy(name, text, length + 1);
+    if(fstatat(screen->dir_fd, name, &statbuf, 0) < 0) return;
+    Listing *cached = listing_cache_lookup(statbuf.st_dev, statbuf.st_ino);
+    if(cached && cached->mtime.tv_sec == statbuf.st_mtim.tv_sec && cached->mtime.tv_nsec == statbuf.st_mtim.tv_nsec) return;
+
+    Prefetch *prefetch = (Prefetch*)slab_alloc(&global_prefetch_slab);
+    memset(prefetch, 0, sizeof(Prefetch));
+    prefetch->dir_fd = fcntl(screen->dir_fd, F_DUPFD_CLOEXEC, 0);
+    if(prefetch->dir_fd < 0)
+    {
+        slab_free(&global_prefetch_slab, prefetch);
+        return;
+    }
+    memcpy(prefetch->name, name, length + 1);
+    global_prefetches[global_num_prefetches++] = prefetch;
+    atomic_fetch_add(&global_stats.prefetches_started, 1);
+    pool_submit(&global_pools[PRIORITY_INTERACTIVE], prefetch_task, prefetch);
+}
+
+// Called from the main loop. Puts finished prefetches in the listing cache.
+void poll_prefetches(void)
+{
+    pthread_mutex_lock(&global_stat_lock);
+    Prefetch *prefetch = global_prefetches_done;
+    global_prefetches_done = NULL;
+    pthread_mutex_unlock(&global_stat_lock);
+
+    while(prefetch)
+    {
+        Prefetch *next = prefetch->next;
+        for(u32 i = 0; i < global_num_prefetches; i++)
+        {
+            if(global_prefetches[i] != prefetch) continue;
+            global_prefetches[i] = global_prefetches[--global_num_prefetches];
+            break;
+        }
+
+        // Entering the directory while it was being read means the cache already has it
+        Listing *listing = prefetch->listing;
+        if(listing && !atomic_load(&prefetch->cancelled) && !listing_cache_lookup(listing->id.dev, listing->id.ino))
+        {
+            listing->prefetched = true;
+            listing_cache_insert(listing);
+        }
+        listing_release(listing);
+        slab_free(&global_prefetch_slab, prefetch);
+        prefetch = next;
+    }
+}
+
+// Shows the buffer's directory, sharing the listing of any other buffer already showing it or
+// reusing a cached one if the directory hasn't changed.
+void load_directory(Buffer *screen)
+{
+    u64 mallocs = thread_mallocs;
+    stop_flat_view(screen);
+    stop_tree_view(screen);
+    clear_normal_buffer_area(screen);
+    DirId id = dir_id(screen->dir_fd);
+    Listing *listing = NULL;
+    for(u32 i = 0; i < global_state_num_buffers; i++)
+    {
+        Buffer *other = global_state_buffers[i];
+        if(other != screen && other->listing && !other->listing->flat && other->listing->id.dev == id.dev && other->listing->id.ino == id.ino)
+        {
+            listing = other->listing;
+            listing->refs++;
+            break;
+        }
+    }
+    if(!listing) listing = listing_cache_find(screen->dir_fd);
+    if(!listing)
+    {
+        atomic_fetch_add(&global_stats.listing_misses, 1);
+        listing = listing_read(screen->dir_fd, NULL);
+        listing_cache_insert(listing);
+    }
+    set_listing(screen, listing);
+    atomic_fetch_add(&global_stats.loads, 1);
+    atomic_fetch_add(&global_stats.load_mallocs, thread_mallocs - mallocs);
+}
+
+// Opens a new buffer on the same directory as source.
+void init_buffer(Buffer *buf, u32 x, u32 y, u32 width, u32 height, Buffer *source)
+{
+    buf->x                 = x;
+    buf->y                 = y;
+    buf->width             = width;
+    buf->height            = height;
+    buf->view_range_start  = 0;
+    buf->view_range_end    = height - 1;
+    buf->current_line      = 0;
+    buf->dir_fd            = openat(source->dir_fd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    buf->current_directory = string_copy(source->current_directory);
+    buf->listing           = NULL;
+    buf->sort              = source->sort;
+    buf->filter            = source->filter ? filter_compile(source->filter->pattern) : NULL;
+    buf->order             = NULL;
+    buf->capacity          = 0;
+
+    // Load buffers current directory
+    load_directory(buf);
+}
+
+// Moves the buffer into name relative to where it is now, ".." being the parent.
+void change_directory(Buffer *screen, const char *name)
+{
+    int fd = openat(screen->dir_fd, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(fd < 0)
+    {
+        draw_error(screen, strerror(errno));
+        return;
+    }
+    close(screen->dir_fd);
+    screen->dir_fd = fd;
+
+    if(strcmp(name, "..") == 0)
+    {
+        pop_directory(screen->current_directory);
+    }
+    else
+    {
+        push_directory(screen->current_directory, arena_string(&global_frame_arena, name));
+    }
+    load_directory(screen);
+}
+
+DirId dir_id(int fd)
+{
+    struct stat statbuf;
+    DirId id = {};
+    if(fstat(fd, &statbuf) == 0)
+    {
+        id.dev = statbuf.st_dev;
+        id.ino = statbuf.st_ino;
+    }
+    return id;
+}
+
+// True when dev, ino is dir_fd or one of its ancestors.
+b32 directory_inside(int dir_fd, dev_t dev, ino_t ino)
+{
+    int fd = openat(dir_fd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    struct stat current;
+    struct stat parent_stat;
+    b32 inside = false;
+    while(fd >= 0 && fstat(fd, &current) == 0)
+    {
+        if(current.st_dev == dev && current.st_ino == ino)
+        {
+            inside = true;
+            break;
+        }
+        int parent = openat(fd, "..", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        close(fd);
+        fd = parent;
+        // The root is its own parent
+        if(fd >= 0 && fstat(fd, &parent_stat) == 0 && parent_stat.st_dev == current.st_dev && parent_stat.st_ino == current.st_ino) break;
+    }
+    if(fd >= 0) close(fd);
+    return inside;
+}
+
+void scroll(Buffer *screen, i32 lines)
+{
+    i32 new_start = (i32)screen->view_range_start + lines;
+    i32 new_end = (i32)screen->view_range_end + lines;
+    if(new_start >= 0 && new_end <= screen->num_lines)
+    {
+        screen->view_range_start = (u32)new_start;
+        screen->view_range_end = (u32)new_end;
+        clear_normal_buffer_area(screen);
+    }
+}
+
+void jump_to_line(Buffer *screen, u32 line_number)
+{
+    screen->current_line = line_number;
+
+    if(screen->current_line < screen->view_range_start)
+    {
+        i32 diff = screen->current_line - screen->view_range_start;
+        scroll(screen, diff);
+    }
+    else if(screen->current_line >= screen->view_range_end)
+    {
+        i32 diff = screen->current_line - screen->view_range_end + 1;
+        scroll(screen, diff);
+    }
+}
+
+void search_scroll(SearchBuffer *results)
+{
+    results->view_range_start++;
+    results->view_range_end++;
+    clear_search_buffer_area(results, 0);
+}
+
+// Pass NULL for text to only print the global mode.
+void draw_text(String *text, u32 x, u32 y)
+{
+    char *mode;
+    u16 bg;
+
+    switch(global_mode)
+    {
+        case NORMAL:
+        mode = "NORMAL";
+        bg = TB_BLUE;
+        break;
+
+        case SEARCH:
+        mode = "SEARCH";
+        bg = TB_MAGENTA;
+        break;
+
+        case INSERT:
+        mode = "INSERT";
+        bg = TB_GREEN;
+        break;
+
+        case VISUAL:
+        mode = "VISUAL";
+        bg = TB_YELLOW;
+        break;
+
+        case LIMIT:
+        mode = "LIMIT ";
+        bg = TB_RED;
+        break;
+
+        case JUMP:
+        mode = "JUMP  ";
+        bg = TB_CYAN;
+        break;
+
+        case FILTER:
+        mode = "FILTER";
+        bg = TB_GREEN;
+        break;
+    }
+
+    for(u32 i = 0; i < TEXT_OFF - 1; i++)
+    {
+        tb_change_cell(x + i, y, (u32)mode[i], TB_BLACK, bg);
+    }
+
+    if(text)
+    {
+        for(u32 i = 0; i < text->length; i++)
+        {
+            tb_change_cell(x + i + TEXT_OFF, y, (u32)text->start[i], TB_WHITE, TB_BLACK);
+        }
+    }
+
+    tb_present();
+}
+
+void clear_text(u32 x, u32 y, u32 length)
+{
+    for(u32 i = 0; i < length; i++)
+    {
+        tb_change_cell(x + i + TEXT_OFF, y, (u32)' ', TB_WHITE, TB_BLACK);
+    }
+    tb_present();
+}
+
+// Fits the pane's buffer into its tile, keeping the cursor in view, and repaints it.
+void place_buffer(Tile *tile)
+{
+    Buffer *buffer = tile->buffer;
+    buffer->x      = tile->x + PANE_MARGIN;
+    buffer->y      = tile->y;
+    buffer->width  = tile->width > PANE_MARGIN * 2 ? tile->width - PANE_MARGIN * 2 : 0;
+    buffer->height = tile->height > 2 ? tile->height - 1 : 2;
+    if(buffer->current_line + 1 >= buffer->view_range_start + buffer->height)
+    {
+        buffer->view_range_start = buffer->current_line + 2 - buffer->height;
+    }
+    if(buffer->current_line < buffer->view_range_start) buffer->view_range_start = buffer->current_line;
+    buffer->view_range_end = buffer->view_range_start + buffer->height - 1;
+
+    // Margins and status row included, they may hold what used to be drawn here
+    struct tb_cell *tb_buffer = tb_cell_buffer();
+    for(u32 y = tile->y; y < tile->y + tile->height && y < global_terminal_height; y++)
+    {
+        for(u32 x = tile->x; x < tile->x + tile->width && x < global_terminal_width; x++)
+        {
+            tb_buffer[x + global_terminal_width * y].ch = (u32)' ';
+            tb_buffer[x + global_terminal_width * y].bg = TB_BLACK;
+        }
+    }
+    update_screen(buffer);
+}
+
+// Gives tile the area, skipping it entirely when it hasn't moved so a resize or split only costs the
+// tiles it changes. Splits keep both sides at the minimum pane size while the area has room for it.
+void layout_tile(Tile *tile, u32 x, u32 y, u32 width, u32 height)
+{
+    if(tile->x == x && tile->y == y && tile->width == width && tile->height == height) return;
+    tile->x      = x;
+    tile->y      = y;
+    tile->width  = width;
+    tile->height = height;
+
+    if(tile->type == TILE_PANE)
+    {
+        place_buffer(tile);
+    }
+    else if(tile->type == TILE_VERTICAL)
+    {
+        u32 first_width = width ? (width - 1) * tile->ratio / 1024 : 0;
+        if(width >= MIN_PANE_WIDTH * 2 + 1)
+        {
+            if(first_width < MIN_PANE_WIDTH) first_width = MIN_PANE_WIDTH;
+            if(first_width > width - 1 - MIN_PANE_WIDTH) first_width = width - 1 - MIN_PANE_WIDTH;
+        }
+        layout_tile(tile->first, x, y, first_width, height);
+        layout_tile(tile->second, x + first_width + 1, y, width ? width - first_width - 1 : 0, height);
+        draw_vertical_line(y, y + height, x + first_width);
+    }
+    else
+    {
+        u32 first_height = height * tile->ratio / 1024;
+        if(height >= MIN_PANE_HEIGHT * 2)
+        {
+            if(first_height < MIN_PANE_HEIGHT) first_height = MIN_PANE_HEIGHT;
+            if(first_height > height - MIN_PANE_HEIGHT) first_height = height - MIN_PANE_HEIGHT;
+        }
+        layout_tile(tile->first, x, y, width, first_height);
+        layout_tile(tile->second, x, y + first_height, width, height - first_height);
+    }
+}
+
+// Splits the buffer's pane in two, the new half showing the same directory.
+void split_buffer(Buffer *buffer, TileType type)
+{
+    Tile *tile = buffer->tile;
+    if(type == TILE_VERTICAL && tile->width < MIN_PANE_WIDTH * 2 + 1) return;
+    if(type == TILE_HORIZONTAL && tile->height < MIN_PANE_HEIGHT * 2) return;
+
+    Buffer *buffer2 = (Buffer*)calloc(1, sizeof(Buffer));
+    init_buffer(buffer2, buffer->x, buffer->y, buffer->width, buffer->height, buffer);
+    global_state_buffers = (Buffer**)realloc(global_state_buffers, sizeof(Buffer*) * (global_state_num_buffers + 1));
+    global_state_buffers[global_state_num_buffers++] = buffer2;
+
+    // The pane's tile becomes the split and both buffers go in new leaves under it
+    Tile *first  = (Tile*)calloc(1, sizeof(Tile));
+    Tile *second = (Tile*)calloc(1, sizeof(Tile));
+    first->type    = TILE_PANE;
+    first->parent  = tile;
+    first->buffer  = buffer;
+    second->type   = TILE_PANE;
+    second->parent = tile;
+    second->buffer = buffer2;
+    buffer->tile   = first;
+    buffer2->tile  = second;
+
+    u32 width  = tile->width;
+    u32 height = tile->height;
+    tile->type   = type;
+    tile->first  = first;
+    tile->second = second;
+    tile->ratio  = 512;
+    tile->buffer = NULL;
+    tile->width  = 0;
+    layout_tile(tile, tile->x, tile->y, width, height);
+    tb_present();
+}
+
+// Applies the source's metadata to an already open destination so none of it costs another path
+// lookup. Owner goes first because chown clears setuid/setgid, times go last because writing
+// xattrs can touch ctime. Failures like EPERM on chown as a normal user are ignored, and so are
+// destinations without xattrs and security or trusted names we aren't allowed to set. An xattr
+// that couldn't be read or written for any other reason returns false so the job counts it.
+b32 copy_metadata(int fd_in, int fd_out, struct statx *source, u32 preserve)
+{
+    b32 success = true;
+    if(preserve & PRESERVE_OWNER)
+    {
+        fchown(fd_out, source->stx_uid, source->stx_gid);
+    }
+    if(preserve & PRESERVE_MODE)
+    {
+        fchmod(fd_out, source->stx_mode & 07777);
+    }
+    if(preserve & PRESERVE_XATTR)
+    {
+        // Zero length calls give the sizes, names and values have no fixed limit. A file that has
+        // none on a filesystem without xattrs is fine.
+        ssize_t length = flistxattr(fd_in, NULL, 0);
+        char *names = length > 0 ? (char*)malloc(length) : NULL;
+        if(names) length = flistxattr(fd_in, names, length);
+        if(length < 0 && errno != ENOTSUP) success = false;
+
+        char *value = NULL;
+        ssize_t capacity = 0;
+        for(ssize_t i = 0; i < length; i += strlen(names + i) + 1)
+        {
+            ssize_t value_length = fgetxattr(fd_in, names + i, NULL, 0);
+            if(value_length > capacity)
+            {
+                capacity = value_length;
+                value = (char*)realloc(value, capacity);
+            }
+            if(value_length >= 0) value_length = fgetxattr(fd_in, names + i, value, value_length);
+            if(value_length < 0)
+            {
+                success = false;
+            }
+            else if(fsetxattr(fd_out, names + i, value, value_length, 0) < 0 && errno != ENOTSUP && errno != EPERM && errno != EACCES)
+            {
+                success = false;
+            }
+        }
+        free(value);
+        free(names);
+    }
+    if(preserve & PRESERVE_TIMES)
+    {
+        struct timespec times[2];
+        times[0].tv_sec  = source->stx_atime.tv_sec;
+        times[0].tv_nsec = source->stx_atime.tv_nsec;
+        times[1].tv_sec  = source->stx_mtime.tv_sec;
+        times[1].tv_nsec = source->stx_mtime.tv_nsec;
+        futimens(fd_out, times);
+    }
+    return success;
+}
+
+// Copies src_name in src_dir to dst_name in dst_dir. With COPY_HAVE_SOURCE source already holds the
+// statx of the file, otherwise it's filled in here. COPY_DST_EXISTS writes into an existing empty
+// file instead of creating one. limit may be NULL.
+// TODO(Luke): This, like all file IO, needs to handle errors at some point buddy boy
+b32 copy_file_at(int src_dir, const char *src_name, int dst_dir, const char *dst_name, u32 preserve, struct statx *source, u32 flags, RateLimit *limit)
+{
+    IoRing *ring = ioring_get();
+    u32 mask = STATX_SIZE|STATX_MODE|STATX_UID|STATX_GID|STATX_ATIME|STATX_MTIME;
+    b32 need_stat = !(flags & COPY_HAVE_SOURCE);
+    b32 stat_failed = false;
+    int fd_in;
+    struct io_uring_sqe *sqe = ring ? ioring_prep(ring, IORING_OP_OPENAT, src_dir, 0) : NULL;
+    if(sqe)
+    {
+        // The open and the metadata lookup don't depend on each other so they go in one submission
+        i32 results[2] = {0, 0};
+        sqe->addr       = (u64)(uintptr_t)src_name;
+        sqe->open_flags = O_RDONLY|O_CLOEXEC;
+        if(need_stat && (sqe = ioring_prep(ring, IORING_OP_STATX, src_dir, 1)))
+        {
+            sqe->addr  = (u64)(uintptr_t)src_name;
+            sqe->len   = mask;
+            sqe->off   = (u64)(uintptr_t)source;
+            need_stat  = false;
+        }
+        ioring_run(ring, results);
+        fd_in       = results[0];
+        stat_failed = results[1] < 0;
+    }
+    else
+    {
+        fd_in = openat(src_dir, src_name, O_RDONLY|O_CLOEXEC);
+    }
+    if(fd_in >= 0 && (stat_failed || (need_stat && statx(fd_in, "", AT_EMPTY_PATH, mask, source) < 0)))
+    {
+        close(fd_in);
+        fd_in = -1;
+    }
+    if(fd_in < 0) return false;
+
+    // O_CREAT|O_EXCL ensure a new file is created. It starts out user read/write only so nobody else
+    // can open it before copy_metadata sets the real mode.
+    int open_flags = flags & COPY_DST_EXISTS ? O_WRONLY|O_CLOEXEC : O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC;
+    int fd_out = openat(dst_dir, dst_name, open_flags, S_IRUSR + S_IWUSR);
+    if(fd_out < 0)
+    {
+        close(fd_in);
+        return false;
+    }
+
+    rate_limit_take(limit, 0, 1);
+    // copy_file_range never brings the data into user space, which makes it faster than the ring's
+    // fixed buffer reads and writes even for big files. The ring is for when it can't do the pair
+    // of filesystems at all, like across devices before 5.3.
+    size_t length = source->stx_size;
+    b32 limited = limit && (atomic_load(&limit->bytes_per_second) || atomic_load(&limit->ops_per_second));
+    while(length > 0)
+    {
+        size_t chunk = limited && length > LIMITED_COPY_CHUNK ? LIMITED_COPY_CHUNK : length;
+        rate_limit_take(limit, chunk, 1);
+        ssize_t copied = copy_file_range(fd_in, NULL, fd_out, NULL, chunk, 0);
+        if(copied <= 0) break;
+        length -= copied;
+    }
+    b32 success = length == 0 || (length == source->stx_size && ring && ioring_copy(ring, fd_in, fd_out, length, limit));
+    success = success && copy_metadata(fd_in, fd_out, source, preserve);
+    close(fd_in);
+    close(fd_out);
+    return success;
+}
+
+void *pool_worker(void *data)
+{
+    WorkerPool *pool = (WorkerPool*)data;
+    if(pool->priority == PRIORITY_BULK)
+    {
+        // Both are per thread on Linux when given a tid
+        pid_t tid = (pid_t)syscall(SYS_gettid);
+        setpriority(PRIO_PROCESS, tid, BULK_NICE);
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7));
+    }
+    for(;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while(pool->size == 0 && !pool->shutdown)
+        {
+            pthread_cond_wait(&pool->has_work, &pool->lock);
+        }
+        if(pool->size == 0)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        Task task = pool->tasks[pool->start];
+        pool->start = (pool->start + 1) % pool->capacity;
+        pool->size--;
+        pthread_mutex_unlock(&pool->lock);
+
+        task.function(task.data);
+    }
+    return NULL;
+}
+
+void pool_init(WorkerPool *pool, u32 num_threads, Priority priority)
+{
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->has_work, NULL);
+    pool->size        = 0;
+    pool->capacity    = 64;
+    pool->start       = 0;
+    pool->end         = 0;
+    pool->tasks       = (Task*)calloc(pool->capacity, sizeof(Task));
+    pool->shutdown    = false;
+    pool->priority    = priority;
+    pool->num_threads = num_threads;
+    pool->threads     = (pthread_t*)malloc(sizeof(pthread_t) * num_threads);
+    for(u32 i = 0; i < num_threads; i++)
+    {
+        pthread_create(&pool->threads[i], NULL, pool_worker, pool);
+    }
+}
+
+void pool_submit(WorkerPool *pool, TaskFunction function, void *data)
+{
+    Task task = {function, data};
+    pthread_mutex_lock(&pool->lock);
+    if(pool->size == pool->capacity)
+    {
+        Task *new_tasks = (Task*)calloc(pool->capacity * 2, sizeof(Task));
+        for(u32 i = 0; i < pool->size; i++)
+        {
+            new_tasks[i] = pool->tasks[(i + pool->start) % pool->capacity];
+        }
+        free(pool->tasks);
+        pool->tasks     = new_tasks;
+        pool->capacity *= 2;
+        pool->start     = 0;
+        pool->end       = pool->size;
+    }
+    pool->tasks[pool->end] = task;
+    pool->end = (pool->end + 1) % pool->capacity;
+    pool->size++;
+    pthread_cond_signal(&pool->has_work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Drains whatever is still queued and joins the threads.
+void pool_shutdown(WorkerPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->has_work);
+    pthread_mutex_unlock(&pool->lock);
+    for(u32 i = 0; i < pool->num_threads; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    free(pool->tasks);
+}
+
+// Returns this thread's ring, setting it up on first use. NULL means use plain syscalls.
+IoRing *ioring_get(void)
+{
+    if(thread_ring) return thread_ring->dead ? NULL : thread_ring;
+    if(global_io_backend != IO_BACKEND_URING || thread_ring_failed) return NULL;
+
+    struct io_uring_params params = {};
+    int fd = (int)syscall(__NR_io_uring_setup, IORING_DEPTH, &params);
+    if(fd < 0)
+    {
+        thread_ring_failed = true;
+        if(errno == ENOSYS || errno == EPERM) global_io_backend = IO_BACKEND_THREADS;
+        return NULL;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    b32 single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single_mmap && cq_size > sq_size) sq_size = cq_size;
+
+    u8 *sq = (u8*)mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    u8 *cq = sq;
+    if(!single_mmap && sq != MAP_FAILED)
+    {
+        cq = (u8*)mmap(NULL, cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    u8 *buffers = (u8*)mmap(NULL, IORING_NUM_BUFFERS * IORING_BUFFER_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED || buffers == MAP_FAILED)
+    {
+        close(fd);
+        thread_ring_failed = true;
+        return NULL;
+    }
+
+    struct iovec iovecs[IORING_NUM_BUFFERS];
+    for(u32 i = 0; i < IORING_NUM_BUFFERS; i++)
+    {
+        iovecs[i].iov_base = buffers + i * IORING_BUFFER_SIZE;
+        iovecs[i].iov_len  = IORING_BUFFER_SIZE;
+    }
+    b32 registered = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iovecs, IORING_NUM_BUFFERS) == 0;
+
+    IoRing *ring      = (IoRing*)calloc(1, sizeof(IoRing));
+
+    // Kernels from before the probe existed (5.6) have the fixed reads and writes but none of the
+    // path based ops, those fall back to syscalls one opcode at a time
+    u32 probe_size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe*)calloc(1, probe_size);
+    if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0)
+    {
+        for(u32 i = 0; i < probe->ops_len && i < IORING_OP_LAST; i++)
+        {
+            ring->supported[i] = (probe->ops[i].flags & IO_URING_OP_SUPPORTED) != 0;
+        }
+    }
+    else
+    {
+        ring->supported[IORING_OP_READ_FIXED]  = true;
+        ring->supported[IORING_OP_WRITE_FIXED] = true;
+    }
+    free(probe);
+
+    ring->fd          = fd;
+    ring->depth       = params.sq_entries;
+    ring->sq_head     = (u32*)(sq + params.sq_off.head);
+    ring->sq_tail     = (u32*)(sq + params.sq_off.tail);
+    ring->sq_mask     = (u32*)(sq + params.sq_off.ring_mask);
+    ring->sq_array    = (u32*)(sq + params.sq_off.array);
+    ring->sqes        = (struct io_uring_sqe*)sqes;
+    ring->cq_head     = (u32*)(cq + params.cq_off.head);
+    ring->cq_tail     = (u32*)(cq + params.cq_off.tail);
+    ring->cq_mask     = (u32*)(cq + params.cq_off.ring_mask);
+    ring->cqes        = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    ring->buffers     = buffers;
+    ring->buffer_size = IORING_BUFFER_SIZE;
+    ring->num_buffers = registered ? IORING_NUM_BUFFERS : 0;
+    thread_ring = ring;
+    return ring;
+}
+
+// Queues an sqe, returns NULL once depth are queued and the caller has to ioring_run first, or if
+// the kernel doesn't support opcode and the caller has to use the syscall.
+struct io_uring_sqe *ioring_prep(IoRing *ring, u8 opcode, int fd, u64 user_data)
+{
+    if(ring->dead || ring->queued >= ring->depth || opcode >= IORING_OP_LAST || !ring->supported[opcode]) return NULL;
+
+    u32 tail = *ring->sq_tail + ring->queued;
+    u32 index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = opcode;
+    sqe->fd        = fd;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    ring->queued++;
+    return sqe;
+}
+
+// Submits everything queued and blocks until all of it completes. results[user_data] gets each
+// result, so user_data has to be 0 to the number queued - 1. Errors are negative errno like the raw syscalls.
+void ioring_run(IoRing *ring, i32 *results)
+{
+    u32 count = ring->queued;
+    if(count == 0) return;
+    for(u32 i = 0; i < count; i++) results[i] = -EIO;
+    atomic_store_explicit((_Atomic u32*)ring->sq_tail, *ring->sq_tail + count, memory_order_release);
+    ring->queued = 0;
+
+    u32 submitted = 0;
+    u32 completed = 0;
+    while(completed < count)
+    {
+        int result = (int)syscall(__NR_io_uring_enter, ring->fd, count - submitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(result < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            // What didn't complete stays -EIO and this thread goes back to plain syscalls
+            ring->dead = true;
+            break;
+        }
+        if(result > 0) submitted += result;
+
+        u32 head = *ring->cq_head;
+        u32 tail = atomic_load_explicit((_Atomic u32*)ring->cq_tail, memory_order_acquire);
+        while(head != tail)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            results[cqe->user_data] = cqe->res;
+            head++;
+            completed++;
+        }
+        atomic_store_explicit((_Atomic u32*)ring->cq_head, head, memory_order_release);
+    }
+}
+
+// Copies length bytes in rounds of IORING_NUM_BUFFERS fixed buffer reads followed by as many
+// writes. Returns false if the ring can't do it and the caller should fall back.
+b32 ioring_copy(IoRing *ring, int fd_in, int fd_out, u64 length, RateLimit *limit)
+{
+    if(ring->num_buffers == 0) return false;
+
+    i32 results[IORING_NUM_BUFFERS];
+    u32 lengths[IORING_NUM_BUFFERS];
+    u64 offset = 0;
+    while(offset < length)
+    {
+        u32 count = 0;
+        for(; count < ring->num_buffers && offset + (u64)count * ring->buffer_size < length; count++)
+        {
+            u64 remaining = length - offset - (u64)count * ring->buffer_size;
+            lengths[count] = remaining < ring->buffer_size ? (u32)remaining : ring->buffer_size;
+            struct io_uring_sqe *sqe = ioring_prep(ring, IORING_OP_READ_FIXED, fd_in, count);
+            if(!sqe) break;
+            sqe->addr      = (u64)(uintptr_t)(ring->buffers + count * ring->buffer_size);
+            sqe->len       = lengths[count];
+            sqe->off       = offset + (u64)count * ring->buffer_size;
+            sqe->buf_index = (u16)count;
+        }
+        if(count == 0) return false;
+        u64 round = 0;
+        for(u32 i = 0; i < count; i++) round += lengths[i];
+        rate_limit_take(limit, round, count);
+        ioring_run(ring, results);
+        for(u32 i = 0; i < count; i++)
+        {
+            if(results[i] != (i32)lengths[i]) return false;
+        }
+
+        // Whatever got queued has to be run before bailing, the ring is shared by the whole thread
+        u32 writes = 0;
+        for(; writes < count; writes++)
+        {
+            struct io_uring_sqe *sqe = ioring_prep(ring, IORING_OP_WRITE_FIXED, fd_out, writes);
+            if(!sqe) break;
+            sqe->addr      = (u64)(uintptr_t)(ring->buffers + writes * ring->buffer_size);
+            sqe->len       = lengths[writes];
+            sqe->off       = offset + (u64)writes * ring->buffer_size;
+            sqe->buf_index = (u16)writes;
+        }
+        ioring_run(ring, results);
+        for(u32 i = 0; i < writes; i++)
+        {
+            if(results[i] != (i32)lengths[i]) return false;
+            offset += lengths[i];
+        }
+        if(writes < count) return false;
+    }
+    return true;
+}
+
+void rate_limit_init(RateLimit *limit, u64 bytes_per_second, u64 ops_per_second)
+{
+    pthread_mutex_init(&limit->lock, NULL);
+    atomic_init(&limit->bytes_per_second, bytes_per_second);
+    atomic_init(&limit->ops_per_second, ops_per_second);
+    limit->byte_tokens = 0;
+    limit->op_tokens   = 0;
+    clock_gettime(CLOCK_MONOTONIC, &limit->last_refill);
+}
+
+// Takes bytes and ops from the bucket, sleeping until the bucket would have had them. The
+// bucket holds at most a second's worth so an idle job can't save up a burst.
+void rate_limit_take(RateLimit *limit, u64 bytes, u64 ops)
+{
+    if(!limit) return;
+    u64 bytes_per_second = atomic_load(&limit->bytes_per_second);
+    u64 ops_per_second = atomic_load(&limit->ops_per_second);
+    if(!bytes_per_second && !ops_per_second) return;
+
+    pthread_mutex_lock(&limit->lock);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - limit->last_refill.tv_sec) + (now.tv_nsec - limit->last_refill.tv_nsec) / 1e9;
+    limit->last_refill = now;
+
+    double wait = 0;
+    if(bytes_per_second)
+    {
+        limit->byte_tokens += elapsed * bytes_per_second;
+        if(limit->byte_tokens > bytes_per_second) limit->byte_tokens = bytes_per_second;
+        limit->byte_tokens -= bytes;
+        if(limit->byte_tokens < 0) wait = -limit->byte_tokens / bytes_per_second;
+    }
+    if(ops_per_second)
+    {
+        limit->op_tokens += elapsed * ops_per_second;
+        if(limit->op_tokens > ops_per_second) limit->op_tokens = ops_per_second;
+        limit->op_tokens -= ops;
+        if(limit->op_tokens < 0 && -limit->op_tokens / ops_per_second > wait) wait = -limit->op_tokens / ops_per_second;
+    }
+    pthread_mutex_unlock(&limit->lock);
+
+    if(wait > 0)
+    {
+        struct timespec duration = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+        nanosleep(&duration, NULL);
+    }
+}
+
+// Parses a number with an optional K, M or G suffix. end is left after what was parsed.
+u64 parse_size(const char *text, char **end)
+{
+    u64 value = strtoull(text, end, 10);
+    switch(**end)
+    {
+        case 'k': case 'K': value <<= 10; (*end)++; break;
+        case 'm': case 'M': value <<= 20; (*end)++; break;
+        case 'g': case 'G': value <<= 30; (*end)++; break;
+    }
+    return value;
+}
+
+// The job the status line shows and LIMIT mode changes.
+Job *oldest_job(void)
+{
+    Job *job = global_jobs;
+    while(job && job->next) job = job->next;
+    return job;
+}
+
+// LIMIT mode's command, words separated by spaces: "bulk" or "interactive" picks the pool, the
+// first number is bytes a second and the second operations a second, with 0 for no limit.
+// E.g. "bulk 20M 500". It changes the running job the status line shows, or the defaults
+// for new jobs when nothing is running. Nothing changes unless the whole command parses.
+void apply_limit_command(Buffer *screen, String *command)
+{
+    char text[128];
+    if(command->length >= sizeof(text))
+    {
+        draw_error(screen, "Limit command too long");
+        return;
+    }
+    string_cstring(command, text, sizeof(text));
+
+    i32 priority = -1;
+    u64 values[2];
+    u32 numbers = 0;
+    char *cursor = text;
+    while(*cursor)
+    {
+        if(*cursor == ' ')
+        {
+            cursor++;
+            continue;
+        }
+        char *end = cursor;
+        while(*end && *end != ' ') end++;
+        size_t length = end - cursor;
+
+        if(*cursor >= '0' && *cursor <= '9' && numbers < 2)
+        {
+            char *parsed;
+            values[numbers++] = parse_size(cursor, &parsed);
+            if(parsed != end)
+            {
+                draw_error(screen, "Bad limit, expected a number like 20M");
+                return;
+            }
+        }
+        else if(length == 4 && memcmp(cursor, "bulk", 4) == 0)
+        {
+            priority = PRIORITY_BULK;
+        }
+        else if(length == 11 && memcmp(cursor, "interactive", 11) == 0)
+        {
+            priority = PRIORITY_INTERACTIVE;
+        }
+        else
+        {
+            draw_error(screen, "Bad limit, expected bulk, interactive and up to two numbers");
+            return;
+        }
+        cursor = end;
+    }
+
+    Job *job = oldest_job();
+    if(numbers > 0)
+    {
+        if(job) atomic_store(&job->limit.bytes_per_second, values[0]);
+        else global_default_bytes_per_second = values[0];
+    }
+    if(numbers > 1)
+    {
+        if(job) atomic_store(&job->limit.ops_per_second, values[1]);
+        else global_default_ops_per_second = values[1];
+    }
+    if(priority >= 0)
+    {
+        if(job) atomic_store(&job->priority, priority);
+        else global_default_priority = priority;
+    }
+}
+
+Job *job_new(JobType type, DirId directory)
+{
+    Job *job = (Job*)calloc(1, sizeof(Job));
+    job->type      = type;
+    job->directory = directory;
+    // Copies move data around and go on the bulk pool, deletes are mostly metadata and don't
+    i32 priority = global_default_priority >= 0 ? global_default_priority : type == JOB_COPY ? PRIORITY_BULK : PRIORITY_INTERACTIVE;
+    atomic_init(&job->priority, priority);
+    rate_limit_init(&job->limit, global_default_bytes_per_second, global_default_ops_per_second);
+    job->next      = global_jobs;
+    global_jobs    = job;
+    return job;
+}
+
+// Called from the main loop. Reaps finished jobs and reloads any buffer looking at what they changed.
+void poll_jobs(void)
+{
+    Job **link = &global_jobs;
+    while(*link)
+    {
+        Job *job = *link;
+        if(!atomic_load(&job->done))
+        {
+            link = &job->next;
+            continue;
+        }
+        *link = job->next;
+
+        reload_buffers(job->directory);
+        if(job->move) reload_buffers(job->source_directory);
+        if(job->type == JOB_COPY)
+        {
+            // Moves count the deleted source in files_done as well, so they only report bytes
+            if(job->move)
+            {
+                snprintf(global_message, sizeof(global_message), " moved %llu MB, hardlinks saved %llu MB, %llu errors ",
+                         atomic_load(&job->bytes_done) >> 20, atomic_load(&job->bytes_saved) >> 20, atomic_load(&job->errors));
+            }
+            else
+            {
+                snprintf(global_message, sizeof(global_message), " copied %llu files %llu MB, hardlinks saved %llu MB, %llu errors ",
+                         atomic_load(&job->files_done), atomic_load(&job->bytes_done) >> 20,
+                         atomic_load(&job->bytes_saved) >> 20, atomic_load(&job->errors));
+            }
+            for(u32 i = 0; i < job->links.capacity; i++) free(job->links.entries[i].path);
+            free(job->links.entries);
+            pthread_mutex_destroy(&job->links.lock);
+        }
+        if(job->journal_id) journal_end(job->journal_id);
+        if(job->completed)
+        {
+            path_set_free(job->completed);
+            free(job->completed);
+        }
+        pthread_mutex_destroy(&job->limit.lock);
+        free(job);
+    }
+}
+
+// Reload every buffer showing directory. The directory is read once and every buffer moves to the
+// new listing together, each keeping its own sort and its cursor on the same name and row if the
+// name is still there, otherwise on the same line.
+void reload_buffers(DirId directory)
+{
+    Listing *listing = NULL;
+    for(u32 i = 0; i < global_state_num_buffers; i++)
+    {
+        Buffer *buffer = global_state_buffers[i];
+        if(buffer->listing->id.dev != directory.dev || buffer->listing->id.ino != directory.ino) continue;
+        // A flat view only changes when it's walked again
+        if(buffer->listing->flat) continue;
+
+        u32 line = buffer->current_line;
+        u32 row  = line - buffer->view_range_start;
+        // Kept alive past the old listing's release
+        u32 name = line < buffer->num_lines ? buffer->listing->names[line_at(buffer, line)] : 0;
+        if(name) name_retain(name);
+        if(!listing)
+        {
+            listing = listing_read(buffer->dir_fd, NULL);
+            listing_cache_insert(listing);
+        }
+        listing->refs++;
+        clear_normal_buffer_area(buffer);
+        set_listing(buffer, listing);
+
+        u32 found = listing_find(listing, name);
+        for(u32 j = 0; found < listing->num_lines && j < buffer->num_lines; j++)
+        {
+            if(buffer->order[j] != found) continue;
+            line = j;
+            break;
+        }
+        if(line < buffer->num_lines)
+        {
+            buffer->current_line     = line;
+            buffer->view_range_start = line >= row ? line - row : 0;
+            buffer->view_range_end   = buffer->view_range_start + buffer->height - 1;
+        }
+        name_release(name);
+        update_screen(buffer);
+    }
+    listing_release(listing);
+}
+
+// Shows message in the status line until the next key press.
+void draw_error(Buffer *screen, const char *message)
+{
+    struct tb_event event;
+    String *error = arena_string(&global_frame_arena, message);
+    draw_text(error, screen->x, screen->y + screen->height);
+    tb_poll_event(&event);
+    clear_text(screen->x, screen->y + screen->height, error->length);
+}
+
+// Progress of the oldest running job, right aligned in the buffer's status line. With nothing
+// running this shows global_message instead, the summary of the last finished job.
+void draw_job_status(Buffer *screen)
+{
+    Job *job = oldest_job();
+    char status[192];
+    int length = 0;
+    if(!job)
+    {
+        length = snprintf(status, sizeof(status), "%s", global_message);
+    }
+    else switch(job->type)
+    {
+        case JOB_DELETE:
+        length = snprintf(status, sizeof(status), " deleting: %llu files %llu dirs %llu errors ",
+                          atomic_load(&job->files_done), atomic_load(&job->dirs_done), atomic_load(&job->errors));
+        break;
+
+        case JOB_COPY:
+        length = snprintf(status, sizeof(status), " copying: %llu files %llu MB, saved %llu MB %llu errors ",
+                          atomic_load(&job->files_done), atomic_load(&job->bytes_done) >> 20,
+                          atomic_load(&job->bytes_saved) >> 20, atomic_load(&job->errors));
+        break;
+    }
+    if(job)
+    {
+        unsigned long long bytes_per_second = atomic_load(&job->limit.bytes_per_second);
+        unsigned long long ops_per_second = atomic_load(&job->limit.ops_per_second);
+        length += snprintf(status + length, sizeof(status) - length, "[%s",
+                           atomic_load(&job->priority) == PRIORITY_BULK ? "bulk" : "interactive");
+        if(bytes_per_second) length += snprintf(status + length, sizeof(status) - length, " %lluK/s", bytes_per_second >> 10);
+        if(ops_per_second) length += snprintf(status + length, sizeof(status) - length, " %lluop/s", ops_per_second);
+        length += snprintf(status + length, sizeof(status) - length, "] ");
+    }
+    if(length < 0 || (u32)length > screen->width) return;
+
+    // Blank out whatever longer status was drawn last time
+    static u32 last_length;
+    u32 y = screen->y + screen->height;
+    for(u32 i = length; i < last_length && i < screen->width; i++)
+    {
+        tb_change_cell(screen->x + screen->width - i - 1, y, (u32)' ', TB_WHITE, TB_BLACK);
+    }
+    last_length = length;
+
+    u32 x = screen->x + screen->width - length;
+    for(int i = 0; i < length; i++)
+    {
+        tb_change_cell(x + i, y, (u32)status[i], TB_BLACK, TB_RED);
+    }
+    tb_present();
+}
+
+void format_size(u64 size, char *text, size_t length)
+{
+    static const char units[] = "BKMGTPE";
+    double value = (double)size;
+    u32 unit = 0;
+    while(value >= 1024 && unit < sizeof(units) - 2)
+    {
+        value /= 1024;
+        unit++;
+    }
+    if(unit == 0) snprintf(text, length, "%lluB", (unsigned long long)size);
+    else if(value < 10) snprintf(text, length, "%.1f%c", value, units[unit]);
+    else snprintf(text, length, "%.0f%c", value, units[unit]);
+}
+
+// getpwuid reads /etc/passwd every time so the last few names are kept around
+const char *owner_name(u32 uid)
+{
+    static struct
+    {
+        u32 uid;
+        char name[9];
+    } cache[16];
+    static u32 num_cached;
+    static u32 next;
+
+    for(u32 i = 0; i < num_cached; i++)
+    {
+        if(cache[i].uid == uid) return cache[i].name;
+    }
+    u32 index = num_cached < 16 ? num_cached++ : next++ % 16;
+    struct passwd *pw = getpwuid(uid);
+    cache[index].uid = uid;
+    if(pw) snprintf(cache[index].name, sizeof(cache[index].name), "%s", pw->pw_name);
+    else snprintf(cache[index].name, sizeof(cache[index].name), "%u", uid);
+    return cache[index].name;
+}
+
+// Draws the metadata columns at the right edge of line_number's row, blank until they're loaded.
+void draw_metadata(Buffer *screen, u32 line_number, u16 bg)
+{
+    if(!global_show_metadata || screen->width < META_WIDTH * 2) return;
+    Listing *listing = screen->listing;
+    u32 line = line_at(screen, line_number);
+    char text[64];
+    memset(text, ' ', META_WIDTH);
+    if(listing->meta_state && listing->meta_state[line] == META_DONE && listing->modes[line])
+    {
+        u16 mode_bits = listing->modes[line];
+        static const char bits[] = "rwxrwxrwx";
+        char mode[11];
+        mode[0] = S_ISDIR(mode_bits) ? 'd' : S_ISLNK(mode_bits) ? 'l' : S_ISFIFO(mode_bits) ? 'p' :
+                  S_ISSOCK(mode_bits) ? 's' : S_ISCHR(mode_bits) ? 'c' : S_ISBLK(mode_bits) ? 'b' : '-';
+        for(u32 i = 0; i < 9; i++) mode[i + 1] = mode_bits & (1 << (8 - i)) ? bits[i] : '-';
+        mode[10] = '\0';
+
+        char size[8];
+        if(!(listing->flags[line] & LINE_DIR)) format_size(listing->sizes[line], size, sizeof(size));
+        else if(listing->usage_state[line] == META_DONE) format_size(listing->usages[line], size, sizeof(size));
+        else size[0] = '\0';
+
+        char date[17];
+        time_t mtime = (time_t)listing->mtimes[line];
+        struct tm tm;
+        localtime_r(&mtime, &tm);
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &tm);
+
+        snprintf(text, sizeof(text), " %s %-8.8s %6s %s", mode, owner_name(listing->uids[line]), size, date);
+    }
+
+    u32 x = screen->x + screen->width - META_WIDTH;
+    u32 y = screen->y + line_number - screen->view_range_start + 1;
+    for(u32 i = 0; i < META_WIDTH && text[i]; i++)
+    {
+        tb_change_cell(x + i, y, (u32)text[i], TB_WHITE, bg);
+    }
+}
+
+// Stats one batch with only the bits the columns need. Runs on the pool.
+void stat_batch_task(void *data)
+{
+    StatBatch *batch = (StatBatch*)data;
+    u32 mask = STATX_TYPE|STATX_MODE|STATX_UID|STATX_SIZE|STATX_MTIME;
+    int flags = AT_SYMLINK_NOFOLLOW|AT_STATX_DONT_SYNC;
+    IoRing *ring = ioring_get();
+    u32 queued = 0;
+    if(ring)
+    {
+        for(; queued < batch->count; queued++)
+        {
+            struct io_uring_sqe *sqe = ioring_prep(ring, IORING_OP_STATX, batch->dir->fd, queued);
+            if(!sqe) break;
+            sqe->addr        = (u64)(uintptr_t)batch->names[queued];
+            sqe->len         = mask;
+            sqe->statx_flags = flags;
+            sqe->off         = (u64)(uintptr_t)&batch->results[queued];
+        }
+        ioring_run(ring, batch->status);
+    }
+    // Anything the ring couldn't take is done with plain syscalls
+    for(u32 i = queued; i < batch->count; i++)
+    {
+        batch->status[i] = statx(batch->dir->fd, batch->names[i], flags, mask, &batch->results[i]) < 0 ? -errno : 0;
+    }
+
+    if(atomic_fetch_sub(&batch->dir->refs, 1) == 1)
+    {
+        close(batch->dir->fd);
+        free(batch->dir);
+    }
+    pthread_mutex_lock(&global_stat_lock);
+    batch->next      = global_stat_done;
+    global_stat_done = batch;
+    pthread_mutex_unlock(&global_stat_lock);
+}
+
+void submit_stat_batch(Listing *listing, StatDir *dir, u32 *lines, u32 count, Priority priority)
+{
+    StatBatch *batch  = (StatBatch*)calloc(1, sizeof(StatBatch));
+    batch->listing    = listing;
+    batch->dir        = dir;
+    batch->count      = count;
+    batch->lines      = (u32*)malloc(sizeof(u32) * count);
+    batch->names      = (char**)malloc(sizeof(char*) * count);
+    batch->status     = (i32*)malloc(sizeof(i32) * count);
+    batch->results    = (struct statx*)malloc(sizeof(struct statx) * count);
+    u32 size = 0;
+    for(u32 i = 0; listing->flat && i < count; i++) size += listing->lengths[lines[i]] + 1;
+    batch->paths = size ? (char*)malloc(size) : NULL;
+    u32 offset = 0;
+    for(u32 i = 0; i < count; i++)
+    {
+        char *text = listing->blob + listing->offsets[lines[i]];
+        if(batch->paths)
+        {
+            memcpy(batch->paths + offset, text, listing->lengths[lines[i]] + 1);
+            text    = batch->paths + offset;
+            offset += listing->lengths[lines[i]] + 1;
+        }
+        batch->lines[i] = lines[i];
+        batch->names[i] = text;
+        listing->meta_state[lines[i]] = META_PENDING;
+    }
+    listing->refs++;
+    atomic_fetch_add(&dir->refs, 1);
+    global_stat_pending++;
+    pool_submit(&global_pools[priority], stat_batch_task, batch);
+}
+
+// Queues statx for every line that doesn't have metadata yet. Visible lines go to the interactive
+// pool in their own batches so they come back first, the rest of the directory follows on the bulk
+// pool once per listing so sorting and scrolling later find everything cached.
+void request_metadata(Buffer *screen)
+{
+    if(!global_show_metadata && screen->sort < SORT_SIZE) return;
+    Listing *listing = screen->listing;
+    listing_add_metadata(listing);
+    StatDir *dir = NULL;
+    u32 lines[STAT_BATCH];
+    for(u32 pass = 0; pass < 2; pass++)
+    {
+        u32 start = pass == 0 ? screen->view_range_start : 0;
+        u32 end = pass == 0 ? screen->view_range_end : listing->num_lines;
+        Priority priority = pass == 0 ? PRIORITY_INTERACTIVE : PRIORITY_BULK;
+        if(pass == 1 && listing->metadata_requested) break;
+        // The buffer's order can be shorter than the listing when a filter or closed tree rows hide lines
+        u32 limit = pass == 0 ? screen->num_lines : listing->num_lines;
+        if(end > limit) end = limit;
+
+        u32 count = 0;
+        for(u32 i = start; i < end; i++)
+        {
+            u32 index = pass == 0 ? screen->order[i] : i;
+            if(listing->meta_state[index] != META_NONE) continue;
+            if(!dir)
+            {
+                dir = (StatDir*)malloc(sizeof(StatDir));
+                dir->fd = fcntl(screen->dir_fd, F_DUPFD_CLOEXEC, 0);
+                atomic_init(&dir->refs, 1);
+                if(dir->fd < 0)
+                {
+                    free(dir);
+                    return;
+                }
+            }
+            lines[count++] = index;
+            if(count == STAT_BATCH)
+            {
+                submit_stat_batch(listing, dir, lines, count, priority);
+                count = 0;
+            }
+        }
+        if(count) submit_stat_batch(listing, dir, lines, count, priority);
+    }
+    listing->metadata_requested = true;
+
+    if(dir && atomic_fetch_sub(&dir->refs, 1) == 1)
+    {
+        close(dir->fd);
+        free(dir);
+    }
+}
+
+// Re-sorts the buffer keeping the cursor on the same entry.
+void resort_buffer(Buffer *screen)
+{
+    u32 current = screen->num_lines ? screen->order[screen->current_line] : 0;
+    sort_buffer(screen);
+    for(u32 i = 0; i < screen->num_lines; i++)
+    {
+        if(screen->order[i] == current)
+        {
+            screen->view_range_start = 0;
+            screen->view_range_end   = screen->height - 1;
+            screen->current_line     = 0;
+            jump_to_line(screen, i);
+            break;
+        }
+    }
+    // The entry it was on can be filtered out
+    if(screen->current_line >= screen->num_lines)
+    {
+        screen->current_line     = 0;
+        screen->view_range_start = 0;
+        screen->view_range_end   = screen->height - 1;
+    }
+    clear_normal_buffer_area(screen);
+}
+
+// Drops the listing's keys that depend on metadata and flags buffers sorted by them.
+void metadata_changed(Listing *listing)
+{
+    for(u32 mode = SORT_SIZE; mode < NUM_SORTS; mode++)
+    {
+        free(listing->keys[mode]);
+        listing->keys[mode] = NULL;
+    }
+    for(u32 i = 0; i < global_state_num_buffers; i++)
+    {
+        Buffer *buffer = global_state_buffers[i];
+        if(buffer->listing == listing && buffer->sort >= SORT_SIZE) global_stale_sorts = true;
+    }
+}
+
+// The directory's mtime only covers its names, so a cached listing's stat and usage columns can be
+// out of date. Finished ones are fetched again when next needed, the usage cache keeps that cheap.
+void listing_metadata_stale(Listing *listing)
+{
+    if(!listing->meta_state) return;
+    for(u32 i = 0; i < listing->num_lines; i++)
+    {
+        if(listing->meta_state[i] == META_DONE) listing->meta_state[i] = META_NONE;
+        if(listing->usage_state[i] == META_DONE) listing->usage_state[i] = META_NONE;
+    }
+    listing->metadata_requested = false;
+    listing->usage_requested    = false;
+    metadata_changed(listing);
+}
+
+// Called from the main loop. Copies finished batches into their listings and redraws. Buffers
+// sorted by metadata are re-sorted as it arrives, but only in normal mode so a visual selection
+// or search results never have the lines move under them.
+void poll_metadata(void)
+{
+    pthread_mutex_lock(&global_stat_lock);
+    StatBatch *batch = global_stat_done;
+    global_stat_done = NULL;
+    pthread_mutex_unlock(&global_stat_lock);
+
+    b32 changed = false;
+    while(batch)
+    {
+        StatBatch *next = batch->next;
+        Listing *listing = batch->listing;
+        for(u32 i = 0; i < batch->count; i++)
+        {
+            u32 line = batch->lines[i];
+            struct statx *result = &batch->results[i];
+            listing->meta_state[line] = META_DONE;
+            listing->modes[line]      = batch->status[i] == 0 ? result->stx_mode : 0;
+            listing->uids[line]       = batch->status[i] == 0 ? result->stx_uid : 0;
+            listing->sizes[line]      = batch->status[i] == 0 ? result->stx_size : 0;
+            listing->mtimes[line]     = batch->status[i] == 0 ? result->stx_mtime.tv_sec : 0;
+        }
+        metadata_changed(listing);
+        changed = true;
+
+        // The names point into the listing's blob or the batch's own copies
+        listing_release(listing);
+        free(batch->lines);
+        free(batch->names);
+        free(batch->paths);
+        free(batch->status);
+        free(batch->results);
+        free(batch);
+        global_stat_pending--;
+        batch = next;
+    }
+
+    pthread_mutex_lock(&global_stat_lock);
+    UsageResult *result = global_usage_done;
+    global_usage_done = NULL;
+    pthread_mutex_unlock(&global_stat_lock);
+    while(result)
+    {
+        UsageResult *next = result->next;
+        result->listing->usage_state[result->line] = META_DONE;
+        result->listing->usages[result->line]      = result->total;
+        result->listing->usage_pending--;
+        metadata_changed(result->listing);
+        changed = true;
+        listing_release(result->listing);
+        free(result);
+        global_stat_pending--;
+        result = next;
+    }
+
+    if(global_stale_sorts && global_mode == NORMAL)
+    {
+        for(u32 i = 0; i < global_state_num_buffers; i++)
+        {
+            Buffer *buffer = global_state_buffers[i];
+            if(buffer->sort >= SORT_SIZE) resort_buffer(buffer);
+        }
+        global_stale_sorts = false;
+        changed = true;
+    }
+    if(changed && global_mode == NORMAL)
+    {
+        for(u32 i = 0; i < global_state_num_buffers; i++) update_screen(global_state_buffers[i]);
+    }
+}
+
+u32 usage_hash(dev_t dev, ino_t ino)
+{
+    return (u32)(((u64)ino * 0x9E3779B97F4A7C15ULL) >> 32) ^ (u32)dev;
+}
+
+// The usage cache functions below expect the cache locked.
+void usage_cache_unlink(UsageEntry *entry)
+{
+    UsageCache *cache = &global_usage_cache;
+    if(entry->newer) entry->newer->older = entry->older;
+    else cache->newest = entry->older;
+    if(entry->older) entry->older->newer = entry->newer;
+    else cache->oldest = entry->newer;
+    entry->newer = NULL;
+    entry->older = NULL;
+}
+
+void usage_cache_push(UsageEntry *entry)
+{
+    UsageCache *cache = &global_usage_cache;
+    entry->older = cache->newest;
+    if(cache->newest) cache->newest->newer = entry;
+    cache->newest = entry;
+    if(!cache->oldest) cache->oldest = entry;
+}
+
+// Drops entry from the table, shifting back whatever probed past its slot so lookups still find it.
+void usage_cache_remove(UsageEntry *entry)
+{
+    UsageCache *cache = &global_usage_cache;
+    u32 mask = cache->capacity - 1;
+    u32 hole = usage_hash(entry->dev, entry->ino);
+    while(cache->slots[hole & mask] != entry) hole++;
+    for(u32 index = hole + 1; cache->slots[index & mask]; index++)
+    {
+        UsageEntry *other = cache->slots[index & mask];
+        u32 home = usage_hash(other->dev, other->ino);
+        if(((index - home) & mask) < ((index - hole) & mask)) continue;
+        cache->slots[hole & mask] = other;
+        hole = index;
+    }
+    cache->slots[hole & mask] = NULL;
+    cache->count--;
+    cache->bytes -= entry->cached_bytes;
+    usage_cache_unlink(entry);
+    free(entry->links);
+    free(entry->subdirs);
+    free(entry);
+}
+
+// Returns a copy of the cached entry for dev, ino, or NULL. The caller frees it and its arrays.
+UsageEntry *usage_cache_find(dev_t dev, ino_t ino)
+{
+    UsageCache *cache = &global_usage_cache;
+    UsageEntry *copy = NULL;
+    pthread_mutex_lock(&cache->lock);
+    u32 mask = cache->capacity - 1;
+    for(u32 index = usage_hash(dev, ino); cache->capacity && cache->slots[index & mask]; index++)
+    {
+        UsageEntry *entry = cache->slots[index & mask];
+        if(entry->dev != dev || entry->ino != ino) continue;
+        usage_cache_unlink(entry);
+        usage_cache_push(entry);
+        copy  = (UsageEntry*)malloc(sizeof(UsageEntry));
+        *copy = *entry;
+        copy->links   = (UsageLink*)malloc(sizeof(UsageLink) * (entry->num_links ? entry->num_links : 1));
+        copy->subdirs = (char*)malloc(entry->subdirs_size ? entry->subdirs_size : 1);
+        memcpy(copy->links, entry->links, sizeof(UsageLink) * entry->num_links);
+        memcpy(copy->subdirs, entry->subdirs, entry->subdirs_size);
+        break;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return copy;
+}
+
+// Takes ownership of entry, replacing whatever was cached for the same directory, then drops the
+// least recently used entries until the cache is back under budget.
+void usage_cache_store(UsageEntry *entry)
+{
+    UsageCache *cache = &global_usage_cache;
+    pthread_mutex_lock(&cache->lock);
+    if((cache->count + 1) * 4 >= cache->capacity * 3)
+    {
+        u32 old_capacity = cache->capacity;
+        UsageEntry **old_slots = cache->slots;
+        cache->capacity = old_capacity ? old_capacity * 2 : 256;
+        cache->slots    = (UsageEntry**)calloc(cache->capacity, sizeof(UsageEntry*));
+        for(u32 i = 0; i < old_capacity; i++)
+        {
+            if(!old_slots[i]) continue;
+            u32 index = usage_hash(old_slots[i]->dev, old_slots[i]->ino);
+            while(cache->slots[index & (cache->capacity - 1)]) index++;
+            cache->slots[index & (cache->capacity - 1)] = old_slots[i];
+        }
+        free(old_slots);
+    }
+
+    u32 mask = cache->capacity - 1;
+    u32 index = usage_hash(entry->dev, entry->ino);
+    UsageEntry **slot = &cache->slots[index & mask];
+    while(*slot && ((*slot)->dev != entry->dev || (*slot)->ino != entry->ino)) slot = &cache->slots[++index & mask];
+    if(*slot)
+    {
+        UsageEntry *old = *slot;
+        cache->bytes -= old->cached_bytes;
+        usage_cache_unlink(old);
+        free(old->links);
+        free(old->subdirs);
+        free(old);
+    }
+    else
+    {
+        cache->count++;
+    }
+    *slot = entry;
+    entry->cached_bytes = sizeof(UsageEntry) + sizeof(UsageLink) * entry->num_links + entry->subdirs_size;
+    cache->bytes += entry->cached_bytes;
+    usage_cache_push(entry);
+
+    while(cache->bytes > global_usage_cache_budget && cache->oldest != entry) usage_cache_remove(cache->oldest);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void usage_walk_release(UsageWalk *walk)
+{
+    if(atomic_fetch_sub(&walk->refs, 1) != 1) return;
+    pthread_mutex_destroy(&walk->links.lock);
+    free(walk->links.entries);
+    free(walk);
+}
+
+// Stops the listing's usage walk, if it has one. Totals of directories already started still come back.
+void usage_cancel(Listing *listing)
+{
+    if(listing && listing->usage_walk) atomic_store(&listing->usage_walk->cancelled, true);
+}
+
+void usage_node_finish(UsageNode *node)
+{
+    while(node && atomic_fetch_sub(&node->pending, 1) == 1)
+    {
+        UsageNode *parent = node->parent;
+        if(node->fd >= 0)
+        {
+            close(node->fd);
+            atomic_fetch_sub(&global_open_fds, 1);
+        }
+
+        if(node->listing)
+        {
+            UsageResult *result = (UsageResult*)malloc(sizeof(UsageResult));
+            result->listing = node->listing;
+            result->line    = node->line;
+            result->total   = atomic_load(&node->total);
+            pthread_mutex_lock(&global_stat_lock);
+            result->next      = global_usage_done;
+            global_usage_done = result;
+            pthread_mutex_unlock(&global_stat_lock);
+        }
+        if(parent)
+        {
+            atomic_fetch_add(&parent->total, atomic_load(&node->total));
+        }
+        else
+        {
+            usage_walk_release(node->walk);
+        }
+        free(node);
+        node = parent;
+    }
+}
+
+void usage_spawn(UsageNode *parent, const char *name, Listing *listing, u32 line)
+{
+    size_t length = strlen(name);
+    UsageNode *child = (UsageNode*)calloc(1, sizeof(UsageNode) + length + 1);
+    child->parent  = parent;
+    child->walk    = parent->walk;
+    child->fd      = -1;
+    child->listing = listing;
+    child->line    = line;
+    atomic_init(&child->pending, 1);
+    memcpy(child->name, name, length + 1);
+
+    atomic_fetch_add(&parent->pending, 1);
+    // The root is filled on the main thread, which must never walk a tree itself
+    if(!parent->parent || atomic_load(&global_open_fds) < global_fd_budget)
+    {
+        pool_submit(&global_pools[PRIORITY_BULK], usage_node_task, child);
+    }
+    else
+    {
+        usage_node_task(child);
+    }
+}
+
+// Measures one directory. If its mtime matches the cache nothing was added, removed or renamed in
+// it since, so its files aren't stat'd again and only its subdirectories are walked. Files growing
+// in place don't touch the directory's mtime, those show up once something else in it changes.
+// Stays on one filesystem like du -x.
+void usage_node_task(void *data)
+{
+    UsageNode *node = (UsageNode*)data;
+    UsageWalk *walk = node->walk;
+    struct stat dir_stat;
+    if(atomic_load(&walk->cancelled))
+    {
+        usage_node_finish(node);
+        return;
+    }
+    node->fd = openat(node->parent->fd, node->name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if(node->fd < 0 || fstat(node->fd, &dir_stat) < 0)
+    {
+        if(node->fd >= 0) close(node->fd);
+        node->fd = -1;
+        usage_node_finish(node);
+        return;
+    }
+    atomic_fetch_add(&global_open_fds, 1);
+
+    UsageEntry *entry = usage_cache_find(dir_stat.st_dev, dir_stat.st_ino);
+    if(entry && (entry->mtime.tv_sec != dir_stat.st_mtim.tv_sec || entry->mtime.tv_nsec != dir_stat.st_mtim.tv_nsec))
+    {
+        free(entry->links);
+        free(entry->subdirs);
+        free(entry);
+        entry = NULL;
+    }
+
+    DIR *dir = entry ? NULL : fdopendir(dup(node->fd));
+    if(!entry && dir)
+    {
+        u32 links_capacity = 0;
+        u32 subdirs_capacity = 0;
+        entry = (UsageEntry*)calloc(1, sizeof(UsageEntry));
+        entry->dev   = dir_stat.st_dev;
+        entry->ino   = dir_stat.st_ino;
+        entry->mtime = dir_stat.st_mtim;
+
+        struct dirent *dirent;
+        while((dirent = readdir(dir)))
+        {
+            char *name = dirent->d_name;
+            if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            if(atomic_load_explicit(&walk->cancelled, memory_order_relaxed)) break;
+
+            struct stat statbuf;
+            if(fstatat(node->fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0) continue;
+            if(S_ISDIR(statbuf.st_mode))
+            {
+                if(statbuf.st_dev != dir_stat.st_dev) continue;
+                size_t length = strlen(name) + 1;
+                if(entry->subdirs_size + length > subdirs_capacity)
+                {
+                    subdirs_capacity = (subdirs_capacity + length) * 2;
+                    entry->subdirs = (char*)realloc(entry->subdirs, subdirs_capacity);
+                }
+                memcpy(entry->subdirs + entry->subdirs_size, name, length);
+                entry->subdirs_size += length;
+                entry->num_subdirs++;
+            }
+            else if(statbuf.st_nlink > 1)
+            {
+                if(entry->num_links == links_capacity)
+                {
+                    links_capacity = links_capacity ? links_capacity * 2 : 16;
+                    entry->links = (UsageLink*)realloc(entry->links, sizeof(UsageLink) * links_capacity);
+                }
+                entry->links[entry->num_links++] = (UsageLink){statbuf.st_dev, statbuf.st_ino, (u64)statbuf.st_blocks * 512};
+            }
+            else
+            {
+                entry->own += (u64)statbuf.st_blocks * 512;
+            }
+        }
+        closedir(dir);
+        if(atomic_load(&walk->cancelled))
+        {
+            // Part of a directory mustn't go in the cache
+            free(entry->links);
+            free(entry->subdirs);
+            free(entry);
+            usage_node_finish(node);
+            return;
+        }
+
+        // The cache keeps this one, the walk works from a copy like it would after a hit
+        UsageEntry *stored = (UsageEntry*)malloc(sizeof(UsageEntry));
+        *stored = *entry;
+        entry->links   = (UsageLink*)malloc(sizeof(UsageLink) * (entry->num_links ? entry->num_links : 1));
+        entry->subdirs = (char*)malloc(entry->subdirs_size ? entry->subdirs_size : 1);
+        memcpy(entry->links, stored->links, sizeof(UsageLink) * stored->num_links);
+        memcpy(entry->subdirs, stored->subdirs, stored->subdirs_size);
+        usage_cache_store(stored);
+    }
+    if(!entry)
+    {
+        usage_node_finish(node);
+        return;
+    }
+
+    u64 total = (u64)dir_stat.st_blocks * 512 + entry->own;
+    pthread_mutex_lock(&walk->links.lock);
+    for(u32 i = 0; i < entry->num_links; i++)
+    {
+        UsageLink *link = &entry->links[i];
+        if(inode_map_find(&walk->links, link->dev, link->ino)) continue;
+        inode_map_insert(&walk->links, link->dev, link->ino, (char*)"");
+        total += link->bytes;
+    }
+    pthread_mutex_unlock(&walk->links.lock);
+    atomic_fetch_add(&node->total, total);
+
+    char *name = entry->subdirs;
+    for(u32 i = 0; i < entry->num_subdirs && !atomic_load(&walk->cancelled); i++)
+    {
+        usage_spawn(node, name, NULL, 0);
+        name += strlen(name) + 1;
+    }
+    free(entry->links);
+    free(entry->subdirs);
+    free(entry);
+    usage_node_finish(node);
+}
+
+// Starts measuring every directory in the buffer's listing, once per listing. Totals come back
+// through poll_metadata.
+void request_usage(Buffer *screen)
+{
+    Listing *listing = screen->listing;
+    if(listing->usage_requested || (!global_show_metadata && screen->sort != SORT_USAGE)) return;
+    listing->usage_requested = true;
+    listing_add_metadata(listing);
+
+    int fd = fcntl(screen->dir_fd, F_DUPFD_CLOEXEC, 0);
+    if(fd < 0) return;
+    atomic_fetch_add(&global_open_fds, 1);
+    UsageWalk *walk = listing->usage_walk;
+    if(!walk)
+    {
+        walk = (UsageWalk*)calloc(1, sizeof(UsageWalk));
+        pthread_mutex_init(&walk->links.lock, NULL);
+        atomic_init(&walk->refs, 1);
+        listing->usage_walk = walk;
+    }
+    atomic_fetch_add(&walk->refs, 1);
+    UsageNode *root = (UsageNode*)calloc(1, sizeof(UsageNode) + 1);
+    root->walk = walk;
+    root->fd   = fd;
+    atomic_init(&root->pending, 1);
+
+    // A tree's directories are mixed in with its files and it asks again as it grows, so it's by flag
+    // and only the ones not measured yet
+    char name[PATH_MAX];
+    for(u32 i = 0; i < listing->num_lines; i++)
+    {
+        if(!(listing->flags[i] & LINE_DIR) || listing->usage_state[i] != META_NONE) continue;
+        if(listing->lengths[i] >= sizeof(name)) continue;
+        memcpy(name, listing->blob + listing->offsets[i], listing->lengths[i] + 1);
+        if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+        listing->usage_state[i] = META_PENDING;
+        listing->refs++;
+        listing->usage_pending++;
+        global_stat_pending++;
+        usage_spawn(root, name, listing, i);
+    }
+    usage_node_finish(root);
+}
+
+// Reads the .gitignore in fd, if there is one, into rules chained onto parent and takes over the
+// caller's reference to parent. Patterns compile to glob filters, so like FILTER mode they ignore
+// case and a * can cross a / in anchored ones. Only the first IGNORE_FILE_MAX bytes are read.
+IgnoreRules *ignore_read(int fd, IgnoreRules *parent, u32 base)
+{
+    int file = openat(fd, ".gitignore", O_RDONLY|O_CLOEXEC);
+    if(file < 0) return parent;
+    char text[IGNORE_FILE_MAX];
+    ssize_t size = read(file, text, sizeof(text));
+    close(file);
+    if(size <= 0) return parent;
+
+    IgnoreRules *rules = (IgnoreRules*)calloc(1, sizeof(IgnoreRules));
+    rules->parent = parent;
+    rules->base   = base;
+    atomic_init(&rules->refs, 1);
+    u32 capacity = 0;
+    char *end = text + size;
+    for(char *line = text; line < end;)
+    {
+        char *stop = (char*)memchr(line, '\n', end - line);
+        if(!stop) stop = end;
+        char *next = stop + 1;
+        // Trailing spaces and the \r of CRLF files aren't part of the pattern
+        while(stop > line && (stop[-1] == ' ' || stop[-1] == '\r')) stop--;
+        if(line == stop || line[0] == '#')
+        {
+            line = next;
+            continue;
+        }
+
+        u8 flags = 0;
+        if(line[0] == '!')
+        {
+            flags |= IGNORE_NEGATE;
+            line++;
+        }
+        if(stop > line && stop[-1] == '/')
+        {
+            flags |= IGNORE_DIR;
+            stop--;
+        }
+        // A leading **/ matches in any directory, the same as no slash at all
+        if(stop - line > 3 && memcmp(line, "**/", 3) == 0) line += 3;
+        else if(stop > line && line[0] == '/') flags |= IGNORE_ANCHORED;
+        while(stop > line && line[0] == '/') line++;
+        if(memchr(line, '/', stop - line)) flags |= IGNORE_ANCHORED;
+
+        Filter *filter = NULL;
+        if(stop > line)
+        {
+            String *pattern = string_new(stop - line);
+            string_push_str(pattern, line, stop - line);
+            filter = filter_compile(pattern);
+            string_free(pattern);
+        }
+        if(filter)
+        {
+            if(rules->count == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 16;
+                rules->filters = (Filter**)realloc(rules->filters, sizeof(Filter*) * capacity);
+                rules->flags   = (u8*)realloc(rules->flags, capacity);
+            }
+            rules->filters[rules->count] = filter;
+            rules->flags[rules->count]   = flags;
+            rules->count++;
+        }
+        line = next;
+    }
+    if(rules->count) return rules;
+    free(rules);
+    return parent;
+}
+
+void ignore_release(IgnoreRules *rules)
+{
+    while(rules && atomic_fetch_sub(&rules->refs, 1) == 1)
+    {
+        IgnoreRules *parent = rules->parent;
+        for(u32 i = 0; i < rules->count; i++) filter_free(rules->filters[i]);
+        free(rules->filters);
+        free(rules->flags);
+        free(rules);
+        rules = parent;
+    }
+}
+
+// Whether the entry at path is ignored. The innermost .gitignore goes first and in each the last
+// pattern that matches decides, like git. Patterns without a slash only see the entry's name.
+b32 ignore_match(IgnoreRules *rules, const char *path, u32 length, b32 is_dir)
+{
+    const char *name = path + length;
+    while(name > path && name[-1] != '/') name--;
+    for(; rules; rules = rules->parent)
+    {
+        for(u32 i = rules->count; i-- > 0;)
+        {
+            u8 flags = rules->flags[i];
+            if((flags & IGNORE_DIR) && !is_dir) continue;
+            const char *text = flags & IGNORE_ANCHORED ? path + rules->base : name;
+            if(!filter_match(rules->filters[i], text, path + length - text)) continue;
+            return !(flags & IGNORE_NEGATE);
+        }
+    }
+    return false;
+}
+
+FlatBatch *flat_batch_new(void)
+{
+    FlatBatch *batch = (FlatBatch*)calloc(1, sizeof(FlatBatch));
+    batch->capacity = FLAT_BATCH * 32;
+    batch->blob     = (char*)malloc(batch->capacity);
+    batch->lengths  = (u16*)malloc(sizeof(u16) * FLAT_BATCH);
+    return batch;
+}
+
+// Packs path onto the batch and interns it, on the worker so the main thread only copies
+void flat_batch_add(FlatBatch *batch, const char *path, u32 length)
+{
+    if(batch->size + length + 1 > batch->capacity)
+    {
+        batch->capacity = (batch->size + length + 1) * 2;
+        batch->blob = (char*)realloc(batch->blob, batch->capacity);
+    }
+    memcpy(batch->blob + batch->size, path, length);
+    batch->blob[batch->size + length] = '\0';
+    batch->lengths[batch->count] = length;
+    batch->size += length + 1;
+    batch->count++;
+}
+
+void flat_batch_free(FlatBatch *batch)
+{
+    free(batch->blob);
+    free(batch->lengths);
+    free(batch);
+}
+
+void flat_push(FlatWalk *walk, FlatBatch *batch)
+{
+    atomic_fetch_add(&global_stats.flat_files, batch->count);
+    pthread_mutex_lock(&walk->lock);
+    batch->next = walk->done;
+    walk->done  = batch;
+    pthread_mutex_unlock(&walk->lock);
+}
+
+void flat_walk_release(FlatWalk *walk)
+{
+    if(atomic_fetch_sub(&walk->refs, 1) != 1) return;
+    // Whatever the buffer never took, from a walk that was stopped
+    FlatBatch *batch = walk->done;
+    while(batch)
+    {
+        FlatBatch *next = batch->next;
+        flat_batch_free(batch);
+        batch = next;
+    }
+    pthread_mutex_destroy(&walk->lock);
+    free(walk);
+}
+
+void flat_node_finish(FlatNode *node)
+{
+    while(node && atomic_fetch_sub(&node->pending, 1) == 1)
+    {
+        FlatNode *parent = node->parent;
+        if(node->fd >= 0)
+        {
+            close(node->fd);
+            atomic_fetch_sub(&global_open_fds, 1);
+        }
+        ignore_release(node->rules);
+        if(!parent)
+        {
+            atomic_store(&node->walk->finished, true);
+            flat_walk_release(node->walk);
+        }
+        free(node);
+        node = parent;
+    }
+}
+
+void flat_spawn(FlatNode *parent, const char *path, u32 length, u32 name)
+{
+    FlatNode *child = (FlatNode*)calloc(1, sizeof(FlatNode) + length + 1);
+    child->parent = parent;
+    child->walk   = parent->walk;
+    child->fd     = -1;
+    child->depth  = parent->depth + 1;
+    child->rules  = parent->rules;
+    child->name   = name;
+    child->length = length;
+    memcpy(child->path, path, length);
+    if(child->rules) atomic_fetch_add(&child->rules->refs, 1);
+    atomic_init(&child->pending, 1);
+
+    atomic_fetch_add(&parent->pending, 1);
+    if(atomic_load(&global_open_fds) < global_fd_budget)
+    {
+        pool_submit(&global_pools[PRIORITY_INTERACTIVE], flat_node_task, child);
+    }
+    else
+    {
+        flat_node_task(child);
+    }
+}
+
+// Lists one directory of a flat walk. Files go into batches for the main thread as paths from the
+// walk's directory, subdirectories within the depth limit are walked in parallel. Symlinks to
+// directories are listed as files and not followed, so there are no cycles to watch for.
+void flat_node_task(void *data)
+{
+    FlatNode *node = (FlatNode*)data;
+    FlatWalk *walk = node->walk;
+    if(node->fd < 0)
+    {
+        node->fd = openat(node->parent->fd, node->path + node->name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        if(node->fd >= 0) atomic_fetch_add(&global_open_fds, 1);
+    }
+    DIR *dir = node->fd >= 0 && !atomic_load(&walk->cancelled) ? fdopendir(dup(node->fd)) : NULL;
+    if(!dir)
+    {
+        flat_node_finish(node);
+        return;
+    }
+    // Entries are matched from the node's path onwards, the root's have no directory in front
+    u32 base = node->length ? node->length + 1 : 0;
+    if(walk->ignore) node->rules = ignore_read(node->fd, node->rules, base);
+
+    char path[PATH_MAX];
+    memcpy(path, node->path, node->length);
+    if(node->length) path[node->length] = '/';
+    FlatBatch *batch = NULL;
+    struct dirent *dirent;
+    while((dirent = readdir(dir)))
+    {
+        if(atomic_load_explicit(&walk->cancelled, memory_order_relaxed) || atomic_load(&walk->truncated)) break;
+        char *name = dirent->d_name;
+        if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+        if(name[0] == '.' && !walk->hidden) continue;
+        if(walk->ignore && strcmp(name, ".git") == 0) continue;
+        u32 length = strlen(name);
+        if(base + length >= sizeof(path)) continue;
+        memcpy(path + base, name, length);
+
+        b32 is_dir = dirent->d_type == DT_DIR;
+        if(dirent->d_type == DT_UNKNOWN)
+        {
+            struct stat statbuf;
+            is_dir = fstatat(node->fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(statbuf.st_mode);
+        }
+        if(node->rules && ignore_match(node->rules, path, base + length, is_dir))
+        {
+            atomic_fetch_add(&global_stats.flat_ignored, 1);
+            continue;
+        }
+        if(is_dir)
+        {
+            if(!walk->max_depth || node->depth + 1 < walk->max_depth) flat_spawn(node, path, base + length, base);
+            continue;
+        }
+
+        if(atomic_fetch_add(&walk->found, 1) >= FLAT_MAX_LINES)
+        {
+            atomic_store(&walk->truncated, true);
+            break;
+        }
+        if(!batch) batch = flat_batch_new();
+        flat_batch_add(batch, path, base + length);
+        if(batch->count == FLAT_BATCH)
+        {
+            flat_push(walk, batch);
+            batch = NULL;
+        }
+    }
+    closedir(dir);
+    if(batch) flat_push(walk, batch);
+    flat_node_finish(node);
+}
+
+// Makes room for capacity lines in a flat listing's columns. Metadata columns only exist once
+// something asked for them, their new lines start unknown.
+void listing_grow(Listing *listing, u32 capacity)
+{
+    listing->offsets = (u32*)realloc(listing->offsets, sizeof(u32) * capacity);
+    listing->lengths = (u16*)realloc(listing->lengths, sizeof(u16) * capacity);
+    listing->flags   = (u8*)realloc(listing->flags, sizeof(u8) * capacity);
+    if(listing->meta_state)
+    {
+        u32 old = listing->capacity;
+        u32 added = capacity - old;
+        listing->meta_state  = (u8*)realloc(listing->meta_state, sizeof(u8) * capacity);
+        listing->modes       = (u16*)realloc(listing->modes, sizeof(u16) * capacity);
+        listing->uids        = (u32*)realloc(listing->uids, sizeof(u32) * capacity);
+        listing->sizes       = (u64*)realloc(listing->sizes, sizeof(u64) * capacity);
+        listing->mtimes      = (i64*)realloc(listing->mtimes, sizeof(i64) * capacity);
+        listing->usage_state = (u8*)realloc(listing->usage_state, sizeof(u8) * capacity);
+        listing->usages      = (u64*)realloc(listing->usages, sizeof(u64) * capacity);
+        memset(listing->meta_state + old, 0, sizeof(u8) * added);
+        memset(listing->modes + old, 0, sizeof(u16) * added);
+        memset(listing->uids + old, 0, sizeof(u32) * added);
+        memset(listing->sizes + old, 0, sizeof(u64) * added);
+        memset(listing->mtimes + old, 0, sizeof(i64) * added);
+        memset(listing->usage_state + old, 0, sizeof(u8) * added);
+        memset(listing->usages + old, 0, sizeof(u64) * added);
+    }
+    listing->capacity = capacity;
+}
+
+// Makes room in a flat listing for lines more lines taking bytes more of its blob. Both double as
+// they fill so appending stays a copy.
+void listing_reserve(Listing *listing, u32 lines, u32 bytes)
+{
+    u32 count = listing->num_lines + lines;
+    if(count > listing->capacity) listing_grow(listing, count > listing->capacity * 2 ? count : listing->capacity * 2);
+    if(listing->blob_size + bytes > listing->blob_capacity)
+    {
+        u32 needed = listing->blob_size + bytes;
+        listing->blob_capacity = needed > listing->blob_capacity * 2 ? needed : listing->blob_capacity * 2;
+        listing->blob = (char*)realloc(listing->blob, listing->blob_capacity);
+    }
+}
+
+// Called once lines have been appended to a flat listing. Keys are built for a fixed number of
+// lines, and the bulk stat and usage passes have new ones to do.
+void listing_appended(Listing *listing)
+{
+    for(u32 mode = 0; mode < NUM_SORTS; mode++)
+    {
+        free(listing->keys[mode]);
+        listing->keys[mode] = NULL;
+    }
+    listing->metadata_requested = false;
+    listing->usage_requested    = false;
+}
+
+// An empty flat listing of the directory
+Listing *flat_listing_new(int dir_fd)
+{
+    Listing *listing = (Listing*)calloc(1, sizeof(Listing));
+    listing->id            = dir_id(dir_fd);
+    listing->refs          = 1;
+    listing->flat          = true;
+    listing->blob_capacity = FLAT_BATCH * 32;
+    listing->blob          = (char*)malloc(listing->blob_capacity);
+    listing_grow(listing, FLAT_BATCH);
+    return listing;
+}
+
+// Adds a batch's paths to the end of a flat listing
+void flat_append(Listing *listing, FlatBatch *batch)
+{
+    listing_reserve(listing, batch->count, batch->size);
+    memcpy(listing->blob + listing->blob_size, batch->blob, batch->size);
+
+    u32 offset = listing->blob_size;
+    for(u32 i = 0; i < batch->count; i++)
+    {
+        u32 line = listing->num_lines + i;
+        listing->offsets[line] = offset;
+        listing->lengths[line] = batch->lengths[i];
+        listing->flags[line]   = 0;
+        offset += batch->lengths[i] + 1;
+    }
+    listing->num_lines += batch->count;
+    listing->blob_size = offset;
+    listing_appended(listing);
+}
+
+// Shows a flat view's new lines, from first on. By name they go on the end in the order they were
+// found, other sorts re-sort the whole buffer.
+void append_rows(Buffer *screen, u32 first)
+{
+    Listing *listing = screen->listing;
+    if(screen->sort != SORT_NAME)
+    {
+        resort_buffer(screen);
+        return;
+    }
+    if(listing->num_lines > screen->capacity)
+    {
+        screen->capacity = listing->num_lines * 2;
+        screen->order = (u32*)realloc(screen->order, sizeof(u32) * screen->capacity);
+    }
+    if(screen->filter) filter_listing(screen->filter, listing);
+    for(u32 line = first; line < listing->num_lines; line++)
+    {
+        if(screen->filter && !filter_keeps(screen->filter, listing, line)) continue;
+        screen->order[screen->num_lines++] = line;
+    }
+}
+
+// Turns the buffer into a flat view of every file below its directory. It starts out empty and
+// poll_flat fills it from a walk on the interactive pool.
+void start_flat_view(Buffer *screen)
+{
+    // Opened again rather than dup'd, a dup would share the read position of any earlier walk
+    int fd = openat(screen->dir_fd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(fd < 0)
+    {
+        draw_error(screen, strerror(errno));
+        return;
+    }
+    atomic_fetch_add(&global_open_fds, 1);
+    stop_flat_view(screen);
+    stop_tree_view(screen);
+    clear_normal_buffer_area(screen);
+    set_listing(screen, flat_listing_new(screen->dir_fd));
+
+    // One reference for the buffer, one for the root node
+    FlatWalk *walk = (FlatWalk*)calloc(1, sizeof(FlatWalk));
+    atomic_init(&walk->refs, 2);
+    walk->active    = true;
+    walk->max_depth = global_flat_depth;
+    walk->hidden    = global_flat_hidden;
+    walk->ignore    = global_flat_ignore;
+    pthread_mutex_init(&walk->lock, NULL);
+    screen->walk = walk;
+    global_flat_walks++;
+
+    FlatNode *root = (FlatNode*)calloc(1, sizeof(FlatNode) + 1);
+    root->walk = walk;
+    root->fd   = fd;
+    atomic_init(&root->pending, 1);
+    pool_submit(&global_pools[PRIORITY_INTERACTIVE], flat_node_task, root);
+}
+
+// Stops the buffer's walk, if it has one. The listing stays until something replaces it.
+void stop_flat_view(Buffer *screen)
+{
+    FlatWalk *walk = screen->walk;
+    if(!walk) return;
+    atomic_store(&walk->cancelled, true);
+    if(walk->active) global_flat_walks--;
+    screen->walk = NULL;
+    flat_walk_release(walk);
+}
+
+// Called from the main loop. Appends what walks have found to their flat views and redraws them.
+// True if any buffer got new rows.
+b32 poll_flat(void)
+{
+    b32 grew = false;
+    for(u32 i = 0; i < global_state_num_buffers; i++)
+    {
+        Buffer *buffer = global_state_buffers[i];
+        FlatWalk *walk = buffer->walk;
+        // Re-sorting would move rows out from under a visual selection, those wait like poll_metadata's
+        if(!walk || !walk->active || (buffer->sort != SORT_NAME && global_mode == VISUAL)) continue;
+
+        // Checked first, once it's set nothing can be pushed after the batches taken here
+        b32 finished = atomic_load(&walk->finished);
+        pthread_mutex_lock(&walk->lock);
+        FlatBatch *batch = walk->done;
+        walk->done = NULL;
+        pthread_mutex_unlock(&walk->lock);
+        // Pushed newest first, turned round so rows keep the order they were found in
+        FlatBatch *ordered = NULL;
+        while(batch)
+        {
+            FlatBatch *next = batch->next;
+            batch->next = ordered;
+            ordered     = batch;
+            batch       = next;
+        }
+
+        Listing *listing = buffer->listing;
+        u32 first = listing->num_lines;
+        while(ordered)
+        {
+            FlatBatch *next = ordered->next;
+            flat_append(listing, ordered);
+            flat_batch_free(ordered);
+            ordered = next;
+        }
+        b32 changed = listing->num_lines != first;
+        if(changed) append_rows(buffer, first);
+        if(finished)
+        {
+            walk->active = false;
+            global_flat_walks--;
+        }
+        if((changed || finished) && global_mode == NORMAL) update_screen(buffer);
+        grew |= changed;
+    }
+    return grew;
+}
+
+int compare_keyed_lines(const void *a, const void *b)
+{
+    const KeyedLine *x = (const KeyedLine*)a;
+    const KeyedLine *y = (const KeyedLine*)b;
+    if(x->key != y->key) return x->key < y->key ? -1 : 1;
+    return x->line < y->line ? -1 : x->line > y->line;
+}
+
+// Gives the tree's per line columns room for capacity lines, matching its listing
+void tree_reserve(TreeView *tree, u32 capacity)
+{
+    if(capacity <= tree->capacity) return;
+    tree->depths       = (u16*)realloc(tree->depths, sizeof(u16) * capacity);
+    tree->parents      = (u32*)realloc(tree->parents, sizeof(u32) * capacity);
+    tree->first_child  = (u32*)realloc(tree->first_child, sizeof(u32) * capacity);
+    tree->num_children = (u32*)realloc(tree->num_children, sizeof(u32) * capacity);
+    tree->state        = (u8*)realloc(tree->state, sizeof(u8) * capacity);
+    tree->capacity     = capacity;
+}
+
+void tree_release(TreeView *tree)
+{
+    if(!tree || --tree->refs > 0) return;
+    free(tree->depths);
+    free(tree->parents);
+    free(tree->first_child);
+    free(tree->num_children);
+    free(tree->state);
+    free(tree);
+}
+
+// Appends the lines of children, a directory's own listing, to the tree as the children of parent
+void tree_add_children(Buffer *screen, u32 parent, Listing *children)
+{
+    TreeView *tree = screen->tree;
+    Listing *listing = screen->listing;
+    char path[PATH_MAX];
+    u32 base = 0;
+    if(parent != TREE_ROOT)
+    {
+        base = listing->lengths[parent];
+        memcpy(path, listing->blob + listing->offsets[parent], base);
+        path[base++] = '/';
+    }
+    u32 bytes = 0;
+    for(u32 i = 0; i < children->num_lines; i++) bytes += base + children->lengths[i] + 1;
+    listing_reserve(listing, children->num_lines, bytes);
+    tree_reserve(tree, listing->capacity);
+
+    u32 first = listing->num_lines;
+    for(u32 i = 0; i < children->num_lines; i++)
+    {
+        const char *name = children->blob + children->offsets[i];
+        u32 length = children->lengths[i];
+        if(name[0] == '.' && (length == 1 || (length == 2 && name[1] == '.'))) continue;
+        if(base + length >= sizeof(path)) continue;
+        memcpy(path + base, name, length);
+
+        u32 line = listing->num_lines++;
+        listing->offsets[line] = listing->blob_size;
+        listing->lengths[line] = base + length;
+        listing->flags[line]   = children->flags[i];
+        memcpy(listing->blob + listing->blob_size, path, base + length);
+        listing->blob[listing->blob_size + base + length] = '\0';
+        listing->blob_size += base + length + 1;
+
+        tree->depths[line]       = parent == TREE_ROOT ? 0 : tree->depths[parent] + 1;
+        tree->parents[line]      = parent;
+        tree->first_child[line]  = 0;
+        tree->num_children[line] = 0;
+        tree->state[line]        = 0;
+    }
+    if(parent == TREE_ROOT)
+    {
+        tree->num_top = listing->num_lines - first;
+    }
+    else
+    {
+        tree->first_child[parent]  = first;
+        tree->num_children[parent] = listing->num_lines - first;
+        tree->state[parent]        = (tree->state[parent] | TREE_LOADED) & ~TREE_LOADING;
+    }
+    listing_appended(listing);
+}
+
+// Writes the rows showing for count siblings from first on, each followed by its children's rows
+// if it's open. With keys siblings are in the buffer's sort order, otherwise in name order.
+// Directories always show, the filter only hides files. Returns how many rows it wrote.
+u32 tree_rows(Buffer *screen, u32 first, u32 count, u64 *keys, u32 *out)
+{
+    TreeView *tree = screen->tree;
+    Listing *listing = screen->listing;
+    // Siblings are few next to the whole tree, so each group gets a comparison sort of its own
+    KeyedLine *sorted = NULL;
+    if(keys && count > 1)
+    {
+        sorted = (KeyedLine*)arena_alloc(&global_frame_arena, sizeof(KeyedLine) * count);
+        for(u32 i = 0; i < count; i++) sorted[i] = (KeyedLine){keys[first + i], first + i};
+        qsort(sorted, count, sizeof(KeyedLine), compare_keyed_lines);
+    }
+
+    u32 written = 0;
+    for(u32 i = 0; i < count; i++)
+    {
+        u32 line = sorted ? sorted[i].line : first + i;
+        b32 dir = listing->flags[line] & LINE_DIR;
+        if(!dir && screen->filter && !filter_keeps(screen->filter, listing, line)) continue;
+        out[written++] = line;
+        if((tree->state[line] & (TREE_OPEN|TREE_LOADED)) == (TREE_OPEN|TREE_LOADED))
+        {
+            written += tree_rows(screen, tree->first_child[line], tree->num_children[line], keys, out + written);
+        }
+    }
+    return written;
+}
+
+// Rebuilds the whole order from the tree, for when the sort or the filter changes. Opening and
+// closing directories only splices the rows under them.
+void tree_order(Buffer *screen)
+{
+    Listing *listing = screen->listing;
+    if(screen->filter) filter_listing(screen->filter, listing);
+    u64 *keys = screen->sort == SORT_NAME ? NULL : listing_keys(listing, screen->sort);
+    screen->num_lines   = tree_rows(screen, 0, screen->tree->num_top, keys, screen->order);
+    screen->files_start = 0;
+}
+
+// Row showing line, or num_lines if it's under a closed directory
+u32 tree_row(Buffer *screen, u32 line)
+{
+    u32 row = 0;
+    while(row < screen->num_lines && screen->order[row] != line) row++;
+    return row;
+}
+
+// Splices the rows under the open directory on row in after it. The cursor stays on its entry.
+void tree_show_children(Buffer *screen, u32 row)
+{
+    TreeView *tree = screen->tree;
+    Listing *listing = screen->listing;
+    u32 line = screen->order[row];
+    if(screen->filter) filter_listing(screen->filter, listing);
+    u64 *keys = screen->sort == SORT_NAME ? NULL : listing_keys(listing, screen->sort);
+    u32 *rows = (u32*)arena_alloc(&global_frame_arena, sizeof(u32) * (listing->num_lines + 1));
+    u32 count = tree_rows(screen, tree->first_child[line], tree->num_children[line], keys, rows);
+
+    if(screen->num_lines + count > screen->capacity)
+    {
+        screen->capacity = (screen->num_lines + count) * 2;
+        screen->order = (u32*)realloc(screen->order, sizeof(u32) * screen->capacity);
+    }
+    memmove(screen->order + row + 1 + count, screen->order + row + 1, sizeof(u32) * (screen->num_lines - row - 1));
+    memcpy(screen->order + row + 1, rows, sizeof(u32) * count);
+    screen->num_lines += count;
+    if(screen->current_line > row) jump_to_line(screen, screen->current_line + count);
+}
+
+// Takes out the rows under the directory on row, which are everything after it that's deeper
+void tree_hide_children(Buffer *screen, u32 row)
+{
+    TreeView *tree = screen->tree;
+    u16 depth = tree->depths[screen->order[row]];
+    u32 end = row + 1;
+    while(end < screen->num_lines && tree->depths[screen->order[end]] > depth) end++;
+    u32 count = end - row - 1;
+    memmove(screen->order + row + 1, screen->order + end, sizeof(u32) * (screen->num_lines - end));
+    screen->num_lines -= count;
+    // The cursor goes to the directory if it was on a row that went
+    if(screen->current_line >= end) jump_to_line(screen, screen->current_line - count);
+    else if(screen->current_line > row) jump_to_line(screen, row);
+}
+
+void tree_load_task(void *data)
+{
+    TreeLoad *load = (TreeLoad*)data;
+    int fd = openat(load->dir_fd, load->path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(fd >= 0)
+    {
+        load->listing = listing_read(fd, NULL);
+        close(fd);
+    }
+    close(load->dir_fd);
+    pthread_mutex_lock(&global_stat_lock);
+    load->next = global_tree_loads_done;
+    global_tree_loads_done = load;
+    pthread_mutex_unlock(&global_stat_lock);
+}
+
+// Opens or closes the directory on row. The first time it opens its listing is taken from the
+// listing cache if it's current there, otherwise it's read on the pool and its rows show once
+// poll_tree has them.
+void tree_toggle(Buffer *screen, u32 row)
+{
+    TreeView *tree = screen->tree;
+    Listing *listing = screen->listing;
+    u32 line = screen->order[row];
+    if(!(listing->flags[line] & LINE_DIR)) return;
+    if(tree->state[line] & TREE_OPEN)
+    {
+        tree->state[line] &= ~TREE_OPEN;
+        if(tree->state[line] & TREE_LOADED) tree_hide_children(screen, row);
+        return;
+    }
+    tree->state[line] |= TREE_OPEN;
+    atomic_fetch_add(&global_stats.tree_opens, 1);
+    if(tree->state[line] & TREE_LOADED)
+    {
+        tree_show_children(screen, row);
+        return;
+    }
+    if(tree->state[line] & TREE_LOADING) return;
+
+    const char *path = listing->blob + listing->offsets[line];
+    struct stat statbuf;
+    if(fstatat(screen->dir_fd, path, &statbuf, 0) == 0)
+    {
+        Listing *cached = listing_cache_lookup(statbuf.st_dev, statbuf.st_ino);
+        if(cached && cached->mtime.tv_sec == statbuf.st_mtim.tv_sec && cached->mtime.tv_nsec == statbuf.st_mtim.tv_nsec)
+        {
+            atomic_fetch_add(&global_stats.listing_hits, 1);
+            tree_add_children(screen, line, cached);
+            tree_show_children(screen, row);
+            return;
+        }
+    }
+
+    int dir_fd = fcntl(screen->dir_fd, F_DUPFD_CLOEXEC, 0);
+    if(dir_fd < 0)
+    {
+        tree->state[line] &= ~TREE_OPEN;
+        draw_error(screen, strerror(errno));
+        return;
+    }
+    u32 length = listing->lengths[line];
+    TreeLoad *load = (TreeLoad*)calloc(1, sizeof(TreeLoad) + length + 1);
+    load->tree   = tree;
+    load->line   = line;
+    load->dir_fd = dir_fd;
+    memcpy(load->path, path, length + 1);
+    tree->refs++;
+    tree->state[line] |= TREE_LOADING;
+    global_tree_loads++;
+    atomic_fetch_add(&global_stats.listing_misses, 1);
+    atomic_fetch_add(&global_stats.tree_reads, 1);
+    pool_submit(&global_pools[PRIORITY_INTERACTIVE], tree_load_task, load);
+}
+
+// Turns the buffer into a tree view of its directory with every directory in it closed
+void start_tree_view(Buffer *screen)
+{
+    // From a flat or tree view the directory's own listing is loaded again first
+    if(screen->listing->flat) load_directory(screen);
+    Listing *source = screen->listing;
+    source->refs++;
+    clear_normal_buffer_area(screen);
+
+    TreeView *tree = (TreeView*)calloc(1, sizeof(TreeView));
+    tree->refs   = 1;
+    screen->tree = tree;
+    set_listing(screen, flat_listing_new(screen->dir_fd));
+    tree_add_children(screen, TREE_ROOT, source);
+    listing_release(source);
+    sort_buffer(screen);
+}
+
+void stop_tree_view(Buffer *screen)
+{
+    tree_release(screen->tree);
+    screen->tree = NULL;
+}
+
+// Called from the main loop. Gives the directories tree views opened their children once they're
+// read and shows them if they're still open. The listings go in the listing cache for next time.
+// Not while a visual selection is open, rows mustn't move under it.
+void poll_tree(void)
+{
+    if(global_mode == VISUAL) return;
+    pthread_mutex_lock(&global_stat_lock);
+    TreeLoad *load = global_tree_loads_done;
+    global_tree_loads_done = NULL;
+    pthread_mutex_unlock(&global_stat_lock);
+
+    while(load)
+    {
+        TreeLoad *next = load->next;
+        TreeView *tree = load->tree;
+        Listing *listing = load->listing;
+        u32 line = load->line;
+        global_tree_loads--;
+
+        // Dropped if the buffer has stopped showing the tree since
+        Buffer *screen = NULL;
+        for(u32 i = 0; i < global_state_num_buffers; i++)
+        {
+            if(global_state_buffers[i]->tree == tree) screen = global_state_buffers[i];
+        }
+        if(screen)
+        {
+            tree->state[line] &= ~TREE_LOADING;
+            if(listing)
+            {
+                tree_add_children(screen, line, listing);
+                u32 row = tree_row(screen, line);
+                if((tree->state[line] & TREE_OPEN) && row < screen->num_lines) tree_show_children(screen, row);
+            }
+            else
+            {
+                tree->state[line] &= ~TREE_OPEN;
+            }
+            if(global_mode == NORMAL)
+            {
+                clear_normal_buffer_area(screen);
+                update_screen(screen);
+            }
+        }
+        if(listing && !listing_cache_lookup(listing->id.dev, listing->id.ino)) listing_cache_insert(listing);
+        listing_release(listing);
+        tree_release(tree);
+        free(load);
+        load = next;
+    }
+}
+
+// A tree view shows a line as its name indented under its directory, with a + or - in front of
+// directories that are closed or open. Draws the indent on row y and moves text from the path on
+// to the name. Returns the columns it took, none outside a tree view.
+u32 draw_tree_indent(Buffer *screen, u32 line, u32 y, const char **text, u32 *length)
+{
+    TreeView *tree = screen->tree;
+    if(!tree) return 0;
+    struct tb_cell *tb_buffer = tb_cell_buffer();
+    // Deep trees stop indenting so names don't run out of the pane
+    u32 indent = tree->depths[line] * 2 + 2;
+    if(indent > screen->width / 2) indent = screen->width / 2;
+    u8 state = tree->state[line];
+    char marker = !(screen->listing->flags[line] & LINE_DIR) ? ' ' : state & TREE_LOADING ? '~' : state & TREE_OPEN ? '-' : '+';
+    u32 row = screen->x + global_terminal_width * (screen->y + y - screen->view_range_start + 1);
+    for(u32 x = 0; x < indent; x++)
+    {
+        tb_buffer[row + x].ch = x + 2 == indent ? (u32)marker : (u32)' ';
+        tb_buffer[row + x].fg = TB_WHITE;
+        tb_buffer[row + x].bg = TB_BLACK;
+    }
+
+    const char *end = *text + *length;
+    const char *name = end;
+    while(name > *text && name[-1] != '/') name--;
+    *text   = name;
+    *length = end - name;
+    return indent;
+}
+
+// Children are removed before their parent's pending count can reach zero, so a node's fd is
+// guaranteed open for as long as any descendant still needs it for unlinkat.
+void delete_node_finish(DeleteNode *node)
+{
+    while(node && atomic_fetch_sub(&node->pending, 1) == 1)
+    {
+        DeleteNode *parent = node->parent;
+        Job *job = node->job;
+        if(node->fd >= 0)
+        {
+            close(node->fd);
+            atomic_fetch_sub(&global_open_fds, 1);
+        }
+
+        if(parent)
+        {
+            rate_limit_take(&job->limit, 0, 1);
+            if(unlinkat(parent->fd, node->name, AT_REMOVEDIR) == 0) atomic_fetch_add(&job->dirs_done, 1);
+            else atomic_fetch_add(&job->errors, 1);
+            free(node);
+        }
+        else
+        {
+            free(node);
+            atomic_store(&job->done, true);
+        }
+        node = parent;
+    }
+}
+
+// Runs the unlinks delete_node_task has queued on ring and counts how they went.
+void delete_flush(Job *job, IoRing *ring, u32 count)
+{
+    if(count == 0) return;
+    i32 results[IORING_DEPTH];
+    rate_limit_take(&job->limit, 0, count);
+    ioring_run(ring, results);
+    for(u32 i = 0; i < count; i++) atomic_fetch_add(results[i] == 0 ? &job->files_done : &job->errors, 1);
+}
+
+// Unlinks name in fd, queued on ring when there is one, in which case name has to stay put
+// until the batch is flushed.
+void delete_unlink(Job *job, IoRing *ring, int fd, const char *name, u32 *batched)
+{
+    struct io_uring_sqe *sqe = ring ? ioring_prep(ring, IORING_OP_UNLINKAT, fd, *batched) : NULL;
+    if(sqe)
+    {
+        sqe->addr = (u64)(uintptr_t)name;
+        if(++*batched == IORING_DEPTH)
+        {
+            delete_flush(job, ring, *batched);
+            *batched = 0;
+        }
+    }
+    else if(rate_limit_take(&job->limit, 0, 1), unlinkat(fd, name, 0) == 0)
+    {
+        atomic_fetch_add(&job->files_done, 1);
+    }
+    else
+    {
+        atomic_fetch_add(&job->errors, 1);
+    }
+}
+
+void delete_spawn(DeleteNode *parent, const char *name)
+{
+    size_t length = strlen(name);
+    DeleteNode *child = (DeleteNode*)malloc(sizeof(DeleteNode) + length + 1);
+    child->parent = parent;
+    child->job    = parent->job;
+    child->fd     = -1;
+    atomic_init(&child->pending, 1);
+    memcpy(child->name, name, length + 1);
+
+    atomic_fetch_add(&parent->pending, 1);
+    // The root is filled on the main thread, which must never walk a tree itself
+    if(!parent->parent || atomic_load(&global_open_fds) < global_fd_budget)
+    {
+        pool_submit(&global_pools[atomic_load(&child->job->priority)], delete_node_task, child);
+    }
+    else
+    {
+        delete_node_task(child);
+    }
+}
+
+void delete_node_task(void *data)
+{
+    DeleteNode *node = (DeleteNode*)data;
+    Job *job = node->job;
+
+    node->fd = openat(node->parent->fd, node->name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if(node->fd < 0)
+    {
+        atomic_fetch_add(&job->errors, 1);
+        delete_node_finish(node);
+        return;
+    }
+    atomic_fetch_add(&global_open_fds, 1);
+
+    DIR *dir = fdopendir(dup(node->fd));
+    if(!dir)
+    {
+        atomic_fetch_add(&job->errors, 1);
+        delete_node_finish(node);
+        return;
+    }
+
+    // With a ring, file unlinks are queued up and submitted IORING_DEPTH at a time. readdir may
+    // reuse its buffer so queued names are copied out first.
+    IoRing *ring = ioring_get();
+    char (*batch)[256] = ring && ring->supported[IORING_OP_UNLINKAT] ? (char(*)[256])malloc(IORING_DEPTH * 256) : NULL;
+    u32 batched = 0;
+
+    struct dirent *entry;
+    while((entry = readdir(dir)))
+    {
+        char *name = entry->d_name;
+        if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+        b32 is_dir = entry->d_type == DT_DIR;
+        if(entry->d_type == DT_UNKNOWN)
+        {
+            struct stat statbuf;
+            is_dir = fstatat(node->fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(statbuf.st_mode);
+        }
+
+        if(is_dir)
+        {
+            // delete_spawn can run the child inline on this thread and so on this ring, which has
+            // to be empty by then
+            delete_flush(job, ring, batched);
+            batched = 0;
+            delete_spawn(node, name);
+            continue;
+        }
+
+        if(batch)
+        {
+            strcpy(batch[batched], name);
+            delete_unlink(job, ring, node->fd, batch[batched], &batched);
+        }
+        else
+        {
+            delete_unlink(job, NULL, node->fd, name, &batched);
+        }
+    }
+    closedir(dir);
+    if(batch)
+    {
+        delete_flush(job, ring, batched);
+        free(batch);
+    }
+    delete_node_finish(node);
+}
+
+// Deletes name in dir_fd as part of job, taking ownership of dir_fd. The job is done when it's gone.
+void delete_into_job(Job *job, int dir_fd, const char *name)
+{
+    DeleteNode *root = (DeleteNode*)malloc(sizeof(DeleteNode) + 1);
+    root->parent  = NULL;
+    root->job     = job;
+    root->fd      = dir_fd;
+    root->name[0] = '\0';
+    atomic_init(&root->pending, 1);
+    atomic_fetch_add(&global_open_fds, 1);
+
+    struct stat statbuf;
+    if(fstatat(dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(statbuf.st_mode))
+    {
+        delete_spawn(root, name);
+    }
+    else if(unlinkat(dir_fd, name, 0) == 0)
+    {
+        atomic_fetch_add(&job->files_done, 1);
+    }
+    else
+    {
+        atomic_fetch_add(&job->errors, 1);
+    }
+    delete_node_finish(root);
+}
+
+void delete_files_task(void *data)
+{
+    DeleteFiles *files = (DeleteFiles*)data;
+    DeleteNode *root = files->root;
+    IoRing *ring = ioring_get();
+    u32 batched = 0;
+    char *name = files->names;
+    for(u32 i = 0; i < files->count; i++)
+    {
+        delete_unlink(root->job, ring, root->fd, name, &batched);
+        name += strlen(name) + 1;
+    }
+    delete_flush(root->job, ring, batched);
+    free(files->names);
+    free(files);
+    delete_node_finish(root);
+}
+
+// Removes lines [start, end) of the buffer in the background. The files directly in the buffer's
+// directory go to one task on the pool, each directory becomes its own.
+void start_delete_job(Buffer *screen, u32 start, u32 end)
+{
+    int fd = openat(screen->dir_fd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(fd < 0) return;
+    atomic_fetch_add(&global_open_fds, 1);
+
+    Job *job = job_new(JOB_DELETE, screen->listing->id);
+    DeleteNode *root = (DeleteNode*)malloc(sizeof(DeleteNode) + 1);
+    root->parent  = NULL;
+    root->job     = job;
+    root->fd      = fd;
+    root->name[0] = '\0';
+    atomic_init(&root->pending, 1);
+
+    DeleteFiles *files = (DeleteFiles*)calloc(1, sizeof(DeleteFiles));
+    files->root = root;
+    u32 names_size = 0;
+    u32 names_capacity = 0;
+    char name[256];
+    for(u32 i = start; i < end && i < screen->num_lines; i++)
+    {
+        u32 line = line_at(screen, i);
+        u32 length = screen->listing->lengths[line];
+        if(length >= sizeof(name)) continue;
+        memcpy(name, screen->listing->blob + screen->listing->offsets[line], length + 1);
+        if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+        if(screen->listing->flags[line] & LINE_DIR)
+        {
+            delete_spawn(root, name);
+            continue;
+        }
+        if(names_size + length + 1 > names_capacity)
+        {
+            names_capacity = (names_size + length + 1) * 2;
+            files->names = (char*)realloc(files->names, names_capacity);
+        }
+        memcpy(files->names + names_size, name, length + 1);
+        names_size += length + 1;
+        files->count++;
+    }
+    if(files->count)
+    {
+        atomic_fetch_add(&root->pending, 1);
+        pool_submit(&global_pools[atomic_load(&job->priority)], delete_files_task, files);
+    }
+    else
+    {
+        free(files);
+    }
+    delete_node_finish(root);
+}
+
+InodeLink *inode_map_find(InodeMap *map, dev_t dev, ino_t ino)
+{
+    if(map->capacity == 0) return NULL;
+    u32 mask = map->capacity - 1;
+    u32 index = (u32)(((u64)ino * 0x9E3779B97F4A7C15ULL) >> 32) ^ (u32)dev;
+    for(;; index++)
+    {
+        InodeLink *entry = &map->entries[index & mask];
+        if(!entry->path) return NULL;
+        if(entry->ino == ino && entry->dev == dev) return entry;
+    }
+}
+
+// Takes ownership of path. Capacity stays a power of two and under 3/4 full.
+void inode_map_insert(InodeMap *map, dev_t dev, ino_t ino, char *path)
+{
+    if((map->count + 1) * 4 >= map->capacity * 3)
+    {
+        InodeMap grown = {};
+        grown.capacity = map->capacity ? map->capacity * 2 : 256;
+        grown.entries  = (InodeLink*)calloc(grown.capacity, sizeof(InodeLink));
+        for(u32 i = 0; i < map->capacity; i++)
+        {
+            InodeLink *entry = &map->entries[i];
+            if(entry->path) inode_map_insert(&grown, entry->dev, entry->ino, entry->path);
+        }
+        free(map->entries);
+        map->entries  = grown.entries;
+        map->capacity = grown.capacity;
+    }
+
+    u32 mask = map->capacity - 1;
+    u32 index = (u32)(((u64)ino * 0x9E3779B97F4A7C15ULL) >> 32) ^ (u32)dev;
+    while(map->entries[index & mask].path) index++;
+    InodeLink *entry = &map->entries[index & mask];
+    entry->dev  = dev;
+    entry->ino  = ino;
+    entry->path = path;
+    map->count++;
+}
+
+// Copies one non-directory entry of dir. Symlinks are recreated as links and every name after
+// the first for a multiply linked inode becomes a hard link to the first copy.
+void copy_entry(CopyNode *dir, const char *name, struct statx *source)
+{
+    Job *job = dir->job;
+    u32 mode = source->stx_mode;
+    b32 success;
+    b32 linked = false;
+    if(!S_ISREG(mode) || source->stx_nlink > 1) rate_limit_take(&job->limit, 0, 1);
+
+    size_t path_length = strlen(dir->path) + strlen(name) + 2;
+    char *path = (char*)malloc(path_length);
+    snprintf(path, path_length, "%s%s%s", dir->path, dir->path[0] ? "/" : "", name);
+    dev_t dev = makedev(source->stx_dev_major, source->stx_dev_minor);
+
+    if(job->completed)
+    {
+        if(path_set_contains(job->completed, path))
+        {
+            // Done before the crash. Later links to it still need to find it.
+            if(S_ISREG(mode) && source->stx_nlink > 1)
+            {
+                pthread_mutex_lock(&job->links.lock);
+                if(!inode_map_find(&job->links, dev, source->stx_ino)) inode_map_insert(&job->links, dev, source->stx_ino, path);
+                else free(path);
+                pthread_mutex_unlock(&job->links.lock);
+            }
+            else
+            {
+                free(path);
+            }
+            atomic_fetch_add(&job->files_done, 1);
+            return;
+        }
+        // Whatever is there is a partial copy from before the crash
+        unlinkat(dir->dst_fd, name, 0);
+    }
+    const char *fields[] = {path};
+    if(job->journal_id) journal_record('I', job->journal_id, fields, 1, -1, -1, false);
+
+    if(S_ISLNK(mode))
+    {
+        char target[4096];
+        ssize_t length = readlinkat(dir->src_fd, name, target, sizeof(target) - 1);
+        success = length >= 0;
+        if(success)
+        {
+            target[length] = '\0';
+            success = symlinkat(target, dir->dst_fd, name) == 0;
+        }
+        if(success && (job->preserve & PRESERVE_OWNER))
+        {
+            fchownat(dir->dst_fd, name, source->stx_uid, source->stx_gid, AT_SYMLINK_NOFOLLOW);
+        }
+        if(success && (job->preserve & PRESERVE_TIMES))
+        {
+            struct timespec times[2] = {{source->stx_atime.tv_sec, source->stx_atime.tv_nsec},
+                                        {source->stx_mtime.tv_sec, source->stx_mtime.tv_nsec}};
+            utimensat(dir->dst_fd, name, times, AT_SYMLINK_NOFOLLOW);
+        }
+    }
+    else if(S_ISREG(mode) && source->stx_nlink > 1)
+    {
+        // The first copy is created while holding the lock so nobody can try to link to it
+        // before it exists. Linking to it while its data is still being written is fine.
+        pthread_mutex_lock(&job->links.lock);
+        InodeLink *link = inode_map_find(&job->links, dev, source->stx_ino);
+        if(link)
+        {
+            success = linkat(job->dst_root_fd, link->path, dir->dst_fd, name, 0) == 0;
+            linked = success;
+            pthread_mutex_unlock(&job->links.lock);
+        }
+        else
+        {
+            int fd = openat(dir->dst_fd, name, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, S_IRUSR + S_IWUSR);
+            if(fd >= 0)
+            {
+                close(fd);
+                inode_map_insert(&job->links, dev, source->stx_ino, strdup(path));
+            }
+            pthread_mutex_unlock(&job->links.lock);
+            success = fd >= 0 && copy_file_at(dir->src_fd, name, dir->dst_fd, name, job->preserve, source, COPY_HAVE_SOURCE|COPY_DST_EXISTS, &job->limit);
+        }
+    }
+    else if(S_ISREG(mode))
+    {
+        success = copy_file_at(dir->src_fd, name, dir->dst_fd, name, job->preserve, source, COPY_HAVE_SOURCE, &job->limit);
+    }
+    else
+    {
+        // Fifos, sockets and device nodes
+        success = mknodat(dir->dst_fd, name, mode, makedev(source->stx_rdev_major, source->stx_rdev_minor)) == 0;
+    }
+
+    if(success)
+    {
+        if(job->journal_id)
+        {
+            // A link's data is synced with the first copy, symlinks and nodes have none
+            int file_fd = S_ISREG(mode) && !linked ? openat(dir->dst_fd, name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC) : -1;
+            journal_record('C', job->journal_id, fields, 1, file_fd, dir->dst_fd, false);
+            if(file_fd >= 0) close(file_fd);
         }
+        atomic_fetch_add(&job->files_done, 1);
+        atomic_fetch_add(linked ? &job->bytes_saved : &job->bytes_done, source->stx_size);
+    }
+    else
+    {
+        atomic_fetch_add(&job->errors, 1);
+    }
+    free(path);
+}
 
-        for(u32 x = 0; x < end_x; x++)
+// Once a directory's whole subtree is in place it gets its metadata, last because adding
+// entries would bump its mtime and a read only mode would have stopped them being added.
+void copy_node_finish(CopyNode *node)
+{
+    while(node && atomic_fetch_sub(&node->pending, 1) == 1)
+    {
+        CopyNode *parent = node->parent;
+        Job *job = node->job;
+        if(parent)
         {
-            u32 tb_index = screen->x + x + global_terminal_width * (screen->y + y - screen->view_range_start + 1);
-            tb_buffer[tb_index].ch = (u32)line.text->start[x];
-            tb_buffer[tb_index].fg = TB_WHITE;
-            if(y >= start && y < end)
+            if(node->src_fd >= 0 && node->dst_fd >= 0)
             {
-                tb_buffer[tb_index].bg = TB_BLUE;
+                b32 copied = copy_metadata(node->src_fd, node->dst_fd, &node->source, job->preserve);
+                atomic_fetch_add(copied ? &job->dirs_done : &job->errors, 1);
+                if(job->journal_id) journal_sync(node->dst_fd);
             }
-            else
+            if(node->src_fd >= 0)
             {
-                tb_buffer[tb_index].bg = TB_BLACK;
+                close(node->src_fd);
+                atomic_fetch_sub(&global_open_fds, 1);
+            }
+            if(node->dst_fd >= 0)
+            {
+                close(node->dst_fd);
+                atomic_fetch_sub(&global_open_fds, 1);
             }
+            free(node->path);
+            free(node);
+        }
+        else if(job->move && atomic_load(&job->errors) == 0)
+        {
+            // A move across devices. The copy is complete and on disk once M is, so the source
+            // can go to the delete engine, which marks the job done when it's gone.
+            if(job->journal_id) journal_wait(journal_record('M', job->journal_id, NULL, 0, -1, node->dst_fd, true));
+            close(node->dst_fd);
+            atomic_fetch_sub(&global_open_fds, 2);
+            delete_into_job(job, node->src_fd, node->name);
+            free(node->path);
+            free(node);
+        }
+        else
+        {
+            close(node->src_fd);
+            close(node->dst_fd);
+            atomic_fetch_sub(&global_open_fds, 2);
+            free(node->path);
+            free(node);
+            atomic_store(&job->done, true);
         }
+        node = parent;
     }
+}
+
+void copy_spawn(CopyNode *parent, const char *name)
+{
+    size_t length = strlen(name);
+    CopyNode *child = (CopyNode*)calloc(1, sizeof(CopyNode) + length + 1);
+    child->parent = parent;
+    child->job    = parent->job;
+    child->src_fd = -1;
+    child->dst_fd = -1;
+    atomic_init(&child->pending, 1);
+    memcpy(child->name, name, length + 1);
+
+    size_t path_length = strlen(parent->path) + length + 2;
+    child->path = (char*)malloc(path_length);
+    snprintf(child->path, path_length, "%s%s%s", parent->path, parent->path[0] ? "/" : "", name);
 
-    for(u32 i = 0; i < global_terminal_width; i++)
+    atomic_fetch_add(&parent->pending, 1);
+    // Same rule as delete_spawn, the main thread never copies anything itself
+    if(!parent->parent || atomic_load(&global_open_fds) < global_fd_budget)
     {
-        u32 index = i + global_terminal_width * (screen->y + screen->height - 1);
-        tb_buffer[index].fg = TB_WHITE | TB_UNDERLINE;
+        pool_submit(&global_pools[atomic_load(&child->job->priority)], copy_node_task, child);
+    }
+    else
+    {
+        copy_node_task(child);
     }
-
-    tb_present();
 }
 
-void update_search_screen(SearchBuffer *results)
+// Copies whatever node names in its parent. Directories are recreated and their entries copied,
+// with subdirectories spawned as new tasks.
+void copy_node_task(void *data)
 {
-    struct tb_cell *tb_buffer = tb_cell_buffer();
+    CopyNode *node = (CopyNode*)data;
+    CopyNode *parent = node->parent;
+    Job *job = node->job;
+    u32 mask = STATX_TYPE|STATX_MODE|STATX_NLINK|STATX_UID|STATX_GID|STATX_ATIME|STATX_MTIME|STATX_INO|STATX_SIZE;
+    // The paste's one top level node, the B record has to be on disk before anything is written
+    if(!parent->parent) journal_wait(job->journal_commit);
 
-    // Draw query bar
-    draw_text(results->query, results->query_x, results->query_y);
+    if(statx(parent->src_fd, node->name, AT_SYMLINK_NOFOLLOW, mask, &node->source) < 0)
+    {
+        atomic_fetch_add(&job->errors, 1);
+        copy_node_finish(node);
+        return;
+    }
+    if(!S_ISDIR(node->source.stx_mode))
+    {
+        copy_entry(parent, node->name, &node->source);
+        copy_node_finish(node);
+        return;
+    }
 
-    u32 end;
-    if(results->num_lines < results->view_range_end)
+    node->src_fd = openat(parent->src_fd, node->name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if(node->src_fd >= 0) atomic_fetch_add(&global_open_fds, 1);
+    if(node->src_fd >= 0 && (mkdirat(parent->dst_fd, node->name, S_IRWXU) == 0 || (job->completed && errno == EEXIST)))
     {
-        end = results->num_lines;
+        node->dst_fd = openat(parent->dst_fd, node->name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        if(node->dst_fd >= 0) atomic_fetch_add(&global_open_fds, 1);
+        // Records for files inside it mean nothing if its entry in the parent didn't survive
+        if(job->journal_id) journal_sync(parent->dst_fd);
     }
-    else
+    DIR *dir = node->dst_fd >= 0 ? fdopendir(dup(node->src_fd)) : NULL;
+    if(!dir)
     {
-        end = results->view_range_end;
+        atomic_fetch_add(&job->errors, 1);
+        copy_node_finish(node);
+        return;
     }
 
-    for(u32 y = results->view_range_start; y < end; y++)
+    struct dirent *entry;
+    while((entry = readdir(dir)))
     {
-        Result line = results->buffer[y];
-        // TODO(Luke): Make this robust
-        if(line.is_dir)
+        char *name = entry->d_name;
+        if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+        if(entry->d_type == DT_DIR)
         {
-            u32 end_line = line.text->length + results->x + global_terminal_width * (y - results->view_range_start + results->y);
-            tb_buffer[end_line].ch = (u32)'/';
-            tb_buffer[end_line].fg = TB_WHITE;
-            tb_buffer[end_line].bg = y == results->current_line ? TB_BLUE : TB_BLACK;
+            copy_spawn(node, name);
+            continue;
         }
 
-        u16 bg = y == results->current_line ? TB_MAGENTA : TB_WHITE;
-        for(u32 x = 0; x < line.text->length; x++)
+        struct statx source;
+        if(statx(node->src_fd, name, AT_SYMLINK_NOFOLLOW, mask, &source) < 0)
         {
-            u32 tb_index = x + results->x + global_terminal_width * (y - results->view_range_start + results->y);
-            tb_buffer[tb_index].ch = (u32)line.text->start[x];
-            u16 fg = y == results->current_line ? TB_WHITE : TB_BLACK;
-            if((line.color_mask >> x) & 1) fg |= TB_BOLD;
-            tb_buffer[tb_index].fg = fg;
-            tb_buffer[tb_index].bg = bg;
+            atomic_fetch_add(&job->errors, 1);
         }
-        for(u32 x = line.text->length; x < results->width; x++)
+        else if(S_ISDIR(source.stx_mode))
         {
-            u32 tb_index = x + results->x + global_terminal_width * (y - results->view_range_start + results->y);
-            tb_buffer[tb_index].ch = (u32)' ';
-            tb_buffer[tb_index].bg = bg;
+            copy_spawn(node, name);
+        }
+        else
+        {
+            copy_entry(node, name, &source);
         }
     }
-    tb_present();
+    closedir(dir);
+    copy_node_finish(node);
 }
 
-void draw_search_overlay(Buffer *screen, SearchBuffer *results)
+// Runs name in src_fd's directory into dst_fd's as a background copy, taking ownership of both fds.
+// move deletes the source after a clean copy. completed is set when resuming from the journal.
+Job *start_copy_job(int src_fd, int dst_fd, const char *name, u32 preserve, b32 move, u64 journal_id, u64 journal_commit, PathSet *completed)
 {
-    clear_normal_buffer_area(screen);
-    u32 original_view_end = screen->view_range_end;
-    if(screen->num_lines < screen->height - 1 - results->height)
-    {
-        update_screen(screen);
-    }
-    else
+    Job *job = job_new(JOB_COPY, dir_id(dst_fd));
+    job->preserve    = preserve;
+    job->dst_root_fd = dst_fd;
+    job->journal_id  = journal_id;
+    job->journal_commit = journal_commit;
+    job->completed   = completed;
+    pthread_mutex_init(&job->links.lock, NULL);
+    if(move)
     {
-        screen->view_range_end  = screen->view_range_start + (screen->height - 1 - results->height);
-        update_screen(screen);
-        screen->view_range_end = original_view_end;
+        job->move             = true;
+        job->source_directory = dir_id(src_fd);
     }
-    update_search_screen(results);
+
+    CopyNode *root = (CopyNode*)calloc(1, sizeof(CopyNode) + strlen(name) + 1);
+    root->job    = job;
+    root->src_fd = src_fd;
+    root->dst_fd = dst_fd;
+    root->path   = (char*)calloc(1, 1);
+    atomic_init(&root->pending, 1);
+    strcpy(root->name, name);
+    atomic_fetch_add(&global_open_fds, 2);
+
+    copy_spawn(root, name);
+    copy_node_finish(root);
+    return job;
 }
 
-int pop_directory(String *path)
+// Returns a reference to a YankDir for dir_fd, the one the last queued operation holds if it's the
+// same directory. NULL when the directory can't be opened.
+YankDir *yank_dir(OperationQueue *op, int dir_fd)
 {
-    i32 index = (i32)(path->length - 1);
-    char c;
-
-    while(index >= 0)
+    if(op->size > 0)
     {
-        c = path->start[index];
-        index--;
-        path->length--;
-        if(c == '/') return 1;
+        YankDir *last = op->data[(op->end + op->capacity - 1) % op->capacity].dir;
+        DirId a = dir_id(last->fd);
+        DirId b = dir_id(dir_fd);
+        if(a.dev == b.dev && a.ino == b.ino)
+        {
+            last->refs++;
+            return last;
+        }
     }
-    return 0;
+    int fd = openat(dir_fd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(fd < 0) return NULL;
+    YankDir *dir = (YankDir*)malloc(sizeof(YankDir));
+    dir->refs = 1;
+    dir->fd   = fd;
+    atomic_fetch_add(&global_open_fds, 1);
+    return dir;
 }
 
-void push_directory(String *path, String *dir)
+void yank_dir_release(YankDir *dir)
 {
-    string_push(path, '/');
-    string_concat(path, dir);
+    if(--dir->refs) return;
+    close(dir->fd);
+    atomic_fetch_sub(&global_open_fds, 1);
+    free(dir);
 }
 
-void load_directory(char *path, Buffer *screen)
+// Pastes operation into the buffer's directory and frees its strings and directory. Moves within a
+// device are a single rename, everything else is a background copy job. Both are journaled.
+void start_paste_job(Buffer *screen, Operation *operation)
 {
-    clear_normal_buffer_area(screen);
-    struct dirent *dir;
-    DIR *cwd = opendir(path);
-    u32 index = 0;
-    screen->num_lines = 0;
-    screen->current_line = 0;
-    while(dir = readdir(cwd))
+    char name[NAME_MAX + 1];
+    // The job takes ownership of its own fd
+    int src_fd = fcntl(operation->dir->fd, F_DUPFD_CLOEXEC, 0);
+    yank_dir_release(operation->dir);
+    int dst_fd = openat(screen->dir_fd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(name_string(operation->name)->length >= sizeof(name))
     {
-        if(index >= screen->capacity)
+        close(src_fd);
+        close(dst_fd);
+        name_release(operation->name);
+        slab_string_free(&global_path_slab, operation->in_path);
+        return;
+    }
+    string_cstring(name_string(operation->name), name, sizeof(name));
+
+    // Pasting a directory inside itself would copy forever
+    struct stat statbuf;
+    b32 inside_source = src_fd >= 0 && dst_fd >= 0 && fstatat(src_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0 &&
+                        S_ISDIR(statbuf.st_mode) && directory_inside(dst_fd, statbuf.st_dev, statbuf.st_ino);
+
+    // Roll back deletes whatever is at the destination, so it has to be new
+    b32 exists = dst_fd >= 0 && fstatat(dst_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0;
+
+    if(src_fd < 0 || dst_fd < 0 || inside_source || exists)
+    {
+        draw_error(screen, inside_source ? "Can't paste a directory inside itself" : exists ? "File exists" : strerror(errno));
+        if(src_fd >= 0) close(src_fd);
+        if(dst_fd >= 0) close(dst_fd);
+    }
+    else
+    {
+        u64 commit;
+        u64 id = journal_begin(operation->type == MOVE ? 'm' : 'c', operation->preserve, operation->in_path, name, screen->current_directory, &commit);
+        if(operation->type == MOVE && renameat2(src_fd, name, dst_fd, name, RENAME_NOREPLACE) == 0)
         {
-            reallocate_buffer(screen);
+            journal_end(id);
+            reload_buffers(dir_id(dst_fd));
+            reload_buffers(dir_id(src_fd));
+            close(src_fd);
+            close(dst_fd);
         }
-
-        if(screen->buffer[index].text == NULL)
+        else if(operation->type == MOVE && errno != EXDEV)
         {
-            screen->buffer[index].text = string_from(dir->d_name);
+            journal_end(id);
+            draw_error(screen, strerror(errno));
+            close(src_fd);
+            close(dst_fd);
         }
         else
         {
-            string_replace(screen->buffer[index].text, dir->d_name, strlen(dir->d_name));
+            start_copy_job(src_fd, dst_fd, name, operation->preserve, operation->type == MOVE, id, commit, NULL);
         }
-        screen->buffer[index].is_dir = dir->d_type == DT_DIR;
-        index++;
-        screen->num_lines++;
     }
-    closedir(cwd);
 
-    screen->view_range_end = screen->height - 1;
-    screen->view_range_start = 0;
+    name_release(operation->name);
+    slab_string_free(&global_path_slab, operation->in_path);
+}
 
-    // Segregate directories and regular files
-    u32 dir_end = 0;
-    u32 length = screen->num_lines;
-    for(u32 index = 0; index < length; index++)
+u32 path_hash(const char *path)
+{
+    // FNV-1a
+    u32 hash = 2166136261u;
+    while(*path) hash = (hash ^ (u8)*path++) * 16777619u;
+    return hash;
+}
+
+// Takes ownership of path.
+void path_set_insert(PathSet *set, char *path)
+{
+    if((set->count + 1) * 4 >= set->capacity * 3)
+    {
+        PathSet grown = {};
+        grown.capacity = set->capacity ? set->capacity * 2 : 256;
+        grown.entries  = (char**)calloc(grown.capacity, sizeof(char*));
+        for(u32 i = 0; i < set->capacity; i++)
+        {
+            if(set->entries[i]) path_set_insert(&grown, set->entries[i]);
+        }
+        free(set->entries);
+        *set = grown;
+    }
+    u32 mask = set->capacity - 1;
+    u32 index = path_hash(path);
+    while(set->entries[index & mask])
     {
-        if(screen->buffer[index].is_dir)
+        if(strcmp(set->entries[index & mask], path) == 0)
         {
-            Line temp = screen->buffer[dir_end];
-            screen->buffer[dir_end] = screen->buffer[index];
-            screen->buffer[index] = temp;
-            dir_end++;
+            free(path);
+            return;
         }
+        index++;
+    }
+    set->entries[index & mask] = path;
+    set->count++;
+}
+
+b32 path_set_contains(PathSet *set, const char *path)
+{
+    if(set->capacity == 0) return false;
+    u32 mask = set->capacity - 1;
+    for(u32 index = path_hash(path);; index++)
+    {
+        char *entry = set->entries[index & mask];
+        if(!entry) return false;
+        if(strcmp(entry, path) == 0) return true;
+    }
+}
+
+void path_set_free(PathSet *set)
+{
+    for(u32 i = 0; i < set->capacity; i++) free(set->entries[i]);
+    free(set->entries);
+}
+
+void journal_open(void)
+{
+    char *home = getenv("HOME");
+    if(!home) return;
+    char path[512];
+    snprintf(path, sizeof(path), "%s/" JOURNAL_NAME, home);
+    global_journal.fd = open(path, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC, S_IRUSR + S_IWUSR);
+    global_journal.next_id = 1;
+    if(global_journal.fd < 0) return;
+    // Another instance owns the log, recovering would roll back its pastes and truncating would lose
+    // its records. This one goes without a journal instead.
+    if(flock(global_journal.fd, LOCK_EX|LOCK_NB) < 0)
+    {
+        close(global_journal.fd);
+        global_journal.fd = -1;
+        return;
     }
-    screen->files_start = dir_end;
 
-    // Sort directory portion
-    for(u32 i = 1; i < dir_end; i++)
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&global_journal.wake, &attributes);
+    pthread_cond_init(&global_journal.progress, NULL);
+    pthread_condattr_destroy(&attributes);
+    pthread_create(&global_journal.committer, NULL, journal_committer, NULL);
+}
+
+// The commit thread. Takes whatever is buffered once a commit is asked for or the oldest record is
+// JOURNAL_COMMIT_MS old, then syncs and writes it with the lock dropped so appending never waits.
+// Destination data goes to disk before the records that describe it, so a C record can never
+// survive a crash that its file didn't.
+void *journal_committer(void *data)
+{
+    Journal *journal = &global_journal;
+    pthread_mutex_lock(&journal->lock);
+    for(;;)
     {
-        Line val = screen->buffer[i];
-        u32 index = i;
+        if(!journal->commit_requested)
+        {
+            if(journal->records == 0)
+            {
+                pthread_cond_wait(&journal->wake, &journal->lock);
+                continue;
+            }
+            struct timespec deadline = journal->oldest;
+            deadline.tv_nsec += JOURNAL_COMMIT_MS * 1000000L;
+            deadline.tv_sec  += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            if(pthread_cond_timedwait(&journal->wake, &journal->lock, &deadline) != ETIMEDOUT) continue;
+        }
+
+        char *buffer = journal->buffer;
+        u32 length   = journal->length;
+        u32 records  = journal->records;
+        JournalSync *syncs = journal->syncs;
+        u32 num_syncs      = journal->num_syncs;
+        journal->buffer    = NULL;
+        journal->length    = 0;
+        journal->capacity  = 0;
+        journal->records   = 0;
+        journal->syncs     = NULL;
+        journal->num_syncs = 0;
+        journal->sync_capacity    = 0;
+        journal->commit_requested = false;
+        u64 commit = ++journal->taken;
+        pthread_cond_broadcast(&journal->progress);
+        pthread_mutex_unlock(&journal->lock);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(u32 i = 0; i < num_syncs; i++)
+        {
+            fdatasync(syncs[i].fd);
+            close(syncs[i].fd);
+        }
+        u32 written = 0;
+        while(written < length)
+        {
+            ssize_t result = write(journal->fd, buffer + written, length - written);
+            if(result <= 0 && errno != EINTR) break;
+            if(result > 0) written += result;
+        }
+        if(length) fdatasync(journal->fd);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        free(buffer);
+        free(syncs);
 
-        while(index > 0 && !(string_compare(screen->buffer[index - 1].text, val.text)))
+        pthread_mutex_lock(&journal->lock);
+        if(records)
         {
-            screen->buffer[index] = screen->buffer[index - 1];
-            index--;
+            atomic_fetch_add(&global_stats.journal_records, records);
+            atomic_fetch_add(&global_stats.journal_commits, 1);
+            atomic_fetch_add(&global_stats.journal_commit_ns, (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec);
         }
-        screen->buffer[index] = val;
+        // Once nothing is in flight the whole log is obsolete
+        if(journal->active == 0 && journal->length == 0) ftruncate(journal->fd, 0);
+        journal->committed = commit;
+        pthread_cond_broadcast(&journal->progress);
+    }
+    return NULL;
+}
+
+// Blocks until commit is on disk. Only for workers, the main thread never waits on the journal.
+void journal_wait(u64 commit)
+{
+    Journal *journal = &global_journal;
+    if(journal->fd < 0) return;
+    pthread_mutex_lock(&journal->lock);
+    while(journal->committed < commit) pthread_cond_wait(&journal->progress, &journal->lock);
+    pthread_mutex_unlock(&journal->lock);
+}
+
+// Commits everything buffered and waits for it, at exit once the jobs are done.
+void journal_flush(void)
+{
+    Journal *journal = &global_journal;
+    if(journal->fd < 0) return;
+    pthread_mutex_lock(&journal->lock);
+    u64 commit = journal->taken;
+    if(journal->length || journal->num_syncs)
+    {
+        journal->commit_requested = true;
+        pthread_cond_signal(&journal->wake);
+        commit++;
+    }
+    while(journal->committed < commit) pthread_cond_wait(&journal->progress, &journal->lock);
+    pthread_mutex_unlock(&journal->lock);
+}
+
+// Call with the journal locked. Adds fd's file or directory to what the next commit syncs, keeping
+// our own fd since the caller's may be closed before then. A directory many records name is synced once.
+void journal_sync_locked(int fd)
+{
+    Journal *journal = &global_journal;
+    struct stat statbuf;
+    if(fd < 0 || fstat(fd, &statbuf) < 0) return;
+    for(u32 i = 0; i < journal->num_syncs; i++)
+    {
+        if(journal->syncs[i].ino == statbuf.st_ino && journal->syncs[i].dev == statbuf.st_dev) return;
+    }
+
+    // Only workers add syncs, they can wait for the committer to take the full list
+    while(journal->num_syncs >= JOURNAL_SYNC_FDS)
+    {
+        journal->commit_requested = true;
+        pthread_cond_signal(&journal->wake);
+        pthread_cond_wait(&journal->progress, &journal->lock);
+    }
+    if(journal->num_syncs == journal->sync_capacity)
+    {
+        journal->sync_capacity = journal->sync_capacity ? journal->sync_capacity * 2 : 16;
+        journal->syncs = (JournalSync*)realloc(journal->syncs, sizeof(JournalSync) * journal->sync_capacity);
+    }
+    JournalSync *entry = &journal->syncs[journal->num_syncs];
+    entry->fd  = dup(fd);
+    entry->dev = statbuf.st_dev;
+    entry->ino = statbuf.st_ino;
+    if(entry->fd >= 0) journal->num_syncs++;
+}
+
+// For destinations no record names, like a directory a new one was made in.
+void journal_sync(int fd)
+{
+    if(global_journal.fd < 0) return;
+    pthread_mutex_lock(&global_journal.lock);
+    journal_sync_locked(fd);
+    pthread_mutex_unlock(&global_journal.lock);
+}
+
+// Appends a record and returns the commit it goes out in, for journal_wait. file_fd and dir_fd are
+// the destination file and the directory holding it the record is about, either can be -1. Both are
+// synced before the record is committed. sync asks for the commit now instead of in JOURNAL_COMMIT_MS.
+u64 journal_record(char tag, u64 id, const char **fields, u32 num_fields, int file_fd, int dir_fd, b32 sync)
+{
+    Journal *journal = &global_journal;
+    if(journal->fd < 0) return 0;
+
+    pthread_mutex_lock(&journal->lock);
+    u32 needed = 32;
+    for(u32 i = 0; i < num_fields; i++) needed += strlen(fields[i]) + 16;
+    if(journal->length + needed > journal->capacity)
+    {
+        journal->capacity = (journal->length + needed) * 2;
+        journal->buffer = (char*)realloc(journal->buffer, journal->capacity);
+    }
+    if(journal->records == 0) clock_gettime(CLOCK_MONOTONIC, &journal->oldest);
+
+    char *cursor = journal->buffer + journal->length;
+    cursor += sprintf(cursor, "%c %llu", tag, (unsigned long long)id);
+    for(u32 i = 0; i < num_fields; i++)
+    {
+        size_t length = strlen(fields[i]);
+        cursor += sprintf(cursor, " %zu:", length);
+        memcpy(cursor, fields[i], length);
+        cursor += length;
     }
+    *cursor++ = '\n';
+    journal->length = cursor - journal->buffer;
+    journal->records++;
 
-    // Sort file portion
-    for(u32 i = dir_end + 1; i < length; i++)
+    journal_sync_locked(file_fd);
+    journal_sync_locked(dir_fd);
+
+    u64 commit = journal->taken + 1;
+    if(sync || journal->records >= JOURNAL_COMMIT_RECORDS) journal->commit_requested = true;
+    pthread_cond_signal(&journal->wake);
+    pthread_mutex_unlock(&journal->lock);
+    return commit;
+}
+
+// Logs the start of a paste and returns its id. commit is set to the commit its record goes out in,
+// which the paste has to wait for before touching the destination.
+u64 journal_begin(char type, u32 preserve, String *src_dir, const char *name, String *dst_dir, u64 *commit)
+{
+    char preserve_text[16];
+    char type_text[2] = {type, '\0'};
+    snprintf(preserve_text, sizeof(preserve_text), "%u", preserve);
+    char *src = (char*)malloc(src_dir->length + 1);
+    char *dst = (char*)malloc(dst_dir->length + 1);
+    string_cstring(src_dir, src, src_dir->length + 1);
+    string_cstring(dst_dir, dst, dst_dir->length + 1);
+
+    pthread_mutex_lock(&global_journal.lock);
+    u64 id = global_journal.next_id++;
+    global_journal.active++;
+    pthread_mutex_unlock(&global_journal.lock);
+
+    const char *fields[] = {type_text, preserve_text, src, name, dst};
+    *commit = journal_record('B', id, fields, 5, -1, -1, true);
+    free(src);
+    free(dst);
+    return id;
+}
+
+// Once nothing is in flight the whole log is obsolete, the committer truncates it after the commit
+// this E record goes out in.
+void journal_end(u64 id)
+{
+    pthread_mutex_lock(&global_journal.lock);
+    b32 last = --global_journal.active == 0;
+    pthread_mutex_unlock(&global_journal.lock);
+    journal_record('E', id, NULL, 0, -1, -1, last);
+}
+
+// Parses the journal into one entry per paste. A torn record at the end from a crash mid write
+// ends the parse, everything before it is still good.
+u32 journal_read(JournalEntry **entries)
+{
+    *entries = NULL;
+    if(global_journal.fd < 0) return 0;
+    struct stat statbuf;
+    if(fstat(global_journal.fd, &statbuf) < 0 || statbuf.st_size == 0) return 0;
+
+    char *data = (char*)malloc(statbuf.st_size + 1);
+    ssize_t size = pread(global_journal.fd, data, statbuf.st_size, 0);
+    if(size < 0) size = 0;
+    data[size] = '\0';
+
+    u32 count = 0;
+    u32 capacity = 0;
+    char *cursor = data;
+    char *end = data + size;
+    while(cursor < end)
     {
-        Line val = screen->buffer[i];
-        u32 index = i;
+        char tag = *cursor++;
+        char *number_end;
+        u64 id = strtoull(cursor, &number_end, 10);
+        if(number_end == cursor) break;
+        cursor = number_end;
+
+        char *fields[5];
+        size_t lengths[5];
+        u32 num_fields = 0;
+        b32 torn = false;
+        while(cursor < end && *cursor == ' ' && num_fields < 5)
+        {
+            size_t length = strtoull(cursor + 1, &number_end, 10);
+            if(*number_end != ':' || number_end + 1 + length > end)
+            {
+                torn = true;
+                break;
+            }
+            fields[num_fields] = number_end + 1;
+            lengths[num_fields++] = length;
+            cursor = number_end + 1 + length;
+        }
+        if(torn || cursor >= end || *cursor != '\n') break;
+        cursor++;
+        // Every field is followed by a space or the newline, terminate them in place
+        for(u32 i = 0; i < num_fields; i++) fields[i][lengths[i]] = '\0';
+
+        JournalEntry *entry = NULL;
+        for(u32 i = 0; i < count; i++)
+        {
+            if((*entries)[i].id == id) entry = &(*entries)[i];
+        }
+        if(id >= global_journal.next_id) global_journal.next_id = id + 1;
 
-        while(index > dir_end && !(string_compare(screen->buffer[index - 1].text, val.text)))
+        if(tag == 'B' && num_fields == 5 && !entry)
+        {
+            if(count == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 8;
+                *entries = (JournalEntry*)realloc(*entries, sizeof(JournalEntry) * capacity);
+            }
+            entry = &(*entries)[count++];
+            memset(entry, 0, sizeof(JournalEntry));
+            entry->id       = id;
+            entry->type     = fields[0][0];
+            entry->preserve = (u32)strtoul(fields[1], NULL, 10);
+            entry->src_dir  = strdup(fields[2]);
+            entry->name     = strdup(fields[3]);
+            entry->dst_dir  = strdup(fields[4]);
+        }
+        else if(!entry)
+        {
+            continue;
+        }
+        else if(tag == 'C' && num_fields == 1)
+        {
+            path_set_insert(&entry->completed, strdup(fields[0]));
+        }
+        else if(tag == 'M')
+        {
+            entry->copied = true;
+        }
+        else if(tag == 'E')
         {
-            screen->buffer[index] = screen->buffer[index - 1];
-            index--;
+            entry->ended = true;
         }
-        screen->buffer[index] = val;
     }
+    free(data);
+    return count;
 }
 
-void init_buffer(Buffer *buf, u32 x, u32 y, u32 width, u32 height, String *directory)
+// Offers to resume or roll back pastes the last run didn't finish. Resuming continues a copy
+// skipping files the journal says are complete, or finishes deleting a move's source. Rolling back
+// removes the partial copy, or renames a moved file back. A move whose source deletion had
+// started can only be resumed.
+void journal_recover(Buffer *screen)
 {
-    buf->x                 = x;
-    buf->y                 = y;
-    buf->width             = width;
-    buf->height            = height;
-    buf->view_range_start  = 0;
-    buf->view_range_end    = height - 1;
-    buf->current_line      = 0;
-    buf->current_directory = string_copy(directory);
-    buf->buffer            = (Line*)calloc(100, sizeof(Line));
-    buf->capacity          = 100;
+    JournalEntry *entries;
+    u32 count = journal_read(&entries);
+    u32 unfinished = 0;
+    u32 resume_only = 0;
+    for(u32 i = 0; i < count; i++)
+    {
+        unfinished  += !entries[i].ended;
+        resume_only += !entries[i].ended && entries[i].type == 'm' && entries[i].copied;
+    }
 
-    // Load buffers current directory
-    string_cstring(directory, global_path, global_path_size);
-    load_directory(global_path, buf);
+    char choice = 'i';
+    if(unfinished)
+    {
+        // A move past its M record has started deleting the source, there's nothing to roll back to
+        char message[192];
+        if(resume_only)
+        {
+            snprintf(message, sizeof(message), "%u unfinished pastes from last run, %u are moves that can only be resumed: r resume, b roll back the rest, i ignore", unfinished, resume_only);
+        }
+        else
+        {
+            snprintf(message, sizeof(message), "%u unfinished pastes from last run: r resume, b roll back, i ignore", unfinished);
+        }
+        String *prompt = string_from(message);
+        draw_text(prompt, screen->x, screen->y + screen->height);
+        struct tb_event event;
+        do
+        {
+            tb_poll_event(&event);
+        } while(event.ch != 'r' && event.ch != 'b' && event.ch != 'i');
+        choice = (char)event.ch;
+        clear_text(screen->x, screen->y + screen->height, prompt->length);
+        string_free(prompt);
+    }
+
+    pthread_mutex_lock(&global_journal.lock);
+    global_journal.active += unfinished;
+    pthread_mutex_unlock(&global_journal.lock);
+    if(!unfinished)
+    {
+        pthread_mutex_lock(&global_journal.lock);
+        ftruncate(global_journal.fd, 0);
+        pthread_mutex_unlock(&global_journal.lock);
+    }
+
+    for(u32 i = 0; i < count; i++)
+    {
+        JournalEntry *entry = &entries[i];
+        int src_fd = -1;
+        int dst_fd = -1;
+        if(!entry->ended && choice != 'i')
+        {
+            src_fd = open(entry->src_dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+            dst_fd = open(entry->dst_dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        }
+        if(src_fd < 0 || dst_fd < 0)
+        {
+            if(!entry->ended) journal_end(entry->id);
+            if(src_fd >= 0) close(src_fd);
+            if(dst_fd >= 0) close(dst_fd);
+        }
+        else
+        {
+            struct stat statbuf;
+            b32 src_exists = fstatat(src_fd, entry->name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0;
+            b32 dst_exists = fstatat(dst_fd, entry->name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0;
+            b32 move = entry->type == 'm';
+
+            if(move && entry->copied)
+            {
+                // Finishes the source's delete even for b, as the prompt said
+                Job *job = job_new(JOB_DELETE, dir_id(src_fd));
+                job->journal_id = entry->id;
+                delete_into_job(job, src_fd, entry->name);
+                close(dst_fd);
+            }
+            else if(move && !src_exists)
+            {
+                // The rename happened
+                if(choice == 'b' && dst_exists) renameat2(dst_fd, entry->name, src_fd, entry->name, RENAME_NOREPLACE);
+                journal_end(entry->id);
+                close(src_fd);
+                close(dst_fd);
+            }
+            else if(choice == 'b')
+            {
+                // Nothing was done to the source yet, so roll back is deleting whatever got copied
+                if(dst_exists)
+                {
+                    Job *job = job_new(JOB_DELETE, dir_id(dst_fd));
+                    job->journal_id = entry->id;
+                    delete_into_job(job, dst_fd, entry->name);
+                }
+                else
+                {
+                    journal_end(entry->id);
+                    close(dst_fd);
+                }
+                close(src_fd);
+            }
+            else if(move && !dst_exists && renameat2(src_fd, entry->name, dst_fd, entry->name, RENAME_NOREPLACE) == 0)
+            {
+                journal_end(entry->id);
+                close(src_fd);
+                close(dst_fd);
+            }
+            else
+            {
+                PathSet *completed = (PathSet*)malloc(sizeof(PathSet));
+                *completed = entry->completed;
+                entry->completed.entries = NULL;
+                entry->completed.capacity = 0;
+                start_copy_job(src_fd, dst_fd, entry->name, entry->preserve, move, entry->id, 0, completed);
+            }
+        }
+        path_set_free(&entry->completed);
+        free(entry->src_dir);
+        free(entry->name);
+        free(entry->dst_dir);
+    }
+    free(entries);
 }
 
-void reallocate_buffer(Buffer *buf)
+// Dumps global_stats to the file named by $FILE_EXPLORER_STATS, if it's set.
+void write_stats(void)
 {
-    Line *new_buffer = calloc(buf->num_lines * 2, sizeof(Line));
+    char *path = getenv("FILE_EXPLORER_STATS");
+    if(!path) return;
+    FILE *file = fopen(path, "w");
+    if(!file) return;
 
-    for(u32 i = 0; i < buf->num_lines; i++)
-    {
-        new_buffer[i] = buf->buffer[i];
-    }
-    free(buf->buffer);
-    buf->capacity *= 2;
-    buf->buffer = new_buffer;
+    unsigned long long commits = atomic_load(&global_stats.journal_commits);
+    unsigned long long commit_ns = atomic_load(&global_stats.journal_commit_ns);
+    fprintf(file, "journal_records %llu\n", atomic_load(&global_stats.journal_records));
+    fprintf(file, "journal_commits %llu\n", commits);
+    fprintf(file, "journal_commit_us_total %llu\n", commit_ns / 1000);
+    fprintf(file, "journal_commit_us_average %llu\n", commits ? commit_ns / commits / 1000 : 0);
+
+    unsigned long long hits = atomic_load(&global_stats.listing_hits);
+    unsigned long long misses = atomic_load(&global_stats.listing_misses);
+    fprintf(file, "listing_cache_hits %llu\n", hits);
+    fprintf(file, "listing_cache_misses %llu\n", misses);
+    fprintf(file, "listing_cache_hit_rate %.3f\n", hits + misses ? (double)hits / (hits + misses) : 0.0);
+    fprintf(file, "prefetches_started %llu\n", atomic_load(&global_stats.prefetches_started));
+    fprintf(file, "prefetches_cancelled %llu\n", atomic_load(&global_stats.prefetches_cancelled));
+    fprintf(file, "prefetch_hits %llu\n", atomic_load(&global_stats.prefetch_hits));
+    fprintf(file, "arena_allocs %llu\n", atomic_load(&global_stats.arena_allocs));
+    fprintf(file, "arena_mallocs %llu\n", atomic_load(&global_stats.arena_mallocs));
+    fprintf(file, "slab_allocs %llu\n", atomic_load(&global_stats.slab_allocs));
+    fprintf(file, "slab_mallocs %llu\n", atomic_load(&global_stats.slab_mallocs));
+    fprintf(file, "filter_runs %llu\n", atomic_load(&global_stats.filter_runs));
+    fprintf(file, "filter_reuses %llu\n", atomic_load(&global_stats.filter_reuses));
+    fprintf(file, "flat_files %llu\n", atomic_load(&global_stats.flat_files));
+    fprintf(file, "flat_ignored %llu\n", atomic_load(&global_stats.flat_ignored));
+    fprintf(file, "tree_opens %llu\n", atomic_load(&global_stats.tree_opens));
+    fprintf(file, "tree_reads %llu\n", atomic_load(&global_stats.tree_reads));
+    fprintf(file, "mallocs %llu\n", atomic_load(&global_stats.mallocs));
+    fprintf(file, "frames %llu\n", atomic_load(&global_stats.frames));
+    fprintf(file, "frames_with_mallocs %llu\n", atomic_load(&global_stats.frames_with_mallocs));
+    fprintf(file, "loads %llu\n", atomic_load(&global_stats.loads));
+    fprintf(file, "load_mallocs %llu\n", atomic_load(&global_stats.load_mallocs));
+    fprintf(file, "searches %llu\n", atomic_load(&global_stats.searches));
+    fprintf(file, "search_mallocs %llu\n", atomic_load(&global_stats.search_mallocs));
+    fclose(file);
 }
 
-void reallocate_search_buffer(SearchBuffer *buf)
+// Finds or creates the trash directory for the mount path lives on. That's TRASH_DIR_NAME in the
+// mount root, or in $HOME when the root isn't writable and home is on the same mount.
+// Returns an index into global_trash_dirs or -1 if there's nowhere to trash to.
+i32 trash_directory(int dir_fd)
 {
-    Result *new_buffer = calloc(buf->num_lines * 2, sizeof(Result));
+    struct stat statbuf;
+    if(fstat(dir_fd, &statbuf) < 0) return -1;
 
-    for(u32 i = 0; i < buf->num_lines; i++)
+    pthread_mutex_lock(&global_trash_lock);
+    for(u32 i = 0; i < global_trash_num_dirs; i++)
     {
-        new_buffer[i] = buf->buffer[i];
+        if(global_trash_dirs[i].dev == statbuf.st_dev)
+        {
+            pthread_mutex_unlock(&global_trash_lock);
+            return (i32)i;
+        }
     }
-    free(buf->buffer);
-    buf->capacity *= 2;
-    buf->buffer = new_buffer;
-}
+    pthread_mutex_unlock(&global_trash_lock);
+    if(global_trash_num_dirs >= MAX_TRASH_DIRS) return -1;
 
-void scroll(Buffer *screen, i32 lines)
-{
-    i32 new_start = (i32)screen->view_range_start + lines;
-    i32 new_end = (i32)screen->view_range_end + lines;
-    if(new_start >= 0 && new_end <= screen->num_lines)
+    // Walk up until the parent is on another device or is ourselves, which is the mount root
+    int fd = openat(dir_fd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(fd < 0) return -1;
+    struct stat current = statbuf;
+    for(;;)
     {
-        screen->view_range_start = (u32)new_start;
-        screen->view_range_end = (u32)new_end;
-        clear_normal_buffer_area(screen);
+        struct stat parent_stat;
+        int parent = openat(fd, "..", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if(parent < 0) break;
+        if(fstat(parent, &parent_stat) < 0 || parent_stat.st_dev != statbuf.st_dev || parent_stat.st_ino == current.st_ino)
+        {
+            close(parent);
+            break;
+        }
+        close(fd);
+        fd = parent;
+        current = parent_stat;
     }
-}
 
-void jump_to_line(Buffer *screen, u32 line_number)
-{
-    screen->current_line = line_number;
+    mkdirat(fd, TRASH_DIR_NAME, S_IRWXU);
+    int trash_fd = openat(fd, TRASH_DIR_NAME, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    close(fd);
 
-    if(screen->current_line < screen->view_range_start)
-    {
-        i32 diff = screen->current_line - screen->view_range_start;
-        scroll(screen, diff);
-    }
-    else if(screen->current_line >= screen->view_range_end)
+    char *home = getenv("HOME");
+    if(trash_fd < 0 && home)
     {
-        i32 diff = screen->current_line - screen->view_range_end + 1;
-        scroll(screen, diff);
+        struct stat home_stat;
+        fd = open(home, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if(fd >= 0 && fstat(fd, &home_stat) == 0 && home_stat.st_dev == statbuf.st_dev)
+        {
+            mkdirat(fd, TRASH_DIR_NAME, S_IRWXU);
+            trash_fd = openat(fd, TRASH_DIR_NAME, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        }
+        if(fd >= 0) close(fd);
     }
-}
+    if(trash_fd < 0) return -1;
 
-void search_scroll(SearchBuffer *results)
-{
-    results->view_range_start++;
-    results->view_range_end++;
-    clear_search_buffer_area(results, 0);
+    pthread_mutex_lock(&global_trash_lock);
+    i32 index = (i32)global_trash_num_dirs;
+    global_trash_dirs[index].dev = statbuf.st_dev;
+    global_trash_dirs[index].fd  = trash_fd;
+    global_trash_num_dirs++;
+    pthread_mutex_unlock(&global_trash_lock);
+    return index;
 }
 
-// Pass NULL for text to only print the global mode.
-void draw_text(String *text, u32 x, u32 y)
+// Moves lines [start, end) of the buffer to the trash. One rename per line no matter how big
+// the tree under it is. Returns false and leaves the rest in place if anything can't be trashed.
+b32 trash_lines(Buffer *screen, u32 start, u32 end)
 {
-    char *mode;
-    u16 bg;
+    static u32 counter;
+    int dir_fd = screen->dir_fd;
+    i32 trash_index = trash_directory(dir_fd);
+    if(trash_index < 0)
+    {
+        draw_error(screen, "No trash directory on this filesystem, T turns off trash mode");
+        return false;
+    }
+    int trash_fd = global_trash_dirs[trash_index].fd;
 
-    switch(global_mode)
+    b32 success = true;
+    char name[256];
+    char trash_name[320];
+    for(u32 i = start; i < end && i < screen->num_lines; i++)
     {
-        case NORMAL:
-        mode = "NORMAL";
-        bg = TB_BLUE;
-        break;
+        u32 line = line_at(screen, i);
+        if(screen->listing->lengths[line] >= sizeof(name)) continue;
+        memcpy(name, screen->listing->blob + screen->listing->offsets[line], screen->listing->lengths[line] + 1);
+        if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
 
-        case SEARCH:
-        mode = "SEARCH";
-        bg = TB_MAGENTA;
-        break;
+        int result;
+        do
+        {
+            snprintf(trash_name, sizeof(trash_name), "%llu.%u.%s", (unsigned long long)time(NULL), counter++, name);
+            result = renameat2(dir_fd, name, trash_fd, trash_name, RENAME_NOREPLACE);
+        } while(result < 0 && errno == EEXIST);
 
-        case INSERT:
-        mode = "INSERT";
-        bg = TB_GREEN;
-        break;
+        if(result < 0)
+        {
+            draw_error(screen, strerror(errno));
+            success = false;
+            break;
+        }
 
-        case VISUAL:
-        mode = "VISUAL";
-        bg = TB_YELLOW;
-        break;
+        if(global_trash_num_entries >= global_trash_capacity)
+        {
+            global_trash_capacity = global_trash_capacity ? global_trash_capacity * 2 : 16;
+            global_trash_entries = (TrashEntry*)realloc(global_trash_entries, sizeof(TrashEntry) * global_trash_capacity);
+        }
+        TrashEntry *entry  = &global_trash_entries[global_trash_num_entries++];
+        entry->trash_index = (u32)trash_index;
+        entry->trash_name  = string_from(trash_name);
+        entry->dir_fd      = openat(dir_fd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        entry->name        = string_from(name);
     }
+    reload_buffers(screen->listing->id);
+    return success;
+}
 
-    for(u32 i = 0; i < TEXT_OFF - 1; i++)
+// Puts the most recently trashed item back where it came from.
+void restore_trash(Buffer *screen)
+{
+    if(global_trash_num_entries == 0) return;
+    TrashEntry entry = global_trash_entries[--global_trash_num_entries];
+
+    char trash_name[320];
+    char name[256];
+    string_cstring(entry.trash_name, trash_name, sizeof(trash_name));
+    string_cstring(entry.name, name, sizeof(name));
+
+    if(entry.dir_fd < 0 || renameat2(global_trash_dirs[entry.trash_index].fd, trash_name, entry.dir_fd, name, RENAME_NOREPLACE) < 0)
     {
-        tb_change_cell(x + i, y, (u32)mode[i], TB_BLACK, bg);
+        draw_error(screen, strerror(errno));
     }
-
-    if(text)
+    else
     {
-        for(u32 i = 0; i < text->length; i++)
-        {
-            tb_change_cell(x + i + TEXT_OFF, y, (u32)text->start[i], TB_WHITE, TB_BLACK);
-        }
+        reload_buffers(dir_id(entry.dir_fd));
     }
+    if(entry.dir_fd >= 0) close(entry.dir_fd);
 
-    tb_present();
+    string_free(entry.trash_name);
+    string_free(entry.name);
 }
 
-void clear_text(u32 x, u32 y, u32 length)
+// Depth first removal for the purger. Slow on purpose, it's throttled and runs at idle priority.
+void purge_tree(int dir_fd, const char *name)
 {
-    for(u32 i = 0; i < length; i++)
+    rate_limit_take(&global_purge_limit, 0, 1);
+    if(unlinkat(dir_fd, name, 0) == 0 || (errno != EISDIR && errno != EPERM)) return;
+
+    int fd = openat(dir_fd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if(fd < 0) return;
+    DIR *dir = fdopendir(fd);
+    if(!dir)
     {
-        tb_change_cell(x + i + TEXT_OFF, y, (u32)' ', TB_WHITE, TB_BLACK);
+        close(fd);
+        return;
     }
-    tb_present();
-}
-
-void vertical_split(Buffer *buffer)
-{
-    if(global_state_num_buffers < MAX_BUFFERS)
+    struct dirent *entry;
+    while((entry = readdir(dir)) && global_trash_purging)
     {
-        u32 buffer_width = buffer->width / 2;
-        u32 buffer_height = buffer->height;
-        u32 x_off = buffer->x;
-        u32 y_off = buffer->y;
-
-        buffer->width = buffer_width;
-
-        Buffer *buffer2 = (Buffer*)malloc(sizeof(Buffer));
-
-        init_buffer(buffer2, x_off * 2 + buffer_width, y_off, buffer_width, buffer_height, buffer->current_directory);
-        global_state_buffers[global_state_num_buffers++] = buffer2;
-
-        update_screen(buffer);
-        update_screen(buffer2);
-        draw_vertical_line(0, global_terminal_height, buffer->x + buffer->width);
+        char *child = entry->d_name;
+        if(child[0] == '.' && (child[1] == '\0' || (child[1] == '.' && child[2] == '\0'))) continue;
+        purge_tree(fd, child);
     }
+    closedir(dir);
+    unlinkat(dir_fd, name, AT_REMOVEDIR);
 }
 
-// TODO(Luke): This, like all file IO, needs to handle errors at some point buddy boy
-void copy_file(String *src_file, String *dst_file)
+void *trash_purger(void *data)
 {
-    string_cstring(src_file, global_path, global_path_size);
-    struct stat statbuf;
-    stat(global_path, &statbuf);
-    size_t length = statbuf.st_size;
-
-    int fd_in = open(global_path, O_RDONLY);
-
-    string_cstring(dst_file, global_path, global_path_size);
-
-    // O_CREAT|O_EXCL ensure a new file is created and S_IRUSR + S_IWUSR sets read and write permissions for the user
-    int fd_out = open(global_path, O_WRONLY|O_CREAT|O_EXCL, S_IRUSR + S_IWUSR);
+    rate_limit_init(&global_purge_limit, 0, TRASH_PURGE_RATE);
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+    setpriority(PRIO_PROCESS, tid, 19);
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
 
-    copy_file_range(fd_in, NULL, fd_out, NULL, length, 0);
-    close(fd_in);
-    close(fd_out);
-}
+    pthread_mutex_lock(&global_trash_lock);
+    while(global_trash_purging)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += TRASH_PURGE_INTERVAL;
+        pthread_cond_timedwait(&global_trash_wake, &global_trash_lock, &deadline);
 
-void delete_file(String *filename)
-{
-    string_cstring(filename, global_path, global_path_size);
+        int trash_fds[MAX_TRASH_DIRS];
+        u32 num_dirs = global_trash_num_dirs;
+        for(u32 i = 0; i < num_dirs; i++) trash_fds[i] = global_trash_dirs[i].fd;
+        pthread_mutex_unlock(&global_trash_lock);
 
-    if(unlink(global_path) < 0) panic(strerror(errno));
+        u64 now = (u64)time(NULL);
+        for(u32 i = 0; i < num_dirs && global_trash_purging; i++)
+        {
+            DIR *dir = fdopendir(dup(trash_fds[i]));
+            if(!dir) continue;
+            struct dirent *entry;
+            while((entry = readdir(dir)) && global_trash_purging)
+            {
+                char *end;
+                u64 trashed_at = strtoull(entry->d_name, &end, 10);
+                if(end == entry->d_name || *end != '.') continue;
+                if(now - trashed_at > TRASH_RETENTION) purge_tree(trash_fds[i], entry->d_name);
+            }
+            closedir(dir);
+        }
+        pthread_mutex_lock(&global_trash_lock);
+    }
+    pthread_mutex_unlock(&global_trash_lock);
+    return NULL;
 }
 
 void rename_file(String *filename, String *new_filename)
@@ -710,34 +6260,80 @@ int main()
 {
     tb_init();
 
+    // Deleting big trees keeps one fd per directory in flight, so take every fd we're allowed
+    struct rlimit fd_limit;
+    if(getrlimit(RLIMIT_NOFILE, &fd_limit) == 0)
+    {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+        global_fd_budget = fd_limit.rlim_cur / 2;
+    }
+    else
+    {
+        global_fd_budget = 512;
+    }
+    char *cache_mb = getenv("FILE_EXPLORER_CACHE_MB");
+    if(cache_mb) global_listing_cache_budget = strtoull(cache_mb, NULL, 10) << 20;
+    char *usage_cache_mb = getenv("FILE_EXPLORER_USAGE_CACHE_MB");
+    if(usage_cache_mb) global_usage_cache_budget = strtoull(usage_cache_mb, NULL, 10) << 20;
+    char *io_backend = getenv("FILE_EXPLORER_IO");
+    if(io_backend && strcmp(io_backend, "threads") == 0) global_io_backend = IO_BACKEND_THREADS;
+    char *flat_depth = getenv("FILE_EXPLORER_FLAT_DEPTH");
+    if(flat_depth) global_flat_depth = strtoul(flat_depth, NULL, 10);
+    char *flat_hidden = getenv("FILE_EXPLORER_FLAT_HIDDEN");
+    if(flat_hidden) global_flat_hidden = strcmp(flat_hidden, "0") != 0;
+    char *flat_ignore = getenv("FILE_EXPLORER_FLAT_IGNORE");
+    if(flat_ignore) global_flat_ignore = strcmp(flat_ignore, "0") != 0;
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for(u32 i = 0; i < NUM_PRIORITIES; i++)
+    {
+        pool_init(&global_pools[i], num_cpus > 0 ? (u32)num_cpus : 4, (Priority)i);
+    }
+    pthread_t purger;
+    pthread_create(&purger, NULL, trash_purger, NULL);
+
     global_terminal_width = tb_width();
     global_terminal_height = tb_height();
     global_mode = NORMAL;
     struct tb_event event = {};
-    getcwd(global_path, global_path_size);
+    char *cwd = getcwd(NULL, 0);
 
-    Buffer *buf            = (Buffer*)malloc(sizeof(Buffer));
-    buf->current_directory = string_from(global_path);
-    buf->buffer            = (Line*)calloc(100, sizeof(Line));
-    buf->capacity          = 100;
-    buf->x                 = 2;
+    Buffer *buf            = (Buffer*)calloc(1, sizeof(Buffer));
+    buf->dir_fd            = open(".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    buf->current_directory = string_from(cwd ? cwd : "");
+    buf->sort              = SORT_NAME;
+    buf->x                 = PANE_MARGIN;
     buf->y                 = 0;
-    buf->width             = global_terminal_width - 10;
+    buf->width             = global_terminal_width - PANE_MARGIN * 2;
     buf->height            = global_terminal_height - 1;
 
-    load_directory(global_path, buf);
+    load_directory(buf);
+    free(cwd);
 
-    global_state_buffers       = (Buffer**)malloc(sizeof(Buffer*) * MAX_BUFFERS);
+    global_state_buffers       = (Buffer**)malloc(sizeof(Buffer*));
     global_state_num_buffers   = 1;
     global_state_active_buffer = 0;
     global_state_buffers[0]    = buf;
 
+    global_layout         = (Tile*)calloc(1, sizeof(Tile));
+    global_layout->type   = TILE_PANE;
+    global_layout->buffer = buf;
+    global_layout->width  = global_terminal_width;
+    global_layout->height = global_terminal_height;
+    buf->tile             = global_layout;
+
     SearchBuffer results = {};
-    results.buffer = (Result*)calloc(100, sizeof(Result));
+    results.matches  = (u32*)calloc(100, sizeof(u32));
     results.capacity = 100;
 
     // Name of new file created. Might move this somewhere else some time
     String *new_file_name = NULL;
+    // Typed in LIMIT mode, see apply_limit_command
+    String *limit_command = NULL;
+    // Typed in JUMP mode, the cursor follows the first name starting with it
+    String *jump_prefix = NULL;
+    // Typed in FILTER mode, see apply_filter
+    String *filter_pattern = NULL;
 
     OperationQueue *op = queue_new(5);
     Operation operation = {};
@@ -748,46 +6344,61 @@ int main()
 
     background(TB_BLACK);
     update_screen(buf);
+    journal_open();
+    journal_recover(buf);
     Buffer *screen = global_state_buffers[0];
     b32 running = true;
+    u64 frame_mallocs = thread_mallocs;
     while(running)
     {
-        tb_poll_event(&event);
-        if(event.type == TB_EVENT_RESIZE)
+        // Counts the iteration before, moving around directories already read shouldn't need the heap
+        atomic_fetch_add(&global_stats.frames, 1);
+        if(thread_mallocs != frame_mallocs) atomic_fetch_add(&global_stats.frames_with_mallocs, 1);
+        frame_mallocs = thread_mallocs;
+        // Nothing allocated from the frame arena outlives an iteration
+        arena_reset(&global_frame_arena);
+        update_prefetch(screen);
+        // While jobs are running wake up regularly to redraw their progress
+        if(global_jobs || global_stat_pending || global_stale_sorts || global_num_prefetches || global_prefetch_armed || global_flat_walks || global_tree_loads)
         {
-            //screen->width = event.w - 10;
-            //screen->height = event.h - 1;
-            //screen->view_range_start = 0;
-            //screen->view_range_end = screen->height - 1;
-            //tb_init();
-            //background(TB_BLACK);
-            //update_screen(screen);
-            
-            global_state_buffers[0]->width = event.w - 10;
-            global_state_buffers[0]->height = event.h - 1;
-            global_state_buffers[0]->view_range_start = 0;
-            global_state_buffers[0]->view_range_end = global_state_buffers[0]->height - 1;
-            global_terminal_width = event.w;
-            global_terminal_height = event.h;
-            
-            // Note(Luke): THIS IS NOT PERMANENT DON'T FORGET TO CHANGE THIS LATER WHEN YOU ALLOW MORE THAN 2 BUFFERS!!!
-            if(global_state_buffers[1])
+            int timeout = global_stat_pending || global_num_prefetches || global_flat_walks || global_tree_loads ? 10 : 100;
+            u64 now = monotonic_ms();
+            if(global_prefetch_armed) timeout = global_prefetch_at > now ? (int)(global_prefetch_at - now) + 1 : 1;
+            int event_type = tb_peek_event(&event, timeout);
+            poll_jobs();
+            poll_metadata();
+            poll_prefetches();
+            poll_tree();
+            if(poll_flat() && global_mode == SEARCH && results.query && results.listing == screen->listing)
             {
-                global_state_buffers[0]->width /= 2;
-
-                global_state_buffers[1]->x = global_state_buffers[0]->x * 2 + global_state_buffers[0]->width;
-                global_state_buffers[1]->y = global_state_buffers[0]->y;
-                global_state_buffers[1]->width = global_state_buffers[0]->width;
-                global_state_buffers[1]->height = global_state_buffers[0]->height;
-                global_state_buffers[1]->view_range_start = 0;
-                global_state_buffers[1]->view_range_end = global_state_buffers[1]->height;
+                // Rows a walk adds while searching are matched straight away, the selection stays if it can
+                u32 current = results.current_line;
+                clear_search_buffer_area(&results, 0);
+                exec_search(screen, &results, results.query);
+                if(current < results.view_range_end) results.current_line = current;
+                draw_search_overlay(screen, &results);
             }
-            tb_shutdown();
-            tb_init();
-            background(TB_BLACK);
-            update_screen(global_state_buffers[0]);
-            update_screen(global_state_buffers[1]);
-            
+            draw_job_status(screen);
+            if(event_type <= 0) continue;
+        }
+        else
+        {
+            tb_poll_event(&event);
+        }
+        if(global_message[0] && event.type == TB_EVENT_KEY)
+        {
+            global_message[0] = '\0';
+            draw_job_status(screen);
+        }
+        if(event.type == TB_EVENT_RESIZE)
+        {
+            // termbox only resizes its cell buffer on the next present, keeping the cells that still
+            // fit, so after that only the panes whose area changed need drawing again
+            tb_present();
+            global_terminal_width  = tb_width();
+            global_terminal_height = tb_height();
+            layout_tile(global_layout, 0, 0, global_terminal_width, global_terminal_height);
+            tb_present();
             continue;
         }
 
@@ -795,7 +6406,13 @@ int main()
         {
             case NORMAL:
             {
-                if((u8)event.ch == 'j')
+                // Flat and tree views' rows are paths, which yanking, moving and deleting by name can't take
+                if(screen->listing->flat && ((u8)event.ch == 'y' || (u8)event.ch == 'd' || (u8)event.ch == 'D'))
+                {
+                    draw_error(screen, "Can't do that in a flat or tree view");
+                }
+                // A flat view has no rows until its walk finds something, and might never
+                else if((u8)event.ch == 'j' && screen->num_lines)
                 {
                     screen->current_line = (screen->current_line + 1) % screen->num_lines;
                     if(screen->current_line >= screen->view_range_end) scroll(screen, 1);
@@ -805,7 +6422,7 @@ int main()
                         jump_to_line(screen, 0);
                     }
                 }
-                else if((u8)event.ch == 'k')
+                else if((u8)event.ch == 'k' && screen->num_lines)
                 {
                     if(screen->current_line == 0)
                     {
@@ -821,19 +6438,45 @@ int main()
                     }
                     if(screen->current_line < screen->view_range_start) scroll(screen, -1);
                 }
+                else if((u8)event.ch == 'h' && screen->tree)
+                {
+                    // Closes the directory the cursor is on, or goes up to the one it's in
+                    TreeView *tree = screen->tree;
+                    u32 line = screen->num_lines ? line_at(screen, screen->current_line) : 0;
+                    if(screen->num_lines && (tree->state[line] & TREE_OPEN))
+                    {
+                        tree_toggle(screen, screen->current_line);
+                    }
+                    else if(screen->num_lines && tree->parents[line] != TREE_ROOT)
+                    {
+                        jump_to_line(screen, tree_row(screen, tree->parents[line]));
+                    }
+                    else
+                    {
+                        // Past the top the tree starts again from the parent
+                        change_directory(screen, "..");
+                        start_tree_view(screen);
+                    }
+                    clear_normal_buffer_area(screen);
+                }
                 else if((u8)event.ch == 'h')
                 {
-                    pop_directory(screen->current_directory);
-                    string_cstring(screen->current_directory, global_path, global_path_size);
-                    load_directory(global_path, screen);
+                    change_directory(screen, "..");
+                }
+                else if(((u8)event.ch == 'l' || event.key == TB_KEY_ENTER) && screen->tree && screen->num_lines)
+                {
+                    tree_toggle(screen, screen->current_line);
+                    clear_normal_buffer_area(screen);
                 }
-                else if((u8)event.ch == 'l' || event.key == TB_KEY_ENTER)
+                else if(((u8)event.ch == 'l' || event.key == TB_KEY_ENTER) && screen->num_lines)
                 {
-                    if(screen->buffer[screen->current_line].is_dir)
+                    u32 line = line_at(screen, screen->current_line);
+                    u32 length = screen->listing->lengths[line];
+                    char name[NAME_MAX + 1];
+                    if((screen->listing->flags[line] & LINE_DIR) && length < sizeof(name))
                     {
-                        push_directory(screen->current_directory, screen->buffer[screen->current_line].text);
-                        string_cstring(screen->current_directory, global_path, global_path_size);
-                        load_directory(global_path, screen);
+                        memcpy(name, screen->listing->blob + screen->listing->offsets[line], length + 1);
+                        change_directory(screen, name);
                     }
                 }
                 else if(event.key == TB_KEY_CTRL_D)
@@ -846,84 +6489,89 @@ int main()
                 }
                 else if((u8)event.ch == 'D')
                 {
-                    push_directory(screen->current_directory, screen->buffer[screen->current_line].text);
-                    delete_file(screen->current_directory);
-                    pop_directory(screen->current_directory);
-                    string_cstring(screen->current_directory, global_path, global_path_size);
-                    load_directory(global_path, screen);
+                    if(global_trash_mode) trash_lines(screen, screen->current_line, screen->current_line + 1);
+                    else start_delete_job(screen, screen->current_line, screen->current_line + 1);
+                }
+                else if((u8)event.ch == 'u')
+                {
+                    restore_trash(screen);
+                }
+                else if((u8)event.ch == 'T')
+                {
+                    global_trash_mode = !global_trash_mode;
+                }
+                else if((u8)event.ch == 'a')
+                {
+                    global_copy_preserve = global_copy_preserve ? 0 : PRESERVE_ALL;
+                }
+                else if((u8)event.ch == 'L')
+                {
+                    global_mode = LIMIT;
+                }
+                else if((u8)event.ch == 'f')
+                {
+                    global_mode = JUMP;
+                }
+                else if((u8)event.ch == 'F')
+                {
+                    global_mode = FILTER;
+                }
+                else if((u8)event.ch == 'R')
+                {
+                    if(screen->walk) load_directory(screen);
+                    else start_flat_view(screen);
                     update_screen(screen);
                 }
-                else if((u8)event.ch == 'd')
+                else if((u8)event.ch == 't')
                 {
-                    operation.type = MOVE;
-                    operation.name = string_copy(screen->buffer[screen->current_line].text);
-                    operation.in_path = string_copy(screen->current_directory);
-                    operation.is_dir = screen->buffer[screen->current_line].is_dir;
-                    enqueue(op, operation);
+                    if(screen->tree) load_directory(screen);
+                    else start_tree_view(screen);
+                    update_screen(screen);
                 }
-                else if((u8)event.ch == 'y')
+                else if((u8)event.ch == 'o')
                 {
-                    operation.type = COPY;
-                    operation.name = string_copy(screen->buffer[screen->current_line].text);
-                    operation.in_path = string_copy(screen->current_directory);
-                    operation.is_dir = screen->buffer[screen->current_line].is_dir;
-                    enqueue(op, operation);
+                    screen->sort = (screen->sort + 1) % NUM_SORTS;
+                    resort_buffer(screen);
+                    update_screen(screen);
+                }
+                else if((u8)event.ch == 'm')
+                {
+                    global_show_metadata = !global_show_metadata;
+                    for(u32 i = 0; i < global_state_num_buffers; i++)
+                    {
+                        clear_normal_buffer_area(global_state_buffers[i]);
+                        update_screen(global_state_buffers[i]);
+                    }
+                }
+                else if((u8)event.ch == 'd' || (u8)event.ch == 'y')
+                {
+                    operation.dir = yank_dir(op, screen->dir_fd);
+                    if(operation.dir)
+                    {
+                        operation.type = (u8)event.ch == 'd' ? MOVE : COPY;
+                        operation.preserve = (u8)event.ch == 'd' ? PRESERVE_ALL : global_copy_preserve;
+                        u32 line = line_at(screen, screen->current_line);
+                        operation.name = name_intern(screen->listing->blob + screen->listing->offsets[line], screen->listing->lengths[line]);
+                        operation.in_path = slab_string(&global_path_slab, screen->current_directory);
+                        operation.is_dir = screen->listing->flags[line_at(screen, screen->current_line)] & LINE_DIR;
+                        enqueue(op, operation);
+                    }
+                    else
+                    {
+                        draw_error(screen, strerror(errno));
+                    }
                 }
                 else if((u8)event.ch == 'p')
                 {
                     if(op->size > 0)
                     {
                         operation = dequeue(op);
-                        if(operation.type == COPY)
-                        {
-                            operation.out_path = string_copy(screen->current_directory);
-                            push_directory(operation.in_path, operation.name);
-                            push_directory(operation.out_path, operation.name);
-
-                            copy_file(operation.in_path, operation.out_path);
-
-                            // Reload directory to see the results of the copy
-                            string_cstring(screen->current_directory, global_path, global_path_size);
-                            load_directory(global_path, screen);
-
-                            string_free(operation.name);
-                            string_free(operation.in_path);
-                            string_free(operation.out_path);
-                        }
-                        else if(operation.type == MOVE)
-                        {
-                            operation.out_path = string_copy(screen->current_directory);
-                            push_directory(operation.in_path, operation.name);
-                            push_directory(operation.out_path, operation.name);
-                            copy_file(operation.in_path, operation.out_path);
-                            delete_file(operation.in_path);
-                            string_cstring(screen->current_directory, global_path, global_path_size);
-                            load_directory(global_path, screen);
-
-                            // Reload directory of moved file if it is open in a buffer
-                            pop_directory(operation.in_path);
-                            if(string_equals(operation.in_path, global_state_buffers[0]->current_directory))
-                            {
-                                string_cstring(operation.in_path, global_path, global_path_size);
-                                load_directory(global_path, global_state_buffers[0]);
-                                update_screen(global_state_buffers[0]);
-                            }
-                            if(string_equals(operation.in_path, global_state_buffers[1]->current_directory))
-                            {
-                                string_cstring(operation.in_path, global_path, global_path_size);
-                                load_directory(global_path, global_state_buffers[1]);
-                                update_screen(global_state_buffers[1]);
-                            }
-
-                            string_free(operation.name);
-                            string_free(operation.in_path);
-                            string_free(operation.out_path);
-                        }
+                        start_paste_job(screen, &operation);
                     }
                 }
                 else if((u8)event.ch == 's')
                 {
-                    global_mode = SEARCH;
+                    if(!buffer_hidden(screen)) global_mode = SEARCH;
                 }
                 else if((u8)event.ch == 'i')
                 {
@@ -935,7 +6583,11 @@ int main()
                 }
                 else if((u8)event.ch == 'V')
                 {
-                    vertical_split(screen);
+                    split_buffer(screen, TILE_VERTICAL);
+                }
+                else if((u8)event.ch == 'H')
+                {
+                    split_buffer(screen, TILE_HORIZONTAL);
                 }
                 else if((u8)event.ch == 'w')
                 {
@@ -1016,7 +6668,15 @@ int main()
                     {
                         clear_search_buffer_area(&results, 0);
                     }
-                    jump_to_line(screen, results.buffer[results.current_line].original_line_number);
+                    // The match is a listing index, find its row in the buffer
+                    u32 row = 0;
+                    if(results.num_lines && results.listing == screen->listing)
+                    {
+                        u32 line = results.matches[results.current_line];
+                        while(row < screen->num_lines && line_at(screen, row) != line) row++;
+                        if(row == screen->num_lines) row = 0;
+                    }
+                    jump_to_line(screen, row);
                     global_mode = NORMAL;
                     update_screen(screen);
                 }
@@ -1066,10 +6726,14 @@ int main()
                 {
                     if(new_file_name && new_file_name->length > 0)
                     {
-                        push_directory(screen->current_directory, new_file_name);
-                        string_cstring(screen->current_directory, global_path, global_path_size);
-                        pop_directory(screen->current_directory);
-                        int new_fd = open(global_path, O_CREAT|O_EXCL, S_IRUSR + S_IWUSR);
+                        char name[NAME_MAX + 1];
+                        int new_fd = -1;
+                        errno = ENAMETOOLONG;
+                        if(new_file_name->length < sizeof(name))
+                        {
+                            string_cstring(new_file_name, name, sizeof(name));
+                            new_fd = openat(screen->dir_fd, name, O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC, S_IRUSR + S_IWUSR);
+                        }
                         if(new_fd >= 0)
                         {
                             close(new_fd);
@@ -1077,17 +6741,15 @@ int main()
                         else
                         {
                             //panic(strerror(errno));
-                            String *error = string_from(strerror(errno));
+                            String *error = arena_string(&global_frame_arena, strerror(errno));
                             clear_text(screen->x, screen->y + screen->height, new_file_name->length);
                             draw_text(error, screen->x, screen->y + screen->height);
                             tb_poll_event(&event);
                             clear_text(screen->x, screen->y + screen->height, error->length);
-                            string_free(error);
                         }
                         clear_text(screen->x, screen->y + screen-> height, new_file_name->length);
                         new_file_name->length = 0;
-                        string_cstring(screen->current_directory, global_path, global_path_size);
-                        load_directory(global_path, screen);
+                        reload_buffers(screen->listing->id);
                     }
                     global_mode = NORMAL;
                     update_screen(screen);
@@ -1103,6 +6765,113 @@ int main()
                 }
             } break;
 
+            case LIMIT:
+            {
+                if(((u8)event.ch >= 0x21 && (u8)event.ch <= 0x7E) || event.key == TB_KEY_SPACE)
+                {
+                    if(!limit_command)
+                    {
+                        limit_command = string_new(20);
+                    }
+                    string_push(limit_command, event.key == TB_KEY_SPACE ? ' ' : (u8)event.ch);
+                    draw_text(limit_command, screen->x, screen->y + screen->height);
+                }
+                else if(event.key == TB_KEY_BACKSPACE || event.key == TB_KEY_BACKSPACE2)
+                {
+                    if(limit_command && limit_command->length > 0)
+                    {
+                        string_pop(limit_command);
+                        tb_change_cell(screen->x + limit_command->length + TEXT_OFF, screen->y + screen->height, (u32)' ', TB_BLACK, TB_BLACK);
+                        tb_present();
+                    }
+                }
+                else if(event.key == TB_KEY_ENTER || event.key == TB_KEY_ESC)
+                {
+                    if(limit_command)
+                    {
+                        if(event.key == TB_KEY_ENTER) apply_limit_command(screen, limit_command);
+                        clear_text(screen->x, screen->y + screen->height, limit_command->length);
+                        limit_command->length = 0;
+                    }
+                    global_mode = NORMAL;
+                    update_screen(screen);
+                    draw_job_status(screen);
+                }
+            } break;
+
+            case FILTER:
+            {
+                if(((u8)event.ch >= 0x21 && (u8)event.ch <= 0x7E) || event.key == TB_KEY_SPACE)
+                {
+                    if(!filter_pattern)
+                    {
+                        filter_pattern = string_new(20);
+                    }
+                    string_push(filter_pattern, event.key == TB_KEY_SPACE ? ' ' : (u8)event.ch);
+                    draw_text(filter_pattern, screen->x, screen->y + screen->height);
+                }
+                else if(event.key == TB_KEY_BACKSPACE || event.key == TB_KEY_BACKSPACE2)
+                {
+                    if(filter_pattern && filter_pattern->length > 0)
+                    {
+                        string_pop(filter_pattern);
+                        tb_change_cell(screen->x + filter_pattern->length + TEXT_OFF, screen->y + screen->height, (u32)' ', TB_BLACK, TB_BLACK);
+                        tb_present();
+                    }
+                }
+                else if(event.key == TB_KEY_ENTER || event.key == TB_KEY_ESC)
+                {
+                    // Entering nothing takes the filter off
+                    if(!filter_pattern)
+                    {
+                        filter_pattern = string_new(20);
+                    }
+                    clear_text(screen->x, screen->y + screen->height, filter_pattern->length);
+                    global_mode = NORMAL;
+                    if(event.key == TB_KEY_ENTER) apply_filter(screen, filter_pattern);
+                    filter_pattern->length = 0;
+                    update_screen(screen);
+                    draw_job_status(screen);
+                }
+            } break;
+
+            case JUMP:
+            {
+                if(((u8)event.ch >= 0x21 && (u8)event.ch <= 0x7E) || event.key == TB_KEY_SPACE)
+                {
+                    if(!jump_prefix)
+                    {
+                        jump_prefix = string_new(20);
+                    }
+                    string_push(jump_prefix, event.key == TB_KEY_SPACE ? ' ' : (u8)event.ch);
+                    jump_to_prefix(screen, jump_prefix);
+                    update_screen(screen);
+                    draw_text(jump_prefix, screen->x, screen->y + screen->height);
+                }
+                else if(event.key == TB_KEY_BACKSPACE || event.key == TB_KEY_BACKSPACE2)
+                {
+                    if(jump_prefix && jump_prefix->length > 0)
+                    {
+                        string_pop(jump_prefix);
+                        tb_change_cell(screen->x + jump_prefix->length + TEXT_OFF, screen->y + screen->height, (u32)' ', TB_BLACK, TB_BLACK);
+                        if(jump_prefix->length > 0) jump_to_prefix(screen, jump_prefix);
+                        update_screen(screen);
+                        draw_text(jump_prefix, screen->x, screen->y + screen->height);
+                    }
+                }
+                else if(event.key == TB_KEY_ENTER || event.key == TB_KEY_ESC)
+                {
+                    if(jump_prefix)
+                    {
+                        clear_text(screen->x, screen->y + screen->height, jump_prefix->length);
+                        jump_prefix->length = 0;
+                    }
+                    global_mode = NORMAL;
+                    update_screen(screen);
+                    draw_job_status(screen);
+                }
+            } break;
+
             case VISUAL:
             {
                 if(new_visual)
@@ -1111,7 +6880,11 @@ int main()
                     visual_select_range_end = screen->current_line + 1;
                     new_visual = false;
                 }
-                if((u8)event.ch == 'j')
+                if(screen->listing->flat && ((u8)event.ch == 'y' || (u8)event.ch == 'D'))
+                {
+                    draw_error(screen, "Can't do that in a flat or tree view");
+                }
+                else if((u8)event.ch == 'j')
                 {
                     if(!(visual_select_range_start == screen->current_line && visual_select_range_end >= screen->num_lines))
                     {
@@ -1157,12 +6930,21 @@ int main()
                 }
                 else if((u8)event.ch == 'y')
                 {
+                    // The first line opens the directory, the rest share it
                     for(u32 i = visual_select_range_start; i < visual_select_range_end; i++)
                     {
+                        operation.dir = yank_dir(op, screen->dir_fd);
+                        if(!operation.dir)
+                        {
+                            draw_error(screen, strerror(errno));
+                            break;
+                        }
                         operation.type = COPY;
-                        operation.name = string_copy(screen->buffer[i].text);
-                        operation.in_path = string_copy(screen->current_directory);
-                        operation.is_dir = screen->buffer[i].is_dir;
+                        operation.preserve = global_copy_preserve;
+                        u32 line = line_at(screen, i);
+                        operation.name = name_intern(screen->listing->blob + screen->listing->offsets[line], screen->listing->lengths[line]);
+                        operation.in_path = slab_string(&global_path_slab, screen->current_directory);
+                        operation.is_dir = screen->listing->flags[line_at(screen, i)] & LINE_DIR;
                         enqueue(op, operation);
                     }
                     new_visual = true;
@@ -1171,15 +6953,8 @@ int main()
                 }
                 else if((u8)event.ch == 'D')
                 {
-                    for(u32 i = visual_select_range_start; i < visual_select_range_end; i++)
-                    {
-                        push_directory(screen->current_directory, screen->buffer[i].text);
-                        string_cstring(screen->current_directory, global_path, global_path_size);
-                        unlink(global_path);
-                        pop_directory(screen->current_directory);
-                    }
-                    string_cstring(screen->current_directory, global_path, global_path_size);
-                    load_directory(global_path, screen);
+                    if(global_trash_mode) trash_lines(screen, visual_select_range_start, visual_select_range_end);
+                    else start_delete_job(screen, visual_select_range_start, visual_select_range_end);
                     new_visual = true;
                     global_mode = NORMAL;
                     update_screen(screen);
@@ -1198,16 +6973,14 @@ int main()
     for(u32 k = 0; k < global_state_num_buffers; k++)
     {
         screen = global_state_buffers[k];
-        for(u32 i = 0; i < 100; i++)
-        {
-            if(screen->buffer[i].text) string_free(screen->buffer[i].text);
-        }
+        listing_release(screen->listing);
         string_free(screen->current_directory);
-        free(screen->buffer);
+        free(screen->order);
         free(screen);
     }
     free(global_state_buffers);
-    free(results.buffer);
+    listing_release(results.listing);
+    free(results.matches);
     if(results.query) string_free(results.query);
     if(new_file_name) string_free(new_file_name);
     if(op.name) string_free(op.name);
@@ -1215,5 +6988,29 @@ int main()
     if(op.out_path) string_free(op.out_path);
     */
     tb_shutdown();
+    pthread_mutex_lock(&global_trash_lock);
+    global_trash_purging = false;
+    pthread_cond_signal(&global_trash_wake);
+    pthread_mutex_unlock(&global_trash_lock);
+    pthread_join(purger, NULL);
+    // Walks only fill buffers, there's no point finishing them
+    for(u32 i = 0; i < global_state_num_buffers; i++)
+    {
+        stop_flat_view(global_state_buffers[i]);
+        usage_cancel(global_state_buffers[i]->listing);
+    }
+    for(Listing *listing = global_listing_newest; listing; listing = listing->older) usage_cancel(listing);
+    // Let background jobs finish rather than leave half deleted trees behind
+    for(u32 i = 0; i < NUM_PRIORITIES; i++)
+    {
+        pool_shutdown(&global_pools[i]);
+    }
+    // Everything has finished now, but poll_jobs can't run without the terminal
+    for(Job *job = global_jobs; job; job = job->next)
+    {
+        if(job->journal_id) journal_end(job->journal_id);
+    }
+    journal_flush();
+    write_stats();
     return 0;
 }